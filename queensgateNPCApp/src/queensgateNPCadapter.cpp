@@ -0,0 +1,45 @@
+#include <string.h>
+
+#include "queensgateNPCadapter.hpp"
+#include "queensgateNPCemulator.hpp"
+
+/** Creates the controller library object for a library path.
+  * \param[in] libPath Path and filename of the Queensgate library so/DLL,
+  *             or "emu:<options>" for the controller emulator
+  * \return controller library object, not initialised yet */
+QgateAdapter* QgateAdapter::create(const char* libPath) {
+    if(libPath != NULL && strncmp(libPath, QG_EMULATOR_PREFIX, strlen(QG_EMULATOR_PREFIX)) == 0) {
+        return new QgateEmulator();
+    }
+    return new QgateDllAdapter();
+}
+
+DllAdapterStatus QgateDllAdapter::Init(const std::string &libPath) {
+    return qg.Init(libPath);
+}
+
+DllAdapterStatus QgateDllAdapter::OpenSession(const std::string &port) {
+    return qg.OpenSession(port);
+}
+
+DllAdapterStatus QgateDllAdapter::CloseSession() {
+    return qg.CloseSession();
+}
+
+DllAdapterStatus QgateDllAdapter::DoCommand(const std::string &command,
+                                            std::list<std::string> &names,
+                                            std::list<std::string> &values) {
+    return qg.DoCommand(command, names, values);
+}
+
+int QgateDllAdapter::GetChannels() {
+    return qg.GetChannels();
+}
+
+void QgateDllAdapter::GetDllVersion(int &major, int &minor, int &build) {
+    qg.GetDllVersion(major, minor, build);
+}
+
+void QgateDllAdapter::GetErrorText(std::ostringstream &text, DllAdapterStatus status) {
+    qg.GetErrorText(text, status);
+}
@@ -0,0 +1,50 @@
+#ifndef QGATENPCadapter_H_
+#define QGATENPCadapter_H_
+
+#include <string>
+#include <list>
+#include <sstream>
+
+#include "dll_adapter.hpp"
+
+#define QG_EMULATOR_PREFIX  "emu:"      //Library path prefix selecting the controller emulator
+
+/* Controller library interface, as used by the driver.
+ * Implemented by the Queensgate DLL adapter (QgateDllAdapter) and by the
+ * in-tree controller emulator (QgateEmulator), selected by the library path
+ * given on qgateCtrlConfig: "emu:<options>" for the emulator, or the
+ * path to the controller_interface .so file otherwise.
+ */
+class QgateAdapter {
+public:
+    virtual ~QgateAdapter() {};
+    virtual DllAdapterStatus Init(const std::string &libPath) = 0;
+    virtual DllAdapterStatus OpenSession(const std::string &port) = 0;
+    virtual DllAdapterStatus CloseSession() = 0;
+    virtual DllAdapterStatus DoCommand(const std::string &command,
+                                        std::list<std::string> &names,
+                                        std::list<std::string> &values) = 0;
+    virtual int GetChannels() = 0;
+    virtual void GetDllVersion(int &major, int &minor, int &build) = 0;
+    virtual void GetErrorText(std::ostringstream &text, DllAdapterStatus status) = 0;
+public:
+    static QgateAdapter* create(const char* libPath);
+};
+
+//Queensgate controller library, loaded from the controller_interface .so file
+class QgateDllAdapter : public QgateAdapter {
+public:
+    virtual DllAdapterStatus Init(const std::string &libPath);
+    virtual DllAdapterStatus OpenSession(const std::string &port);
+    virtual DllAdapterStatus CloseSession();
+    virtual DllAdapterStatus DoCommand(const std::string &command,
+                                        std::list<std::string> &names,
+                                        std::list<std::string> &values);
+    virtual int GetChannels();
+    virtual void GetDllVersion(int &major, int &minor, int &build);
+    virtual void GetErrorText(std::ostringstream &text, DllAdapterStatus status);
+private:
+    DllAdapter qg;  //Queensgate adapter
+};
+
+#endif //QGATENPCadapter_H_
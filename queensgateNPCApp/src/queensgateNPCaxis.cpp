@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <math.h>
 #include <string>
 #include <sstream>
 
@@ -8,7 +9,7 @@
 
 #include "queensgateNPCaxis.hpp"
 
-#define QGATE_NUM_PARAMS 100
+#define QGATE_STOP_MARGIN   (1.5)   //Max age of the measured position taken as stop target, in poll intervals
 
 /** Driver object for stage (axis) control
   * \param[in] controller Controller object
@@ -25,12 +26,36 @@ QgateAxis::QgateAxis(QgateController &controller,
         , ctrler(controller)
         , qg(controller.getAdapter())
         , axisNum(axisNumber)
+        , axisCmd(axisNumber)
         , axis_name(axisName)
         , axis_mode(axisMode)
         , isSensor(axisType == AXISTYPE_SENSOR)
         , initialStatus(false)
         , connected(false)
-        , _pollCounter(SLOW_POLL_FREQ_CONST)
+        , lastConnected(false)
+        , _pollCounter(0)
+        , pollState(QGPOLL_DISCONNECTED)
+        , settleCounter(0)
+        , lastMoving(false)
+        , batchFields(0)
+        , batchScheduled(false)
+        , batchPolled(false)
+        , acquisition(NULL)
+        , flight(NULL)
+        , feedback(NULL)
+        , statsWindow(10.0)
+        , positionPublished(false)
+        , publishedPosition(0.0)
+        , positionStamped(false)
+        , latestKnown(false)
+        , latestPosition(0.0)
+        , latestUncertainty(0.0)
+        , moveTarget(0.0)
+        , moveStep(0.0)
+        , moveTimed(false)
+        , predicting(false)
+        , predictFrom(0.0)
+        , predictTo(0.0)
 {
     asynPrint(pasynUser_, ASYN_TRACE_FLOW, "creating QgateAxis %d '%s' %d\n", axisNumber, axisName, axisType);
 
@@ -39,24 +64,51 @@ QgateAxis::QgateAxis(QgateController &controller,
     setDoubleParam(ctrler.motorPowerOnDelay_, 0.0);
     setDoubleParam(ctrler.motorPowerOffDelay_, 0.0);
     setIntegerParam(ctrler.motorPowerAutoOnOff_, 0);
+    setIntegerParam(ctrler.QG_AxisPollState, pollState);
+    setDoubleParam(ctrler.QG_AxisStatsWindow, statsWindow);
+    setDoubleParam(ctrler.QG_AxisPosDeadband, 0.0);     //Every position change published
+    setDoubleParam(ctrler.QG_AxisPosUncertainty, 0.0);
+    setDoubleParam(ctrler.QG_AxisSettlePredicted, 0.0);
+    setDoubleParam(ctrler.QG_AxisSettleMeasured, 0.0);
+    epicsTimeGetCurrent(&publishedTime);
+    statusRefreshed = publishedTime;
+    //Last known stage model, until identified again
+    std::string stagePart;
+    if(ctrler.getStagePart(axisNumber, stagePart)) {
+        setStringParam(ctrler.QG_AxisModel, stagePart.c_str());
+    }
 
 }
 
-QgateAxis::~QgateAxis() {}
+QgateAxis::~QgateAxis() {
+    delete acquisition;
+    delete flight;
+    delete feedback;
+}
 
 /** Initialises the Axis and identifies the stage connected to it.
   * \return false if failed to initialise or communicate */
 bool QgateAxis::initAxis() {
     std::string value;
     bool result = false;
+    QgateStageIdentity identity;
     
     //EPICS is not in charge of the closed loop operation, it is the Queensgate controller,
     // but nevertheless it is defined a closed loop.
     setClosedLoop(true);
-    ctrler.deferredMove[axisNo_].clear();
-    result = getStatusConnected();
+    ctrler.cancelDeferredMove(axisNum);
+    if(ctrler.getStageIdentity(axisNum, identity)) {
+        //Stage just identified along with the controller: no need to ask again
+        updateStatusConnected(identity.connected);
+        result = connected;
+        value = identity.part;
+    } else {
+        result = getStatusConnected();
+        if(result) {
+            ctrler.getCmd(axisCmd[QGCMD_STAGE_PART], axisNum, value);
+        }
+    }
     if(result) {
-        ctrler.getCmd("identity.stage.part.get", axisNum, value);
         setStringParam(ctrler.QG_AxisModel, value.c_str());
         initialStatus = true;   //Specify initial moving query for first poll
     }
@@ -69,7 +121,7 @@ bool QgateAxis::initAxis() {
   * \return always asynsuccess as no fatal or urecoverable errors considered */
 asynStatus QgateAxis::poll(bool *moving) {
     bool result = false;
-    bool wasconnected = connected;
+    bool wasconnected = lastConnected;  //Connection status may be updated by the batched poll
 
     //Update initial status
     if(initialStatus) {
@@ -81,24 +133,55 @@ asynStatus QgateAxis::poll(bool *moving) {
     asynPrint(ctrler.pasynUserSelf, ASYN_TRACEIO_DRIVER, "Axis %d (%d) %s polling: %sconnected \tSTATUS=%d\n", 
                     axisNum, axisNo_, axis_name.c_str(), (connected)? "":"DIS", status_.status);
 
-    if(ctrler.connected) {
-        //fast poll
-        result |= getStatusConnected();
-        if(result) {
-            result |= getPosition();    
+    //Fields to poll on this cycle, unless already chosen for the batched poll
+    unsigned int fields = (batchScheduled)? batchFields : scheduleFields();
+    batchScheduled = false;
+    *moving = lastMoving;   //Unchanged if not polled on this cycle
+
+    //Stage connection already known when the controller just identified all its stages
+    QgateStageIdentity identity;
+    if(ctrler.getStageIdentity(axisNum, identity)) {
+        updateStatusConnected(identity.connected);
+        result = connected;
+        fields &= ~POLLFIELD_CONNECTED;
+    }
+
+    if(ctrler.connected && batchPolled) {
+        //Values already retrieved by the controller's batched poll
+        batchPolled = false;
+        result = connected;
+        if(fields & POLLFIELD_MOVING) {
+            checkMoving(*moving);
         }
-        //slow poll
-        if (_pollCounter++ % SLOW_POLL_FREQ_CONST == 0) {
-            result |= isStageDigital();
-            result |= getStatusMoving(*moving);
+    } else if(ctrler.connected) {
+        if(fields & POLLFIELD_CONNECTED) {
+            result |= getStatusConnected();
+        }
+        if(connected) {
+            if(fields & POLLFIELD_MODE) {
+                result |= isStageDigital();
+            }
+            if(fields & POLLFIELD_MOVING) {
+                result |= getStatusMoving(*moving);
+            }
+            //Position read last: no request (thus no unlocking) before its
+            // stamped callbacks, so no other thread publishes it meanwhile
+            if(fields & POLLFIELD_POSITION) {
+                result |= getPosition();
+            }
         }
     } else {
-        //Axis reconnection poll (slow)
+        //Controller down: no requests till it is reconnected (see QgateController::poll())
         *moving = false;
-        //Slow poll
-        if (_pollCounter++ % SLOW_POLL_FREQ_CONST == 0) {
-            result |= getStatusConnected();     //Update Axis status
-        }
+        updateStatusConnected(false);
+    }
+    //Position readback taken from the buffered acquisition when sampling,
+    // after any request of this poll as the position read from the controller
+    double position;
+    epicsTimeStamp sampled;
+    double uncertainty = 0.0;
+    if(acquisition && acquisition->getLatest(position, sampled, uncertainty)) {
+        updatePosition(position, &sampled, uncertainty);
     }
     //TODO: check !result and if != connected then failed after getStatusConnected()call
     //TODO: check !result and log it
@@ -112,21 +195,221 @@ asynStatus QgateAxis::poll(bool *moving) {
             initAxis();         //Been re-connected
         }
     }
-    callParamCallbacks();
+    lastConnected = connected;
+    lastMoving = *moving;
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+    //Move completed: learn its settle time, unless it was stopped or failed
+    if(moveTimed && !*moving) {
+        moveTimed = false;
+        predicting = false;
+        if(flight) {
+            flight->finish();
+        }
+        if(connected && !forceStop) {
+            double settleTime = epicsTimeDiffInSeconds(&now, &moveStart);
+            settleModel.learn(moveStep, settleTime);
+            setDoubleParam(ctrler.QG_AxisSettleMeasured, settleTime);
+        }
+    }
+    //Motor status sent again from time to time, even if unchanged
+    if(isRefreshDue(statusRefreshed, now)) {
+        statusRefreshed = now;
+        statusChanged_ = 1;
+    }
+    if(ctrler.shmExport != NULL) {
+        exportState(*moving);
+    }
+    if(positionStamped) {
+        //Callbacks stamped with the time the position was sampled
+        ctrler.setReadingTime(&positionSampled);
+        callParamCallbacks();
+        ctrler.setReadingTime(NULL);
+        positionStamped = false;
+    } else {
+        callParamCallbacks();
+    }
     return asynSuccess;   
 }
 
+/** Tells if a value unchanged (or within its deadband) is due to be published again.
+  * \param[in] published Time the value was last published
+  * \param[in] now Current time
+  * \return true if older than the maximum age (QG_CtrlPublishMaxAge) */
+bool QgateAxis::isRefreshDue(const epicsTimeStamp &published, const epicsTimeStamp &now) {
+    double maxAge = 0.0;
+    ctrler.getDoubleParam(ctrler.QG_CtrlPublishMaxAge, &maxAge);
+    return maxAge > 0.0 && epicsTimeDiffInSeconds(&now, &published) >= maxAge;
+}
+
+/** Chooses the fields to poll on this cycle from the axis polling state.
+  * Each state has its own poll divider, so axes are polled every so many
+  * cycles: moving axes get most of the link and idle ones only check in
+  * from time to time. Slow-changing fields (e.g. digital mode) are polled
+  * a further QG_PollDivSlow times less often.
+  * \return fields to poll (POLLFIELD bitmask), 0 when none on this cycle */
+unsigned int QgateAxis::scheduleFields() {
+    QgatePollState state = QGPOLL_IDLE;
+    unsigned int fastFields = POLLFIELD_CONNECTED | POLLFIELD_POSITION;
+    unsigned int slowFields = POLLFIELD_MODE | POLLFIELD_MOVING;
+
+    //Find out polling state from latest status
+    if(!connected || !ctrler.connected) {
+        state = QGPOLL_DISCONNECTED;
+        fastFields = POLLFIELD_CONNECTED;
+        slowFields = 0;
+    } else if(isSensor) {
+        state = QGPOLL_SENSOR;
+        fastFields = POLLFIELD_POSITION;
+        slowFields = POLLFIELD_CONNECTED | POLLFIELD_MODE;
+        if(acquisition && acquisition->isRunning()) {
+            fastFields = 0;     //Already sampled by the buffered acquisition
+        }
+    } else if(lastMoving) {
+        state = QGPOLL_MOVING;
+        settleCounter = ctrler.getPollParam(ctrler.QG_PollSettle);
+        fastFields = POLLFIELD_POSITION | POLLFIELD_MOVING;
+        slowFields = POLLFIELD_CONNECTED | POLLFIELD_MODE;
+    } else if(settleCounter > 0) {
+        state = QGPOLL_SETTLING;
+        settleCounter--;
+        fastFields = POLLFIELD_POSITION | POLLFIELD_MOVING;
+        slowFields = POLLFIELD_CONNECTED | POLLFIELD_MODE;
+    }
+    if(state != pollState) {
+        //Poll straight away on state change
+        pollState = state;
+        _pollCounter = 0;
+        setIntegerParam(ctrler.QG_AxisPollState, pollState);
+    }
+
+    unsigned int divider = ctrler.getPollParam(ctrler.QG_PollDivider[pollState]);
+    unsigned int slowDivider = divider * ctrler.getPollParam(ctrler.QG_PollDivSlow);
+    unsigned int fields = 0;
+    if(_pollCounter % divider == 0) {
+        fields |= fastFields;
+    }
+    if(_pollCounter % slowDivider == 0) {
+        fields |= slowFields;
+    }
+    _pollCounter++;
+
+    //Move completion predicted: moving status polled on every cycle around
+    // the expected time, waking up the poller for it, and not polled before
+    if(state == QGPOLL_MOVING && predicting) {
+        epicsTimeStamp now;
+        epicsTimeGetCurrent(&now);
+        double elapsed = epicsTimeDiffInSeconds(&now, &moveStart);
+        if(elapsed < predictFrom) {
+            fields &= ~POLLFIELD_MOVING;
+        } else if(elapsed <= predictTo) {
+            double period = 0.0;
+            ctrler.getDoubleParam(ctrler.QG_PollPredict, &period);
+            fields |= POLLFIELD_POSITION | POLLFIELD_MOVING;
+            ctrler.scheduleWakeup(period);
+        } else {
+            predicting = false;     //Not seen completed: back to the regular polling
+        }
+    }
+    return fields;
+}
+
+/** Adds the commands needed for this poll cycle to the controller's batched poll request.
+  * Fields are chosen by the poll scheduler, as in the individual poll.
+  * \param[in,out] request Multi-line controller request to append the commands to
+  * \return amount of reply values expected from the added commands */
+size_t QgateAxis::buildPollRequest(std::string &request) {
+    batchFields = 0;
+    batchPolled = false;
+    if(initialStatus) {
+        return 0;   //First run of the poll does not need any data
+    }
+    batchFields = scheduleFields();
+    batchScheduled = true;
+
+    size_t numReplies = 0;
+    if(batchFields & POLLFIELD_CONNECTED) {
+        numReplies += appendPollCmd(request, QGCMD_STAGE_CONNECTED);
+    }
+    if(batchFields & POLLFIELD_POSITION) {
+        numReplies += appendPollCmd(request, QGCMD_POS_MEASURED);
+    }
+    if(batchFields & POLLFIELD_MODE) {
+        numReplies += appendPollCmd(request, QGCMD_DIGITAL_MODE);
+    }
+    if(batchFields & POLLFIELD_MOVING) {
+        numReplies += appendPollCmd(request, QGCMD_STAGE_MOVING);
+        numReplies += appendPollCmd(request, QGCMD_INPOS_UNCONFIRMED);
+        numReplies += appendPollCmd(request, QGCMD_INPOS_LPF);
+        numReplies += appendPollCmd(request, QGCMD_INPOS_WINDOW);
+    }
+    return numReplies;
+}
+
+/** Adds an axis command as a new line of a multi-line controller request.
+  * \param[in,out] request Multi-line controller request
+  * \param[in] cmd Controller's command
+  * \return amount of reply values expected from the command */
+size_t QgateAxis::appendPollCmd(std::string &request, QgateCommand cmd) {
+    request.append(1, '\n');
+    request.append(axisCmd[cmd]);
+    return qgateCommandTable[cmd].numReplies;
+}
+
+/** Takes the values requested by buildPollRequest() from the controller's batched poll reply.
+  * \param[in] reply Controller's batched poll reply
+  * \param[in,out] index Position of this axis' first value on the reply. 
+  *                 Returns past the last value used by this axis. */
+void QgateAxis::processPollReply(const QgateReply &reply, size_t &index) {
+    int value = 0;
+    if(batchFields & POLLFIELD_CONNECTED) {
+        updateStatusConnected(reply.getInt(index++, value) && value);
+    }
+    if(batchFields & POLLFIELD_POSITION) {
+        double position;
+        if(reply.getDouble(index++, position)) {
+            epicsTimeStamp sampled;
+            double uncertainty = 0.0;
+            ctrler.getReplyTime(sampled, uncertainty);  //Batched poll just sent
+            updatePosition(position, &sampled, uncertainty);
+        }
+    }
+    if(batchFields & POLLFIELD_MODE) {
+        if(reply.getInt(index++, value)) {
+            setIntegerParam(ctrler.QG_AxisMode, value);
+        }
+    }
+    if(batchFields & POLLFIELD_MOVING) {
+        const int indexPV[] = {ctrler.QG_AxisMoving, ctrler.QG_AxisInPosUnconfirmed, 
+                                ctrler.QG_AxisInPosLPF, ctrler.QG_AxisInPosWindow};
+        for(size_t i=0; i<sizeof(indexPV)/sizeof(indexPV[0]); i++) {
+            if(reply.getInt(index++, value)) {
+                setIntegerParam(indexPV[i], value);
+            }
+        }
+    }
+    batchPolled = (batchFields != 0);
+}
+
 /** Updates the axis connection status
   * \return true if stage is connected */
 bool QgateAxis::getStatusConnected() {
     bool result = false;    //Default for when controller not connected
 
     if(ctrler.connected) {
-        std::string value;
-        if(ctrler.getCmd("stage.status.stage-connected.get", axisNum, value) == DLL_ADAPTER_STATUS_SUCCESS) {
-            result = atoi(value.c_str());
+        int value = 0;
+        if(ctrler.getCmd(axisCmd[QGCMD_STAGE_CONNECTED], axisNum, value) == DLL_ADAPTER_STATUS_SUCCESS) {
+            result = value;
         }
     }
+    updateStatusConnected(result);
+    return connected;
+}
+
+/** Sets the axis connection status
+  * \param[in] stageConnected Stage connection status reported by the controller */
+void QgateAxis::updateStatusConnected(bool stageConnected) {
+    bool result = stageConnected;
     if(result != connected) {
         //Update axis status on change
         connected = result;
@@ -139,29 +422,27 @@ bool QgateAxis::getStatusConnected() {
         //Update status of related PVs
         setIntegerParam(ctrler.QG_AxisConnected, connected);
     }
-    return connected;
 }
 
 /** Tells if an axis is configured for digital or analogue mode in the Controller
   * \return true if stage is configured for digital mode */
 bool QgateAxis::isStageDigital() {
-    std::string value;
-    if(ctrler.getCmd("stage.mode.digital-command.get", axisNum, value) == DLL_ADAPTER_STATUS_SUCCESS) {
-        setIntegerParam(ctrler.QG_AxisMode, atoi(value.c_str()));
+    int value = 0;
+    if(ctrler.getCmd(axisCmd[QGCMD_DIGITAL_MODE], axisNum, value) == DLL_ADAPTER_STATUS_SUCCESS) {
+        setIntegerParam(ctrler.QG_AxisMode, value);
         return true;
     }
     return false;
 }
 
 /** Updates the value of a given axis-related PV.
-  * \param[in] sCmd Controller's command string
+  * \param[in] cmd Controller's command
   * \param[in] indexPV Index of the PV to update
   * \return false if communication fails */
-bool QgateAxis::updateAxisPV(std::string sCmd, int indexPV) {
+bool QgateAxis::updateAxisPV(QgateCommand cmd, int indexPV) {
     bool result = false;   //Assume feedback from controller failed
-    std::string sValue;
-    if(ctrler.getCmd(sCmd, axisNum, sValue) == DLL_ADAPTER_STATUS_SUCCESS) {
-        int value = atoi(sValue.c_str());
+    int value = 0;
+    if(ctrler.getCmd(axisCmd[cmd], axisNum, value) == DLL_ADAPTER_STATUS_SUCCESS) {
         result = true;      //success getting position status
         setIntegerParam(indexPV, value);
     }
@@ -172,20 +453,29 @@ bool QgateAxis::updateAxisPV(std::string sCmd, int indexPV) {
   * \param[out] moving Returns here the motor moving status as configured. True if stage is moving.
   * \return false when comms or command failed  */
 bool QgateAxis::getStatusMoving(bool &moving) {
-    bool result = false;    //Assume feedback from controller failed
+    bool result = true;     //Sensors: assume successful comms
+    
+    if(!isSensor) {
+        //Update moving/in-position status
+        result = updateAxisPV(QGCMD_STAGE_MOVING, ctrler.QG_AxisMoving);
+        result |= updateAxisPV(QGCMD_INPOS_UNCONFIRMED, ctrler.QG_AxisInPosUnconfirmed);
+        result |= updateAxisPV(QGCMD_INPOS_LPF, ctrler.QG_AxisInPosLPF);
+        result |= updateAxisPV(QGCMD_INPOS_WINDOW, ctrler.QG_AxisInPosWindow);
+    }
+    checkMoving(moving, result);
+    return result;
+}
+
+/** Sets the moving status from the latest moving/in-position values, as configured by the axis mode.
+  * \param[out] moving Returns here the motor moving status as configured. True if stage is moving.
+  * \param[in] validStatus false when the moving/in-position values could not be retrieved */
+void QgateAxis::checkMoving(bool &moving, bool validStatus) {
     epicsInt32 inPos = 0;   //Assume not in position
     
     if(isSensor) {
         moving = false;     //Sensor never have indication of being moved
-        result = true;      //Assume successful comms
     } else {
-        //Update moving/in-position status
-        result = updateAxisPV("stage.status.stage-moving.get", ctrler.QG_AxisMoving);
-        result |= updateAxisPV("stage.status.in-position.unconfirmed.get", ctrler.QG_AxisInPosUnconfirmed);
-        result |= updateAxisPV("stage.status.in-position.lpf-confirmed.get", ctrler.QG_AxisInPosLPF);
-        result |= updateAxisPV("stage.status.in-position.window-filter-confirmed.get", ctrler.QG_AxisInPosWindow);
-
-        if(!result) {
+        if(!validStatus) {
             moving = false;     //comms failure
         } else {
             //Set moving indication
@@ -224,29 +514,251 @@ bool QgateAxis::getStatusMoving(bool &moving) {
     //Update Motor Record status
     setIntegerParam(ctrler.motorStatusDone_, !moving);
     setIntegerParam(ctrler.motorStatusMoving_, moving);
-
-    return result;
 }
 
 /** Update axis position readback.
   * \return false when comms failed  */
 bool QgateAxis::getPosition() {
-    std::string value;
-    if(ctrler.getCmd("stage.position.measured.get", axisNum, value) != DLL_ADAPTER_STATUS_SUCCESS) {
+    double position;
+    if(ctrler.getCmd(axisCmd[QGCMD_POS_MEASURED], axisNum, position) != DLL_ADAPTER_STATUS_SUCCESS) {
         return false;
     }
+    epicsTimeStamp sampled;
+    double uncertainty = 0.0;
+    ctrler.getReplyTime(sampled, uncertainty);
+    updatePosition(position, &sampled, uncertainty);
+    return true;
+}
+
+/** Writes the axis state on the controller's shared memory export.
+  * \param[in] moving Moving status reported on this poll */
+void QgateAxis::exportState(bool moving) {
+    unsigned int flags = 0;
+    if(connected && ctrler.connected) {
+        flags |= QGATE_SHM_CONNECTED;
+    }
+    if(moving) {
+        flags |= QGATE_SHM_MOVING;
+    }
+    if(isSensor) {
+        flags |= QGATE_SHM_SENSOR;
+    }
+    if(latestKnown) {
+        flags |= QGATE_SHM_VALID;
+    }
+    ctrler.shmExport->update(axisNo_, flags, latestPosition, latestSampled, latestUncertainty);
+}
+
+/** Sets the axis position readback.
+  * \param[in] position Measured position as reported by the controller (picometres)
+  * \param[in] sampled Time the position was sampled, NULL if not known (taken as now)
+  * \param[in] uncertainty Uncertainty of the sampling time (secs) */
+void QgateAxis::updatePosition(double position, const epicsTimeStamp *sampled, double uncertainty) {
     // TODO: this probably should rely on configured units 
     //Report position
-    double positionMicrons = PM_TO_MICRONS(atof(value.c_str()));
-    double position = atof(value.c_str());
+    double positionMicrons = PM_TO_MICRONS(position);
     asynPrint(pasynUser_, ASYN_TRACEIO_DEVICE, "Queensgate %s Axis %d measured pos=%lf microns (%lf pm)\n", 
                 ctrler.nameCtrl.c_str(), axisNum, positionMicrons, position);
 
+    //Keep the sample for the position statistics
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+    positionStats.add(position, (sampled != NULL)? *sampled : now);
+    latestKnown = true;
+    latestPosition = position;
+    latestSampled = (sampled != NULL)? *sampled : now;
+    latestUncertainty = uncertainty;
+
+    //Motor record readback always up to date, so it sees the final position when done
     setDoubleParam(ctrler.motorEncoderPosition_, position);
     setDoubleParam(ctrler.motorPosition_, position);
+    if(sampled != NULL) {
+        positionStamped = true;
+        positionSampled = *sampled;
+    }
+
+    //Position readback only published when it moves beyond the deadband, or it gets too old
+    double deadband = 0.0;
+    ctrler.getDoubleParam(axisNo_, ctrler.QG_AxisPosDeadband, &deadband);
+    if(positionPublished && fabs(position - publishedPosition) < deadband 
+            && !isRefreshDue(publishedTime, now)) {
+        return;
+    }
+    setDoubleParam(ctrler.QG_AxisPos, position);
+    if(sampled != NULL) {
+        setDoubleParam(ctrler.QG_AxisPosUncertainty, uncertainty * 1.0e3);
+    }
+    positionPublished = true;
+    publishedPosition = position;
+    publishedTime = now;
+}
+
+/** Computes the position statistics over the configured window and publishes them.
+  * Called from the controller's statistics thread, without the lock taken. */
+void QgateAxis::updateStats() {
+    QgatePositionStatsResult stats;
+    positionStats.update(statsWindow, stats);
+
+    TakeLock takeLock(&ctrler);     //Parameter callbacks done when released
+    setDoubleParam(ctrler.QG_AxisPosMean, stats.mean);
+    setDoubleParam(ctrler.QG_AxisPosStdDev, stats.stddev);
+    setDoubleParam(ctrler.QG_AxisPosMin, stats.min);
+    setDoubleParam(ctrler.QG_AxisPosMax, stats.max);
+    setDoubleParam(ctrler.QG_AxisPosP2P, stats.peakToPeak);
+    setIntegerParam(ctrler.QG_AxisStatsSamples, (int)stats.numSamples);
+    //Window change applies from the next update
+    ctrler.getDoubleParam(axisNo_, ctrler.QG_AxisStatsWindow, &statsWindow);
+}
+
+/** Tells if the axis can be moved by a profile: a connected stage, not a sensor */
+bool QgateAxis::isProfileMovable() {
+    return connected && !isSensor;
+}
+
+/** Copies the position table of the profile, so it can be executed without the lock taken.
+  * Must be called with the lock taken.
+  * \param[out] positions Position table (picometres)
+  * \param[in] numPoints Amount of profile points */
+void QgateAxis::getProfilePositions(std::vector<double> &positions, size_t numPoints) {
+    if(profilePositions_ == NULL) {
+        positions.assign(numPoints, 0.0);     //Profile not initialised
+    } else {
+        positions.assign(profilePositions_, profilePositions_ + numPoints);
+    }
+}
+
+/** Adds the stop of the stage to a multi-line controller request, for stopping
+  * several axes at once. Any deferred move of the axis is discarded.
+  * Called with the controller lock taken.
+  * \param[in,out] request Multi-line controller request
+  * \return false if there is nothing to stop (e.g. sensor or not connected) */
+bool QgateAxis::appendStop(std::string &request) {
+    stopFeedback();
+    ctrler.cancelDeferredMove(axisNum);
+    if(!connected || isSensor) {
+        return false;
+    }
+    //Re-command the axis to move to its latest measured position, as in stop()
+    double newPosition;
+    if(!getStopPosition(newPosition)) {
+        return false;
+    }
+    forceStop = true;
+    appendMove(request, newPosition);
+    asynPrint(pasynUser_, ASYN_TRACEIO_FILTER, ":::::STOP axis %s-%d at raw pos %lf\n", ctrler.nameCtrl.c_str(), axisNum, newPosition);
+    return true;
+}
+
+/** Gets the position to stop the stage at: its latest measured position.
+  * Taken from the last poll while within the axis' current poll interval, so
+  * stopping (even all the stages) takes a single request; otherwise it is
+  * measured first, at the cost of a round trip. A moving stage thus stops up
+  * to a poll interval behind where it is, and settles back there.
+  * Called with the controller lock taken.
+  * \param[out] position Position to stop at (picometres)
+  * \return false if the position is not known */
+bool QgateAxis::getStopPosition(double &position) {
+    //Position polled every so many cycles of the poller (see scheduleFields())
+    double period = (lastMoving)? ctrler.movingPollPeriod_ : ctrler.idlePollPeriod_;
+    double maxAge = QGATE_STOP_MARGIN * period * ctrler.getPollParam(ctrler.QG_PollDivider[pollState]);
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+    if(!latestKnown || epicsTimeDiffInSeconds(&now, &latestSampled) > maxAge) {
+        if(!getPosition()) {
+            return false;
+        }
+    }
+    position = latestPosition;
     return true;
 }
 
+/** Adds an absolute move as a new line of a multi-line controller request.
+  * \param[in,out] request Multi-line controller request
+  * \param[in] position Absolute position to move to (picometres) */
+void QgateAxis::appendMove(std::string &request, double position) {
+    char valueStr[QG_VALUE_STRLEN];
+    snprintf(valueStr, QG_VALUE_STRLEN, " %f", position);
+    request.append(1, '\n');
+    request.append(axisCmd[QGCMD_POS_ABSOLUTE_SET]);
+    request.append(valueStr);
+}
+
+/** Adds the commands to check if the axis reached its position, as the axis mode
+  * configures it, followed by its measured position. Sensors only add the position.
+  * \param[in,out] request Multi-line controller request
+  * \return amount of reply values expected from the commands */
+size_t QgateAxis::buildInPositionRequest(std::string &request) {
+    size_t numReplies = 0;
+    if(!isSensor) {
+        switch(axis_mode) {
+            case AXISMODE_NATIVE:
+                numReplies += appendPollCmd(request, QGCMD_STAGE_MOVING);
+                break;
+            case AXISMODE_UNCONFIRMED:
+                numReplies += appendPollCmd(request, QGCMD_INPOS_UNCONFIRMED);
+                break;
+            case AXISMODE_WINDOW:
+                numReplies += appendPollCmd(request, QGCMD_INPOS_WINDOW);
+                break;
+            case AXISMODE_LPF:
+                numReplies += appendPollCmd(request, QGCMD_INPOS_LPF);
+                break;
+            case AXISMODE_BOTH:
+                numReplies += appendPollCmd(request, QGCMD_INPOS_WINDOW);
+                numReplies += appendPollCmd(request, QGCMD_INPOS_LPF);
+                break;
+        }
+    }
+    numReplies += appendPollCmd(request, QGCMD_POS_MEASURED);
+    return numReplies;
+}
+
+/** Takes the values requested by buildInPositionRequest() from the controller's reply.
+  * \param[in] reply Controller's reply
+  * \param[in,out] index Position of this axis' first value on the reply.
+  *                 Returns past the last value used by this axis.
+  * \param[out] inPosition true if the stage reached its position, always true for sensors
+  * \param[out] position Measured position (picometres)
+  * \return false if the reply could not be decoded */
+bool QgateAxis::processInPositionReply(const QgateReply &reply, size_t &index, bool &inPosition, double &position) {
+    int value = 0, value2 = 0;
+    bool valid = true;
+    inPosition = true;
+    if(!isSensor) {
+        switch(axis_mode) {
+            case AXISMODE_NATIVE:
+                valid = reply.getInt(index++, value);
+                inPosition = !value;
+                break;
+            case AXISMODE_UNCONFIRMED:
+            case AXISMODE_WINDOW:
+            case AXISMODE_LPF:
+                valid = reply.getInt(index++, value);
+                inPosition = value;
+                break;
+            case AXISMODE_BOTH:
+                valid = reply.getInt(index++, value);
+                valid &= reply.getInt(index++, value2);
+                inPosition = value && value2;
+                break;
+        }
+    }
+    valid &= reply.getDouble(index++, position);
+    return valid;
+}
+
+/** Stores the position captured at a profile point, for the profile readback.
+  * Must be called with the lock taken.
+  * \param[in] point Profile point [0..n-1]
+  * \param[in] position Measured position (picometres) */
+void QgateAxis::setProfileReadback(size_t point, double position) {
+    if(profileReadbacks_ == NULL || profileFollowingErrors_ == NULL || profilePositions_ == NULL) {
+        return;     //Profile not initialised
+    }
+    profileReadbacks_[point] = position;
+    profileFollowingErrors_[point] = position - profilePositions_[point];
+}
+
 /** Move the stage to an absolute location or by a relative amount.
   * \param[in] position  The absolute position to move to (if relative=0) or the relative distance to move 
   * by (if relative=1). Units=microns.
@@ -268,29 +780,26 @@ asynStatus QgateAxis::move(double position, int relative,
         asynPrint(ctrler.pasynUserSelf, ASYN_TRACEIO_DEVICE, ":::::MOVE axis %s-%d denied: is a sensor\n", ctrler.nameCtrl.c_str(), axisNum);
         return asynError;   //Refuse moving on Sensors
     }
+    if(feedback && feedback->isEnabled()) {
+        asynPrint(ctrler.pasynUserSelf, ASYN_TRACEIO_DEVICE, ":::::MOVE axis %s-%d denied: feedback enabled\n", ctrler.nameCtrl.c_str(), axisNum);
+        return asynError;   //Stage commanded by its feedback loop
+    }
 
-    // Start the move
-	TakeLock takeLock(&ctrler, /*alreadyTaken=*/true);
-    FreeLock freeLock(takeLock);
+    moveTarget = position;
 
+    // Start the move: queued for the I/O thread, outcome reported to moveCompleted()
     //Note: NPC controller have pre-configured movement parameters (e.g. velocity, accel)
-    if(ctrler.moveCmd("stage.position.absolute-command.set", axisNum, position) != DLL_ADAPTER_STATUS_SUCCESS) {
-        connected = false;
-        ctrler.setIntegerParam(axisNo_, ctrler.motorStatusCommsError_, !connected);
-        
+    bool deferred = false;
+    if(ctrler.moveCmd(axisCmd[QGCMD_POS_ABSOLUTE_SET], axisNum, position, deferred) != DLL_ADAPTER_STATUS_SUCCESS) {
+        moveCompleted(false, true);
         return asynError;
-    } else {
-        //Start of movement: not in position
-        setIntegerParam(ctrler.motorStatusDone_, 0);
-        setIntegerParam(ctrler.QG_AxisInPosUnconfirmed, 0);
-        setIntegerParam(ctrler.QG_AxisInPosWindow, 0);
-        setIntegerParam(ctrler.QG_AxisInPosLPF, 0);
-        forceStop = false;  //Cancel any previous stop request
+    } else if(!deferred) {
+        moveStarted();  //Deferred moves started when their group is flushed
     }
 
     //TODO: implement and test relative move
     // if(relative) {
-    //     if(ctrler.moveCmd("stage.position.command.set", axisNum, position) != DLL_ADAPTER_STATUS_SUCCESS) {
+    //     if(ctrler.moveCmd(axisCmd[QGCMD_POS_RELATIVE_SET], axisNum, position) != DLL_ADAPTER_STATUS_SUCCESS) {
     //     connected = false;
     //     ctrler.setIntegerParam(axisNo_, ctrler.motorStatusCommsError_, !connected);
     //     return asynError;
@@ -302,11 +811,183 @@ asynStatus QgateAxis::move(double position, int relative,
     return asynSuccess;
 }
 
+/** Sets the axis status for the start of a movement, so it is polled as
+  * moving straight away instead of waiting for its next scheduled poll.
+  * Called with the controller lock taken, when a move is requested, and
+  * again when a deferred move is sent. */
+void QgateAxis::moveStarted() {
+    //Start of movement: not in position
+    setIntegerParam(ctrler.motorStatusDone_, 0);
+    setIntegerParam(ctrler.motorStatusProblem_, !connected);  //Clears a previous move failure
+    setIntegerParam(ctrler.QG_AxisInPosUnconfirmed, 0);
+    setIntegerParam(ctrler.QG_AxisInPosWindow, 0);
+    setIntegerParam(ctrler.QG_AxisInPosLPF, 0);
+    lastMoving = true;  //Poll as moving till the controller reports otherwise
+    forceStop = false;  //Cancel any previous stop request
+
+    //Time the move, and predict when it completes from the moves of similar size
+    double position = 0.0;
+    double period = 0.0;
+    double predicted = 0.0;
+    double deviation = 0.0;
+    ctrler.getDoubleParam(axisNo_, ctrler.motorPosition_, &position);
+    ctrler.getDoubleParam(ctrler.QG_PollPredict, &period);
+    moveStep = fabs(moveTarget - position);
+    moveTimed = true;
+    epicsTimeGetCurrent(&moveStart);
+    int capture = 0;
+    ctrler.getIntegerParam(axisNo_, ctrler.QG_AxisFlight, &capture);
+    if(flight && capture) {
+        flight->start(moveStart);   //Trace of the move till completed
+    }
+    predicting = (period > 0.0 && settleModel.predict(moveStep, predicted, deviation));
+    if(predicting) {
+        double margin = (2.0 * deviation > 2.0 * period)? 2.0 * deviation : 2.0 * period;
+        predictFrom = predicted - margin;
+        predictTo = predicted + margin;
+        setDoubleParam(ctrler.QG_AxisSettlePredicted, predicted);
+        ctrler.scheduleWakeup((predictFrom > 0.0)? predictFrom : 0.0);
+    }
+}
+
+/** Forgets the settle times learned, e.g. after changing the stage tuning.
+  * Called with the controller lock taken. */
+void QgateAxis::resetSettle() {
+    settleModel.reset();
+    predicting = false;
+    setDoubleParam(ctrler.QG_AxisSettlePredicted, 0.0);
+    setDoubleParam(ctrler.QG_AxisSettleMeasured, 0.0);
+    callParamCallbacks();
+}
+
+/** Updates the axis status once the controller has processed a move request.
+  * A failed move never started, so the status set by moveStarted() is undone
+  * straight away instead of waiting for a poll to read the moving status.
+  * Called with the controller lock taken.
+  * \param[in] success false when the controller failed to take the move
+  * \param[in] commsError true when failed to communicate, rather than refused by the controller */
+void QgateAxis::moveCompleted(bool success, bool commsError) {
+    if(success) {
+        return;
+    }
+    setIntegerParam(ctrler.motorStatusDone_, 1);
+    setIntegerParam(ctrler.motorStatusMoving_, 0);
+    setIntegerParam(ctrler.motorStatusProblem_, 1);
+    lastMoving = false;
+    moveTimed = false;  //Nothing to learn from
+    predicting = false;
+    if(commsError) {
+        updateStatusConnected(false);
+    }
+    callParamCallbacks();
+}
+
+/** Configures the feedback loop commanding this stage from a sensor, disabled.
+  * \param[in] sensorController Controller of the sensor, may be this one
+  * \param[in] sensorAxisNumber Sensor axis number [1..n]
+  * \param[in] period Loop period (secs)
+  * \return false if a sensor or already configured */
+bool QgateAxis::configFeedback(QgateController &sensorController, int sensorAxisNumber, double period) {
+    if(isSensor || feedback != NULL) {
+        return false;
+    }
+    feedback = new QgateFeedback(ctrler, axisNum, sensorController, sensorAxisNumber, period);
+    setIntegerParam(ctrler.QG_AxisFbEnable, 0);
+    setDoubleParam(ctrler.QG_AxisFbSetpoint, 0.0);
+    setDoubleParam(ctrler.QG_AxisFbKp, 0.0);
+    setDoubleParam(ctrler.QG_AxisFbKi, 0.0);
+    setDoubleParam(ctrler.QG_AxisFbKd, 0.0);
+    setDoubleParam(ctrler.QG_AxisFbOutLow, 0.0);
+    setDoubleParam(ctrler.QG_AxisFbOutHigh, 0.0);
+    setDoubleParam(ctrler.QG_AxisFbError, 0.0);
+    setDoubleParam(ctrler.QG_AxisFbOutput, 0.0);
+    setDoubleParam(ctrler.QG_AxisFbRate, 0.0);
+    setIntegerParam(ctrler.QG_AxisFbOverruns, 0);
+    setIntegerParam(ctrler.QG_AxisFbFaults, 0);
+    return true;
+}
+
+/** Passes the feedback parameters to the loop. Called with the controller lock taken.
+  * \return false if not configured, or enabled with an empty output range or no stage connected */
+bool QgateAxis::updateFeedback() {
+    if(feedback == NULL) {
+        return false;
+    }
+    QgateFeedbackSettings settings;
+    int enable = 0;
+    ctrler.getIntegerParam(axisNo_, ctrler.QG_AxisFbEnable, &enable);
+    ctrler.getDoubleParam(axisNo_, ctrler.QG_AxisFbSetpoint, &settings.setpoint);
+    ctrler.getDoubleParam(axisNo_, ctrler.QG_AxisFbKp, &settings.kp);
+    ctrler.getDoubleParam(axisNo_, ctrler.QG_AxisFbKi, &settings.ki);
+    ctrler.getDoubleParam(axisNo_, ctrler.QG_AxisFbKd, &settings.kd);
+    ctrler.getDoubleParam(axisNo_, ctrler.QG_AxisFbOutLow, &settings.outLow);
+    ctrler.getDoubleParam(axisNo_, ctrler.QG_AxisFbOutHigh, &settings.outHigh);
+    bool valid = (settings.outLow < settings.outHigh);
+    settings.enable = (enable != 0) && valid && connected;
+    feedback->configure(settings);
+    return settings.enable || !enable;
+}
+
+/** Opens the feedback loop, if closed, so it does not undo a stop.
+  * Called with the controller lock taken. */
+void QgateAxis::stopFeedback() {
+    if(feedback == NULL || !feedback->disable()) {
+        return;
+    }
+    asynPrint(pasynUser_, ASYN_TRACEIO_FILTER, ":::::STOP axis %s-%d feedback disabled\n", ctrler.nameCtrl.c_str(), axisNum);
+    setIntegerParam(ctrler.QG_AxisFbEnable, 0);
+    callParamCallbacks();
+}
+
+/** Configures the buffered acquisition of a sensor axis.
+  * \param[in] blockSize Amount of samples published at once
+  * \param[in] bufferSize Amount of samples kept on the ring buffer
+  * \return false if not a sensor or already configured */
+bool QgateAxis::configAcquisition(size_t blockSize, size_t bufferSize) {
+    if(!isSensor || acquisition != NULL) {
+        return false;
+    }
+    acquisition = new QgateSensorAcq(ctrler, axisNum, blockSize, bufferSize);
+    setIntegerParam(ctrler.QG_AxisAcq, 0);
+    setIntegerParam(ctrler.QG_AxisAcqCount, 0);
+    setDoubleParam(ctrler.QG_AxisAcqMean, 0.0);
+    setDoubleParam(ctrler.QG_AxisAcqRate, 0.0);
+    return true;
+}
+
+/** Configures the flight capture of a stage axis.
+  * \param[in] maxSamples Maximum amount of samples of a move trace
+  * \return false if a sensor or already configured */
+bool QgateAxis::configFlightCapture(size_t maxSamples) {
+    if(isSensor || flight != NULL) {
+        return false;
+    }
+    flight = new QgateFlightCapture(ctrler, axisNum, maxSamples);
+    setIntegerParam(ctrler.QG_AxisFlight, 0);
+    setIntegerParam(ctrler.QG_AxisFlightCount, 0);
+    setDoubleParam(ctrler.QG_AxisFlightRate, 0.0);
+    return true;
+}
+
+/** Starts or stops the buffered acquisition.
+  * \param[in] enable true to start sampling
+  * \return false if the buffered acquisition is not configured */
+bool QgateAxis::setAcquisition(bool enable) {
+    if(acquisition == NULL) {
+        asynPrint(pasynUser_, ASYN_TRACE_ERROR, "Queensgate %s Axis %d: buffered acquisition not configured\n", 
+                    ctrler.nameCtrl.c_str(), axisNum);
+        return false;
+    }
+    acquisition->setRunning(enable);
+    return true;
+}
+
 /** Command the stage to stop.
   * \param[in] acceleration The acceleration value for the stop operation. Units=steps/sec/sec. [IGNORED in this method]
   * \return error if failed to communicate */
  asynStatus QgateAxis::stop(double acceleration) {
     asynStatus status = asynError;
+    stopFeedback();
     if(!connected) {
         // If axis not connected to a stage, ignore
         return asynSuccess;
@@ -315,23 +996,20 @@ asynStatus QgateAxis::move(double position, int relative,
         return asynError;   //Refuse moving-related commands on Sensors
     }
     //clear axis' pending deferred command
-    if(ctrler.deferringMode) {
-        ctrler.deferredMove[axisNo_].clear();
+    if(ctrler.cancelDeferredMove(axisNum)) {
         return asynSuccess;
     }
 
-    // Start the stop procedure: Re-command the axis to move to the current position
-	TakeLock takeLock(&ctrler, /*alreadyTaken=*/true);
-    FreeLock freeLock(takeLock);
-    forceStop = true;
+    // Start the stop procedure: Re-command the axis to move to its latest measured position.
     double newPosition;
-    if(!getPosition()) {
+    if(!getStopPosition(newPosition)) {
         asynPrint(pasynUser_, ASYN_TRACEIO_DEVICE, ":::::STOP axis %s-%d ignoring stop command\n", ctrler.nameCtrl.c_str(), axisNum);
         return asynSuccess;
     }
-    ctrler.getDoubleParam(axisNo_, ctrler.motorPosition_, &newPosition);
+    forceStop = true;
     //Note: NPC controller have pre-configured movement parameters (e.g. velocity, accel)
-    if(ctrler.moveCmd("stage.position.absolute-command.set", axisNum, newPosition) != DLL_ADAPTER_STATUS_SUCCESS) {
+    bool deferred = false;
+    if(ctrler.moveCmd(axisCmd[QGCMD_POS_ABSOLUTE_SET], axisNum, newPosition, deferred) != DLL_ADAPTER_STATUS_SUCCESS) {
         status = asynError;
     }       
     else {
@@ -7,6 +7,11 @@
 #include <asynMotorAxis.h>
 
 #include "queensgateNPCcontroller.hpp"
+#include "queensgateNPCsensor.hpp"
+#include "queensgateNPCflight.hpp"
+#include "queensgateNPCfeedback.hpp"
+#include "queensgateNPCstats.hpp"
+#include "queensgateNPCsettle.hpp"
 
 class QgateAxis : public asynMotorAxis 
 {
@@ -36,12 +41,45 @@ public:
     virtual asynStatus move(double position, int relative,
             double minVelocity, double maxVelocity, double acceleration);
     virtual asynStatus stop(double acceleration);
+    bool appendStop(std::string &request);
+    // Batched polling
+    size_t buildPollRequest(std::string &request);
+    void processPollReply(const QgateReply &reply, size_t &index);
+    // Asynchronous moves
+    void moveStarted();
+    void moveCompleted(bool success, bool commsError);
+    void resetSettle();
+    // Sensor buffered acquisition
+    bool configAcquisition(size_t blockSize, size_t bufferSize);
+    bool setAcquisition(bool enable);
+    // Flight capture
+    bool configFlightCapture(size_t maxSamples);
+    // Closed-loop feedback
+    bool configFeedback(QgateController &sensorController, int sensorAxisNumber, double period);
+    bool updateFeedback();
+    void stopFeedback();
+    // Position statistics
+    void updateStats();
+    // Profile moves
+    bool isProfileMovable();
+    void getProfilePositions(std::vector<double> &positions, size_t numPoints);
+    void appendMove(std::string &request, double position);
+    size_t buildInPositionRequest(std::string &request);
+    bool processInPositionReply(const QgateReply &reply, size_t &index, bool &inPosition, double &position);
+    void setProfileReadback(size_t point, double position);
+private:
+    enum POLLFIELD {
+        POLLFIELD_CONNECTED = 0x01,
+        POLLFIELD_POSITION = 0x02,
+        POLLFIELD_MODE = 0x04,
+        POLLFIELD_MOVING = 0x08
+    };
 private:
-    static const int SLOW_POLL_FREQ_CONST=8;
     QgateController& ctrler;
-    DllAdapter& qg;  //Queensgate adapter
+    QgateAdapter& qg;  //Controller library
     unsigned int axisNum;    //Axis number for DLL [1..n]
                         //Note that it differs from asynMotorAxis::axisNo_ that is the axis index [0..n-1]
+    const QgateCommandSet axisCmd;  //Controller commands for this axis
     std::string axis_name;  //name of the stage
     std::string axis_model; //(Reported) model of the stage
     unsigned int axis_mode; //In-position mode to be used
@@ -49,16 +87,54 @@ private:
     //Status attributes
     bool initialStatus;     //Initial status, before first polling
     bool connected;         //Axis connected status
+    bool lastConnected;     //Axis connected status on the previous poll
     bool forceStop;         //Stop status was forced
-    unsigned int _pollCounter;  //Iteration counter for slow polling
+    unsigned int _pollCounter;  //Poll cycles since the polling state changed
+    QgatePollState pollState;   //Polling state, as chosen by the poll scheduler
+    int settleCounter;          //Polls left considered settling after moving
+    bool lastMoving;            //Moving status reported on the previous poll
+    unsigned int batchFields;   //Fields requested on the batched poll (POLLFIELD bitmask)
+    bool batchScheduled;        //Fields for this poll cycle already chosen by buildPollRequest()
+    bool batchPolled;           //Fields already updated by the controller's batched poll
+    QgateSensorAcq *acquisition;    //Buffered acquisition, when configured
+    QgateFlightCapture *flight;     //Flight capture, when configured
+    QgateFeedback *feedback;        //Feedback loop commanding this stage, when configured
+    QgatePositionStats positionStats;   //Fed on each position update
+    double statsWindow;         //Statistics window length (secs), only used by the statistics thread
+    bool positionPublished;     //Position readback published at least once
+    double publishedPosition;   //Position readback last published (picometres)
+    epicsTimeStamp publishedTime;   //Time the position readback was last published
+    epicsTimeStamp statusRefreshed; //Time the whole motor status was last sent
+    bool positionStamped;       //Position readback published on this poll with the time it was sampled
+    epicsTimeStamp positionSampled; //Time the position readback was sampled
+    bool latestKnown;           //Position measured at least once, for stopping and the shared memory export
+    double latestPosition;      //Latest position measured (picometres), even within the deadband
+    epicsTimeStamp latestSampled;   //Time the latest position was sampled
+    double latestUncertainty;   //Uncertainty of the latest sampling time (secs)
+    QgateSettleModel settleModel;   //Settle times learned from past moves
+    double moveTarget;          //Position of the last move requested (picometres)
+    double moveStep;            //Step size of the move being timed (picometres)
+    bool moveTimed;             //Move being timed, to learn its settle time once completed
+    epicsTimeStamp moveStart;   //Time the move being timed was started
+    bool predicting;            //Completion predicted: moving status polled around that time only
+    double predictFrom;         //Time window the completion is expected in, since the move start (secs)
+    double predictTo;
     
 private:
     bool initAxis();
     bool getStatusConnected();
+    void updateStatusConnected(bool stageConnected);
     bool getStatusMoving(bool &moving);
+    void checkMoving(bool &moving, bool validStatus=true);
     bool isStageDigital();
     bool getPosition();
-    bool updateAxisPV(std::string sCmd, int indexPV);
+    bool getStopPosition(double &position);
+    void updatePosition(double position, const epicsTimeStamp *sampled=NULL, double uncertainty=0.0);
+    bool isRefreshDue(const epicsTimeStamp &published, const epicsTimeStamp &now);
+    void exportState(bool moving);
+    bool updateAxisPV(QgateCommand cmd, int indexPV);
+    unsigned int scheduleFields();
+    size_t appendPollCmd(std::string &request, QgateCommand cmd);
 };
 
 #endif //ONCE
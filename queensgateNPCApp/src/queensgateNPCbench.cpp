@@ -0,0 +1,408 @@
+/* queensgateNPCbench.cpp
+ * Poll cycle scaling benchmark.
+ * Runs N controllers with M axes each against the controller emulator,
+ * driving the driver's real poll(), move() and setDeferredMoves() code from
+ * one poller thread and one mover thread per controller, as the motor
+ * poller and the motor records would. Reports the poll cycle latency,
+ * controller traffic, CPU per poll and the time the port lock is held, to
+ * find where an IOC saturates before adding more stages to it.
+ *
+ * Usage: queensgateNPCBench [-c <controllers>[,<controllers>...]] [-a <axes>]
+ *              [-p <poll rate Hz>] [-m <move rate Hz>] [-d] [-s <workers>] [-t <secs>] [-e <emulator options>]
+ *   -c  Amount of controllers. A comma-separated list runs one test for each (default 1)
+ *   -a  Axes on each controller (default 3)
+ *   -p  Poll rate of each controller, in Hz (default 20)
+ *   -m  Moves commanded on each controller per second, on all its axes (default 1, 0 for none)
+ *   -d  Command the moves deferred, flushed as a single request (default individual moves)
+ *   -s  Serve all controllers from a shared I/O pool of this many workers (default a thread per controller)
+ *   -t  Duration of each test, in seconds (default 10)
+ *   -e  Emulator options, as in queensgateNPCemulator.hpp (default "latency=0.002")
+ * e.g. 10 controllers x 3 channels at 20 Hz:  queensgateNPCBench -c 1,2,5,10 -a 3 -p 20
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <algorithm>
+
+#include <epicsThread.h>
+#include <epicsEvent.h>
+#include <epicsTime.h>
+#include <epicsExit.h>
+
+#include "queensgateNPCcontroller.hpp"
+#include "queensgateNPCaxis.hpp"
+#include "queensgateNPCemulator.hpp"
+#include "queensgateNPCpool.hpp"
+
+#define BENCH_WARMUP        (1.0)       //Time to let controllers connect before measuring (secs)
+#define BENCH_PARK_PERIOD   (1.0e6)     //Motor poller period: kept out of the way of the benchmark poller (secs)
+#define BENCH_MOVE_STEP     (1.0e6)     //Move amplitude (pm)
+
+//Benchmark test configuration
+struct BenchConfig {
+    int numAxes;
+    double pollRate;
+    double moveRate;
+    bool deferred;
+    int ioWorkers;
+    double duration;
+    std::string emuOptions;
+};
+
+//Controller instrumented for the benchmark
+class BenchController : public QgateController {
+public:
+    BenchController(const char *portName, const BenchConfig &config, const char *libPath);
+    /* overridden methods: measure the port lock hold time */
+    virtual asynStatus lock();
+    virtual asynStatus unlock();
+    void start();
+    void stop();
+    void pollThread();
+    void moveThread();
+    bool getCounters(size_t &requests, size_t &lines);
+public:
+    /* Measurements, not to be read until stopped */
+    std::vector<double> pollCycles;     //Poll cycle durations (secs)
+    std::vector<double> moveTimes;      //Move command durations (secs)
+    std::vector<double> lockHolds;      //Port lock hold durations (secs)
+    size_t overruns;                    //Poll cycles not started on time
+private:
+    const BenchConfig &cfg;
+    int lockDepth;
+    epicsTimeStamp lockTaken;
+    bool measuring;
+    bool exiting;
+    epicsEvent pollExitEvent;
+    epicsEvent moveExitEvent;
+};
+
+static void pollThreadC(void *pPvt) {
+    ((BenchController*)pPvt)->pollThread();
+}
+
+static void moveThreadC(void *pPvt) {
+    ((BenchController*)pPvt)->moveThread();
+}
+
+/** Creates a controller and its axes on the emulator
+  * \param[in] portName The asyn name
+  * \param[in] config Benchmark test configuration
+  * \param[in] libPath Emulator library path */
+BenchController::BenchController(const char *portName, const BenchConfig &config, const char *libPath)
+    : QgateController(portName, "", config.numAxes, BENCH_PARK_PERIOD, BENCH_PARK_PERIOD, libPath, 
+                        NULL, (config.ioWorkers > 0))
+    , overruns(0)
+    , cfg(config)
+    , lockDepth(0)
+    , measuring(false)
+    , exiting(false)
+{
+    for(int i=1; i<=config.numAxes; i++) {
+        std::ostringstream name;
+        name << portName << "_AX" << i;
+        new QgateAxis(*this, i, name.str().c_str());
+    }
+}
+
+asynStatus BenchController::lock() {
+    asynStatus status = QgateController::lock();
+    if(lockDepth++ == 0) {
+        epicsTimeGetCurrent(&lockTaken);
+    }
+    return status;
+}
+
+asynStatus BenchController::unlock() {
+    if(--lockDepth == 0 && measuring) {
+        epicsTimeStamp now;
+        epicsTimeGetCurrent(&now);
+        lockHolds.push_back(epicsTimeDiffInSeconds(&now, &lockTaken));
+    }
+    return QgateController::unlock();
+}
+
+/** Starts measuring, after discarding the start-up polls */
+void BenchController::start() {
+    lock();
+    pollCycles.clear();
+    moveTimes.clear();
+    lockHolds.clear();
+    overruns = 0;
+    measuring = true;
+    unlock();
+    epicsThreadCreate((nameCtrl + "_BPOLL").c_str(),
+                    epicsThreadPriorityMedium,
+                    epicsThreadGetStackSize(epicsThreadStackMedium),
+                    (EPICSTHREADFUNC)pollThreadC, this);
+    if(cfg.moveRate > 0.0) {
+        epicsThreadCreate((nameCtrl + "_BMOVE").c_str(),
+                        epicsThreadPriorityMedium,
+                        epicsThreadGetStackSize(epicsThreadStackMedium),
+                        (EPICSTHREADFUNC)moveThreadC, this);
+    } else {
+        moveExitEvent.signal();
+    }
+}
+
+/** Stops the benchmark threads and the measurements */
+void BenchController::stop() {
+    exiting = true;
+    pollExitEvent.wait();
+    moveExitEvent.wait();
+    lock();
+    measuring = false;
+    unlock();
+}
+
+/** Polls the controller at the configured rate, as the motor poller does:
+  * controller and then all its axes, holding the port lock */
+void BenchController::pollThread() {
+    double period = 1.0 / cfg.pollRate;
+    epicsTimeStamp next, start, end;
+    bool moving;
+
+    epicsTimeGetCurrent(&next);
+    while(!exiting) {
+        epicsTimeGetCurrent(&start);
+        lock();
+        poll();
+        for(int i=0; i<numAxes_; i++) {
+            QgateAxis* pAxis = getQgateAxis(i);
+            if(pAxis) {
+                pAxis->poll(&moving);
+            }
+        }
+        unlock();
+        epicsTimeGetCurrent(&end);
+        pollCycles.push_back(epicsTimeDiffInSeconds(&end, &start));
+
+        epicsTimeAddSeconds(&next, period);
+        double wait = epicsTimeDiffInSeconds(&next, &end);
+        if(wait > 0.0) {
+            epicsThreadSleep(wait);
+        } else {
+            overruns++;
+            next = end;     //Late: do not try catching up
+        }
+    }
+    pollExitEvent.signal();
+}
+
+/** Moves all the axes back and forth at the configured rate, as the motor records would */
+void BenchController::moveThread() {
+    double period = 1.0 / cfg.moveRate;
+    double target = 0.0;
+    epicsTimeStamp start, end;
+
+    while(!exiting) {
+        target = (target == 0.0)? BENCH_MOVE_STEP : 0.0;
+        epicsTimeGetCurrent(&start);
+        lock();
+        if(cfg.deferred) {
+            setDeferredMoves(true);
+        }
+        for(int i=0; i<numAxes_; i++) {
+            QgateAxis* pAxis = getQgateAxis(i);
+            if(pAxis) {
+                pAxis->move(target, 0, 0.0, 0.0, 0.0);
+            }
+        }
+        if(cfg.deferred) {
+            setDeferredMoves(false);
+        }
+        unlock();
+        epicsTimeGetCurrent(&end);
+        moveTimes.push_back(epicsTimeDiffInSeconds(&end, &start));
+        epicsThreadSleep(period);
+    }
+    moveExitEvent.signal();
+}
+
+/** Retrieves the traffic received by the emulator
+  * \param[out] requests Requests received so far
+  * \param[out] lines Command lines received so far
+  * \return false if not running on the emulator */
+bool BenchController::getCounters(size_t &requests, size_t &lines) {
+    QgateEmulator *emulator = dynamic_cast<QgateEmulator*>(&getAdapter());
+    if(emulator == NULL) {
+        return false;
+    }
+    emulator->getCounters(requests, lines);
+    return true;
+}
+
+//Percentile of a sorted list of samples
+static double percentile(const std::vector<double> &sorted, double fraction) {
+    if(sorted.empty()) {
+        return 0.0;
+    }
+    return sorted[(size_t)(fraction * (sorted.size() - 1) + 0.5)];
+}
+
+//Prints the percentiles of a list of durations, in milliseconds
+static void printTimes(const char *title, std::vector<double> &samples) {
+    double total = 0.0;
+    std::sort(samples.begin(), samples.end());
+    for(size_t i=0; i<samples.size(); i++) {
+        total += samples[i];
+    }
+    printf("  %-16s n=%-8lu mean=%8.3f p50=%8.3f p90=%8.3f p99=%8.3f max=%8.3f ms\n",
+            title, (unsigned long)samples.size(),
+            (samples.empty())? 0.0 : total * 1.0e3 / samples.size(),
+            percentile(samples, 0.50) * 1.0e3, percentile(samples, 0.90) * 1.0e3,
+            percentile(samples, 0.99) * 1.0e3, (samples.empty())? 0.0 : samples.back() * 1.0e3);
+}
+
+/** Runs one benchmark test
+  * \param[in] testNum Test number, used for naming the ports
+  * \param[in] numControllers Amount of controllers
+  * \param[in] cfg Test configuration */
+static void runTest(int testNum, int numControllers, const BenchConfig &cfg) {
+    std::vector<BenchController*> controllers;
+    std::vector<double> pollCycles, moveTimes, lockHolds;
+    size_t overruns = 0, requests = 0, lines = 0;
+    double lockBusy = 0.0;
+
+    std::ostringstream libPath;
+    libPath << QG_EMULATOR_PREFIX << "channels=" << cfg.numAxes << ",stages=" << cfg.numAxes;
+    if(!cfg.emuOptions.empty()) {
+        libPath << "," << cfg.emuOptions;
+    }
+    for(int i=0; i<numControllers; i++) {
+        std::ostringstream portName;
+        portName << "BENCH" << testNum << "_" << i;
+        controllers.push_back(new BenchController(portName.str().c_str(), cfg, libPath.str().c_str()));
+    }
+    epicsThreadSleep(BENCH_WARMUP);
+
+    //Traffic counters before the test
+    std::vector<size_t> startRequests(numControllers), startLines(numControllers);
+    for(int i=0; i<numControllers; i++) {
+        controllers[i]->getCounters(startRequests[i], startLines[i]);
+    }
+    epicsTimeStamp start, end;
+    clock_t cpuStart = clock();
+    epicsTimeGetCurrent(&start);
+    for(int i=0; i<numControllers; i++) {
+        controllers[i]->start();
+    }
+    epicsThreadSleep(cfg.duration);
+    for(int i=0; i<numControllers; i++) {
+        controllers[i]->stop();
+    }
+    epicsTimeGetCurrent(&end);
+    clock_t cpuEnd = clock();
+    double elapsed = epicsTimeDiffInSeconds(&end, &start);
+    double cpu = (double)(cpuEnd - cpuStart) / CLOCKS_PER_SEC;
+
+    for(int i=0; i<numControllers; i++) {
+        BenchController &ctrl = *controllers[i];
+        size_t ctrlRequests = 0, ctrlLines = 0;
+        pollCycles.insert(pollCycles.end(), ctrl.pollCycles.begin(), ctrl.pollCycles.end());
+        moveTimes.insert(moveTimes.end(), ctrl.moveTimes.begin(), ctrl.moveTimes.end());
+        lockHolds.insert(lockHolds.end(), ctrl.lockHolds.begin(), ctrl.lockHolds.end());
+        for(size_t j=0; j<ctrl.lockHolds.size(); j++) {
+            lockBusy += ctrl.lockHolds[j];
+        }
+        overruns += ctrl.overruns;
+        if(ctrl.getCounters(ctrlRequests, ctrlLines)) {
+            requests += ctrlRequests - startRequests[i];
+            lines += ctrlLines - startLines[i];
+        }
+    }
+
+    printf("\n%d controller(s) x %d axes, poll %.1f Hz, %s moves %.1f Hz, %.1f secs, emulator '%s'\n",
+            numControllers, cfg.numAxes, cfg.pollRate, (cfg.deferred)? "deferred" : "individual",
+            cfg.moveRate, elapsed, libPath.str().c_str());
+    if(cfg.ioWorkers > 0) {
+        printf("  shared I/O pool of %d workers\n", cfg.ioWorkers);
+    }
+    printTimes("poll cycle", pollCycles);
+    printTimes("move", moveTimes);
+    printTimes("lock hold", lockHolds);
+    printf("  poll rate        %.2f Hz per controller (%.1f requested), %lu overruns (%.1f%%)\n",
+            pollCycles.size() / elapsed / numControllers, cfg.pollRate, (unsigned long)overruns,
+            (pollCycles.empty())? 0.0 : 100.0 * overruns / pollCycles.size());
+    printf("  traffic          %.1f requests/s, %.1f commands/s\n", requests / elapsed, lines / elapsed);
+    printf("  CPU              %.1f%% of one core, %.1f us per poll cycle\n",
+            100.0 * cpu / elapsed, (pollCycles.empty())? 0.0 : cpu * 1.0e6 / pollCycles.size());
+    printf("  port lock busy   %.1f%% per controller\n", 100.0 * lockBusy / elapsed / numControllers);
+    //Controllers are left idle: the motor controller has no way to remove its port
+}
+
+static void usage() {
+    printf("Usage: queensgateNPCBench [-c <controllers>[,<controllers>...]] [-a <axes>]\n"
+           "            [-p <poll rate Hz>] [-m <move rate Hz>] [-d] [-s <workers>] [-t <secs>] [-e <emulator options>]\n");
+}
+
+int main(int argc, char *argv[]) {
+    BenchConfig cfg;
+    std::vector<int> numControllers;
+    std::string controllerList("1");
+
+    cfg.numAxes = 3;
+    cfg.pollRate = 20.0;
+    cfg.moveRate = 1.0;
+    cfg.deferred = false;
+    cfg.ioWorkers = 0;
+    cfg.duration = 10.0;
+    cfg.emuOptions = "latency=0.002";
+    for(int i=1; i<argc; i++) {
+        const char *arg = argv[i];
+        const char *value = (i + 1 < argc)? argv[i + 1] : NULL;
+        if(strcmp(arg, "-d") == 0) {
+            cfg.deferred = true;
+            continue;
+        }
+        if(value == NULL) {
+            usage();
+            return 1;
+        }
+        if(strcmp(arg, "-c") == 0) {
+            controllerList = value;
+        } else if(strcmp(arg, "-a") == 0) {
+            cfg.numAxes = atoi(value);
+        } else if(strcmp(arg, "-p") == 0) {
+            cfg.pollRate = atof(value);
+        } else if(strcmp(arg, "-m") == 0) {
+            cfg.moveRate = atof(value);
+        } else if(strcmp(arg, "-s") == 0) {
+            cfg.ioWorkers = atoi(value);
+        } else if(strcmp(arg, "-t") == 0) {
+            cfg.duration = atof(value);
+        } else if(strcmp(arg, "-e") == 0) {
+            cfg.emuOptions = value;
+        } else {
+            usage();
+            return 1;
+        }
+        i++;
+    }
+    std::istringstream list(controllerList);
+    std::string item;
+    while(std::getline(list, item, ',')) {
+        int amount = atoi(item.c_str());
+        if(amount > 0) {
+            numControllers.push_back(amount);
+        }
+    }
+    if(numControllers.empty() || cfg.numAxes < 1 || cfg.pollRate <= 0.0 || cfg.moveRate < 0.0 || cfg.duration <= 0.0) {
+        usage();
+        return 1;
+    }
+
+    if(cfg.ioWorkers > 0) {
+        QgateIOPool::configure(cfg.ioWorkers);
+    }
+    for(size_t i=0; i<numControllers.size(); i++) {
+        runTest(i, numControllers[i], cfg);
+    }
+    epicsExit(0);
+    return 0;
+}
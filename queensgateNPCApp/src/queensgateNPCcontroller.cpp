@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 #include <string>
 #include <sstream>
 
@@ -7,32 +8,66 @@
 #include <asynOctetSyncIO.h>
 
 #include "queensgateNPCcontroller.hpp"
+#include "queensgateNPCaxis.hpp"
+#include "queensgateNPCpool.hpp"
+#include "queensgateNPCprofile.hpp"
 
-#define QGATE_NUM_PARAMS 100
+#define QGATE_RETRY_JITTER (0.2)    //Reconnection backoff randomised by up to this fraction
+#define QGATE_WATCHDOG_PERIOD (0.1) //Time between checks of the request deadline (secs)
+#define QGATE_NUM_PARAMS (100 + 2 * QG_MAX_MOVE_GROUPS)
 
 const char *driverName = "queensgateNPC";
 
-/** Gets a DoCommand list's content from its position.
-  * \param[in] position position in the list.
-  * \return List string content at that position */
-std::string QGList::find(const int position) {
-    int pos=0;
-    for(QGList::iterator it=this->begin(); it!=this->end(); ++it, ++pos) {
-        if(pos==position) {
-            return *it;
-        }
-    }
-    return "Not Found";
-} 
+static void statsThreadC(void *pPvt) {
+    QgateController *pController = (QgateController*)pPvt;
+    pController->statsThread();
+}
+
+static void timeStampSourceC(void *userPvt, epicsTimeStamp *pTimeStamp) {
+    QgateController *pController = (QgateController*)userPvt;
+    pController->getReadingTime(pTimeStamp);
+}
 
-/** Gets a DoCommand's full list of contents.
-  * \return string containing all values separated by commas */
-std::string QGList::print() {
-    std::ostringstream qgList;
-    for(QGList::iterator it=this->begin(); it!=this->end(); ++it) {
-        qgList << *it << ",";
+static void watchdogThreadC(void *pPvt) {
+    QgateController *pController = (QgateController*)pPvt;
+    pController->watchdogThread();
+}
+
+/* Controller command table, indexed by QgateCommand */
+const QgateCommandDef qgateCommandTable[QGCMD_NUM] = {
+    {"controller.status.get",                                   3},
+    {"identity.hardware.part.get",                              1},
+    {"identity.hardware.serial.get",                            1},
+    {"identity.software.version.get",                           1},
+    {"controller.security.user.get",                            1},
+    {"controller.security.user.set " QG_SECURITY_USER_CODE,     1},
+    {"stage.status.stage-connected.get",                        1},
+    {"identity.stage.part.get",                                 1},
+    {"stage.position.absolute-command.get",                     1},
+    {"stage.position.absolute-command.set",                     1},
+    {"stage.position.command.get",                              1},
+    {"stage.position.command.set",                              1},
+    {"stage.position.measured.get",                             1},
+    {"stage.status.in-position.unconfirmed.get",                1},
+    {"stage.status.in-position.lpf-confirmed.get",              1},
+    {"stage.status.in-position.window-filter-confirmed.get",    1},
+    {"stage.status.stage-moving.get",                           1},
+    {"stage.mode.digital-command.get",                          1}
+};
+
+/** Renders all the controller commands for an axis, so they do not need to be composed on each request.
+  * \param[in] axisNum Axis stage number [1..n], 0 for commands addressed to the controller itself */
+QgateCommandSet::QgateCommandSet(int axisNum) {
+    char axisStr[QG_VALUE_STRLEN] = "";
+    if(axisNum > 0) {
+        //Axis 0 is the controller itself and does not need this parameter on the string to send
+        snprintf(axisStr, QG_VALUE_STRLEN, " %d", axisNum);
+    }
+    for(int i=0; i<QGCMD_NUM; i++) {
+        cmds[i].reserve(strlen(qgateCommandTable[i].cmd) + strlen(axisStr) + QG_VALUE_STRLEN);
+        cmds[i].assign(qgateCommandTable[i].cmd);
+        cmds[i].append(axisStr);
     }
-    return qgList.str();
 }
 
 /** Driver object for communication with the controller
@@ -41,29 +76,51 @@ std::string QGList::print() {
   * \param[in] numAxes Number of configured axes
   * \param[in] movingPollPeriod The time in secs between polls when any axis is moving.
   * \param[in] idlePollPeriod The time in secs between polls when no axis is moving.
-  * \param[in] libraryPath The number of times to force the movingPollPeriod after waking up the poller.   */
+  * \param[in] libraryPath Path and filename of the Queensgate Library so/DLL, or "emu:<options>" for the controller emulator
+  * \param[in] identityCache Directory of the identity cache files, NULL or empty for no cache
+  * \param[in] sharedIO Served by the shared I/O pool (see QgateIOPool) instead of its own I/O thread */
 QgateController::QgateController(const char *portName, 
                                 const char* portAddress,
                                 const int maxNumAxes, 
                                 double movingPollPeriod, 
                                 double idlePollPeriod,
-                                const char* libraryPath)
+                                const char* libraryPath,
+                                const char* identityCache,
+                                bool sharedIO)
     : asynMotorController(portName, 
             maxNumAxes,
             QGATE_NUM_PARAMS,
-            asynFloat64Mask | asynInt32Mask | asynOctetMask | asynDrvUserMask, /* Interface mask */
-            asynFloat64Mask | asynInt32Mask | asynOctetMask, /* Interrupt mask */
+            asynFloat64Mask | asynInt32Mask | asynOctetMask | asynFloat64ArrayMask | asynDrvUserMask, /* Interface mask */
+            asynFloat64Mask | asynInt32Mask | asynOctetMask | asynFloat64ArrayMask, /* Interrupt mask */
             ASYN_MULTIDEVICE | ASYN_CANBLOCK, /* asynFlags */
             1, /* Autoconnect */
             0, /* Default priority */
             0) /* Default stack size */
+    , qg(*QgateAdapter::create(libraryPath))
+    , latency(QGCMD_NUMTYPES)
+    , ioQueue(qg, latency, portName)
     , numAxes(maxNumAxes)
     , maxAxes(QgateController::NOAXIS)
     , portDevice(portAddress)
+    , ctrlCmd(0)
+    , ioBusyTime(0.0)
+    , securityCheckForced(true)
+    , securityEnforced(0)
+    , replyUncertainty(0.0)
+    , readingTimeSet(false)
+    , retryDelay(0.0)
+    , statsExiting(false)
+    , watchdogExiting(false)
+    , timerQueue(epicsTimerQueueActive::allocate(true, epicsThreadPriorityScanHigh))
+    , wakeupTimer(timerQueue.createTimer())
+    , wakeupPending(false)
+    , profile(NULL)
+    , shmExport(NULL)
     , nameCtrl(portName)
     , initialised(false)
     , connected(false)
-    , deferringMode(false)
+    , identityFresh(false)
+    , identityCached(false)
 {
     // Uncomment these lines to enable full asyn trace flow and error
     //pasynTrace->setTraceMask(pasynUserSelf, 0xFF);
@@ -81,7 +138,51 @@ QgateController::QgateController(const char *portName,
     createParam(QG_CtrlMaxAxesCmd,      asynParamInt32,     &QG_CtrlMaxAxes);
     createParam(QG_CtrlDLLverCmd,       asynParamOctet,     &QG_CtrlDLLver);
     createParam(QG_CtrlSecurityCmd,     asynParamOctet,     &QG_CtrlSecurity);
+    createParam(QG_CtrlSecurityPeriodCmd,   asynParamFloat64,   &QG_CtrlSecurityPeriod);
+    createParam(QG_CtrlSecurityCheckedCmd,  asynParamOctet,     &QG_CtrlSecurityChecked);
+    createParam(QG_CtrlSecurityEnforcedCmd, asynParamInt32,     &QG_CtrlSecurityEnforced);
+    createParam(QG_CtrlRetryMinCmd,     asynParamFloat64,   &QG_CtrlRetryMin);
+    createParam(QG_CtrlRetryMaxCmd,     asynParamFloat64,   &QG_CtrlRetryMax);
+    createParam(QG_CtrlRetryDelayCmd,   asynParamFloat64,   &QG_CtrlRetryDelay);
+    createParam(QG_CtrlRetryNextCmd,    asynParamOctet,     &QG_CtrlRetryNext);
+    createParam(QG_CtrlStatsPeriodCmd,  asynParamFloat64,   &QG_CtrlStatsPeriod);
+    createParam(QG_CtrlCmdTimeoutCmd,   asynParamFloat64,   &QG_CtrlCmdTimeout);
+    createParam(QG_CtrlCmdDeadlineCmd,  asynParamFloat64,   &QG_CtrlCmdDeadline);
+    createParam(QG_CtrlCmdOverrunsCmd,  asynParamInt32,     &QG_CtrlCmdOverruns);
+    createParam(QG_CtrlCmdWorstCmd,     asynParamFloat64,   &QG_CtrlCmdWorst);
+    createParam(QG_CtrlIOMaxRateCmd,    asynParamFloat64,   &QG_CtrlIOMaxRate);
+    createParam(QG_CtrlIOLoadCmd,       asynParamFloat64,   &QG_CtrlIOLoad);
+    createParam(QG_CtrlLatResetCmd,     asynParamInt32,     &QG_CtrlLatReset);
+    createParam(QG_CtrlLatCallsCmd,     asynParamFloat64Array, &QG_CtrlLatCalls);
+    createParam(QG_CtrlLatErrorsCmd,    asynParamFloat64Array, &QG_CtrlLatErrors);
+    createParam(QG_CtrlLatTimeoutsCmd,  asynParamFloat64Array, &QG_CtrlLatTimeouts);
+    createParam(QG_CtrlLatP50Cmd,       asynParamFloat64Array, &QG_CtrlLatP50);
+    createParam(QG_CtrlLatP99Cmd,       asynParamFloat64Array, &QG_CtrlLatP99);
+    createParam(QG_CtrlLatMaxCmd,       asynParamFloat64Array, &QG_CtrlLatMax);
+    createParam(QG_CtrlLatSelectCmd,    asynParamInt32,     &QG_CtrlLatSelect);
+    createParam(QG_CtrlLatHistogramCmd, asynParamFloat64Array, &QG_CtrlLatHistogram);
+    createParam(QG_CtrlLatBinsCmd,      asynParamFloat64Array, &QG_CtrlLatBins);
+    createParam(QG_CtrlLatAllCallsCmd,  asynParamInt32,     &QG_CtrlLatAllCalls);
+    createParam(QG_CtrlLatAllErrorsCmd, asynParamInt32,     &QG_CtrlLatAllErrors);
+    createParam(QG_CtrlLatAllTimeoutsCmd,   asynParamInt32,     &QG_CtrlLatAllTimeouts);
+    createParam(QG_CtrlLatAllP50Cmd,    asynParamFloat64,   &QG_CtrlLatAllP50);
+    createParam(QG_CtrlLatAllP99Cmd,    asynParamFloat64,   &QG_CtrlLatAllP99);
+    createParam(QG_CtrlLatAllMaxCmd,    asynParamFloat64,   &QG_CtrlLatAllMax);
+    createParam(QG_CtrlStopAllCmd,      asynParamInt32,     &QG_CtrlStopAll);
+    createParam(QG_CtrlMoveFailedCmd,   asynParamInt32,     &QG_CtrlMoveFailed);
+    createParam(QG_CtrlProfileTimeoutCmd,   asynParamFloat64,   &QG_CtrlProfileTimeout);
+    createParam(QG_CtrlProfileTimesCmd, asynParamFloat64Array, &QG_CtrlProfileTimes);
+    createParam(QG_CtrlPublishMaxAgeCmd,    asynParamFloat64,   &QG_CtrlPublishMaxAge);
     createParam(QG_CtrlReportCmd,       asynParamOctet,     &QG_CtrlReport);
+    createParam(QG_CtrlBatchPollCmd,    asynParamInt32,     &QG_CtrlBatchPoll);
+    createParam(QG_PollDivMovingCmd,    asynParamInt32,     &QG_PollDivider[QGPOLL_MOVING]);
+    createParam(QG_PollDivSettlingCmd,  asynParamInt32,     &QG_PollDivider[QGPOLL_SETTLING]);
+    createParam(QG_PollDivIdleCmd,      asynParamInt32,     &QG_PollDivider[QGPOLL_IDLE]);
+    createParam(QG_PollDivDisconnCmd,   asynParamInt32,     &QG_PollDivider[QGPOLL_DISCONNECTED]);
+    createParam(QG_PollDivSensorCmd,    asynParamInt32,     &QG_PollDivider[QGPOLL_SENSOR]);
+    createParam(QG_PollDivSlowCmd,      asynParamInt32,     &QG_PollDivSlow);
+    createParam(QG_PollSettleCmd,       asynParamInt32,     &QG_PollSettle);
+    createParam(QG_PollPredictCmd,      asynParamFloat64,   &QG_PollPredict);
     createParam(QG_AxisNameCmd,         asynParamOctet,     &QG_AxisName);
     createParam(QG_AxisModelCmd,        asynParamOctet,     &QG_AxisModel);
     createParam(QG_AxisConnectedCmd,    asynParamInt32,     &QG_AxisConnected);
@@ -91,6 +192,42 @@ QgateController::QgateController(const char *portName,
     createParam(QG_AxisInPosUnconfirmedCmd, asynParamInt32,    &QG_AxisInPosUnconfirmed);
     createParam(QG_AxisInPosLPFCmd,     asynParamInt32,     &QG_AxisInPosLPF);
     createParam(QG_AxisInPosWindowCmd,  asynParamInt32,     &QG_AxisInPosWindow);
+    createParam(QG_AxisPollStateCmd,    asynParamInt32,     &QG_AxisPollState);
+    createParam(QG_AxisAcqCmd,          asynParamInt32,     &QG_AxisAcq);
+    createParam(QG_AxisAcqPositionsCmd, asynParamFloat64Array, &QG_AxisAcqPositions);
+    createParam(QG_AxisAcqTimesCmd,     asynParamFloat64Array, &QG_AxisAcqTimes);
+    createParam(QG_AxisAcqMeanCmd,      asynParamFloat64,   &QG_AxisAcqMean);
+    createParam(QG_AxisAcqRateCmd,      asynParamFloat64,   &QG_AxisAcqRate);
+    createParam(QG_AxisAcqCountCmd,     asynParamInt32,     &QG_AxisAcqCount);
+    createParam(QG_AxisFlightCmd,       asynParamInt32,     &QG_AxisFlight);
+    createParam(QG_AxisFlightPositionsCmd,  asynParamFloat64Array,  &QG_AxisFlightPositions);
+    createParam(QG_AxisFlightTimesCmd,  asynParamFloat64Array,  &QG_AxisFlightTimes);
+    createParam(QG_AxisFlightCountCmd,  asynParamInt32,     &QG_AxisFlightCount);
+    createParam(QG_AxisFlightRateCmd,   asynParamFloat64,   &QG_AxisFlightRate);
+    createParam(QG_AxisPosDeadbandCmd,  asynParamFloat64,   &QG_AxisPosDeadband);
+    createParam(QG_AxisStatsWindowCmd,  asynParamFloat64,   &QG_AxisStatsWindow);
+    createParam(QG_AxisPosMeanCmd,      asynParamFloat64,   &QG_AxisPosMean);
+    createParam(QG_AxisPosStdDevCmd,    asynParamFloat64,   &QG_AxisPosStdDev);
+    createParam(QG_AxisPosMinCmd,       asynParamFloat64,   &QG_AxisPosMin);
+    createParam(QG_AxisPosMaxCmd,       asynParamFloat64,   &QG_AxisPosMax);
+    createParam(QG_AxisPosP2PCmd,       asynParamFloat64,   &QG_AxisPosP2P);
+    createParam(QG_AxisSettlePredictedCmd,  asynParamFloat64,   &QG_AxisSettlePredicted);
+    createParam(QG_AxisSettleMeasuredCmd,   asynParamFloat64,   &QG_AxisSettleMeasured);
+    createParam(QG_AxisSettleResetCmd,  asynParamInt32,     &QG_AxisSettleReset);
+    createParam(QG_AxisFbEnableCmd,     asynParamInt32,     &QG_AxisFbEnable);
+    createParam(QG_AxisFbSetpointCmd,   asynParamFloat64,   &QG_AxisFbSetpoint);
+    createParam(QG_AxisFbKpCmd,         asynParamFloat64,   &QG_AxisFbKp);
+    createParam(QG_AxisFbKiCmd,         asynParamFloat64,   &QG_AxisFbKi);
+    createParam(QG_AxisFbKdCmd,         asynParamFloat64,   &QG_AxisFbKd);
+    createParam(QG_AxisFbOutLowCmd,     asynParamFloat64,   &QG_AxisFbOutLow);
+    createParam(QG_AxisFbOutHighCmd,    asynParamFloat64,   &QG_AxisFbOutHigh);
+    createParam(QG_AxisFbErrorCmd,      asynParamFloat64,   &QG_AxisFbError);
+    createParam(QG_AxisFbOutputCmd,     asynParamFloat64,   &QG_AxisFbOutput);
+    createParam(QG_AxisFbRateCmd,       asynParamFloat64,   &QG_AxisFbRate);
+    createParam(QG_AxisFbOverrunsCmd,   asynParamInt32,     &QG_AxisFbOverruns);
+    createParam(QG_AxisFbFaultsCmd,     asynParamInt32,     &QG_AxisFbFaults);
+    createParam(QG_AxisPosUncertaintyCmd,   asynParamFloat64,   &QG_AxisPosUncertainty);
+    createParam(QG_AxisStatsSamplesCmd, asynParamInt32,     &QG_AxisStatsSamples);
 
     bool initialStatus = true;  //Assume controller would be initialised
     bool failedDLL = false;     //DLL initialisation (severe error)
@@ -116,9 +253,77 @@ QgateController::QgateController(const char *portName,
     }
 
     setIntegerParam(QG_CtrlMaxAxes, numAxes);
+    setIntegerParam(QG_CtrlBatchPoll, 1);   //Batched polling by default
+    //Poll scheduler defaults: moving axes every poll, idle ones every 4 polls...
+    setIntegerParam(QG_PollDivider[QGPOLL_MOVING], 1);
+    setIntegerParam(QG_PollDivider[QGPOLL_SETTLING], 1);
+    setIntegerParam(QG_PollDivider[QGPOLL_IDLE], 4);
+    setIntegerParam(QG_PollDivider[QGPOLL_DISCONNECTED], 8);
+    setIntegerParam(QG_PollDivider[QGPOLL_SENSOR], 1);
+    setIntegerParam(QG_PollDivSlow, 8);     //...and their slow-changing status 8 times less often
+    setIntegerParam(QG_PollSettle, 10);     //Polls considered settling after a move
+    setDoubleParam(QG_PollPredict, 0.005);  //Polled every 5 ms around the expected end of a move
+    setDoubleParam(QG_CtrlSecurityPeriod, 60.0);    //Security level checked every minute
+    setStringParam(QG_CtrlSecurityChecked, "");
+    setIntegerParam(QG_CtrlSecurityEnforced, securityEnforced);
+    securityChecked.secPastEpoch = 0;
+    securityChecked.nsec = 0;
+    //Readbacks stamped with the time they were sampled (see setReadingTime())
+    replySampled.secPastEpoch = 0;
+    replySampled.nsec = 0;
+    pasynManager->registerTimeStampSource(pasynUserSelf, this, timeStampSourceC);
+    setDoubleParam(QG_CtrlRetryMin, 1.0);       //Reconnection retried after 1 second...
+    setDoubleParam(QG_CtrlRetryMax, 60.0);      //...doubling up to a minute
+    setDoubleParam(QG_CtrlRetryDelay, retryDelay);
+    setStringParam(QG_CtrlRetryNext, "");
+    nextRetry.secPastEpoch = 0;                 //First connection attempted straight away
+    nextRetry.nsec = 0;
+    epicsTimeStamp seedTime;
+    epicsTimeGetCurrent(&seedTime);
+    retrySeed = seedTime.nsec ^ (unsigned int)(size_t)this;  //Jitter differs between controllers
+    setDoubleParam(QG_CtrlStatsPeriod, 1.0);    //Position statistics published every second
+    setDoubleParam(QG_CtrlCmdTimeout, 1.0);     //Requests taking a second or more counted as timeouts
+    setDoubleParam(QG_CtrlCmdDeadline, 5.0);    //Link considered hung after 5 seconds per request
+    setIntegerParam(QG_CtrlCmdOverruns, 0);
+    setDoubleParam(QG_CtrlCmdWorst, 0.0);
+    setIntegerParam(QG_CtrlLatSelect, QGCMD_NUMTYPES);  //Histogram of all requests
+    setDoubleParam(QG_CtrlIOMaxRate, 0.0);      //No request rate limit
+    setDoubleParam(QG_CtrlIOLoad, 0.0);
+    setIntegerParam(QG_CtrlMoveFailed, 0);
+    setDoubleParam(QG_CtrlPublishMaxAge, 10.0); //Readbacks within deadband published every 10 seconds
+    setDoubleParam(QG_CtrlProfileTimeout, 5.0); //Profile points to be reached within 5 seconds
+    epicsTimeGetCurrent(&ioLoadTime);
     initialised = initialStatus;
 
+    //Group of all the axes, deferred by the motor records
+    QgateMoveGroup *allAxes = new QgateMoveGroup("", numAxes);
+    for(int i=1; i<=numAxes; i++) {
+        allAxes->addAxis(i);
+    }
+    allAxes->failedParam = QG_CtrlMoveFailed;
+    moveGroups.push_back(allAxes);
+
+    //Publish the last known identity straight away, to be verified once connected
+    if(identityCache != NULL && identityCache[0] != '\0') {
+        identityCachePath = identityCache;
+        identityCachePath.append("/").append(nameCtrl).append(QG_IDENTITY_CACHE_EXT);
+        identityCached = loadIdentity();
+        if(identityCached) {
+            publishIdentity();
+            callParamCallbacks();
+        }
+    }
+
     if(!failedDLL) {
+        //Controller traffic from now on goes through the I/O thread, or the shared pool
+        QgateIOPool *ioPool = NULL;
+        if(sharedIO) {
+            ioPool = QgateIOPool::getShared();
+            if(ioPool == NULL) {
+                printf("queensgateNPC: %s: no shared I/O pool configured (qgateIOPoolConfig): using its own I/O thread\n", portName);
+            }
+        }
+        ioQueue.start(ioPool);
         /** Starts the motor poller thread.
          * \param[in] movingPollPeriod The time in secs between polls when any axis is moving.
          * \param[in] idlePollPeriod The time in secs between polls when no axis is moving.
@@ -126,15 +331,41 @@ QgateController::QgateController(const char *portName,
          * This can need to be non-zero for controllers that do not immediately
          * report that an axis is moving after it has been told to start. */
         startPoller(movingPollPeriod, idlePollPeriod, /*forcedFastPolls-*/3);
+        epicsThreadCreate((nameCtrl + "_STATS").c_str(),
+                        epicsThreadPriorityLow,
+                        epicsThreadGetStackSize(epicsThreadStackMedium),
+                        (EPICSTHREADFUNC)statsThreadC, this);
+        epicsThreadCreate((nameCtrl + "_WDOG").c_str(),
+                        epicsThreadPriorityHigh,
+                        epicsThreadGetStackSize(epicsThreadStackSmall),
+                        (EPICSTHREADFUNC)watchdogThreadC, this);
+    } else {
+        statsExitEvent.signal();    //No statistics thread to wait for
+        watchdogExitEvent.signal();
     }
 }
 
 QgateController::~QgateController() {
+    delete profile;
+    statsExiting = true;
+    statsEvent.signal();
+    statsExitEvent.wait();
+    watchdogExiting = true;
+    watchdogEvent.signal();
+    watchdogExitEvent.wait();
+    wakeupTimer.destroy();
+    timerQueue.release();
+    ioQueue.stop();
     qg.CloseSession();
+    delete &qg;
+    delete shmExport;
+    for(size_t i=0; i<moveGroups.size(); i++) {
+        delete moveGroups[i];
+    }
 }
 
 /** Initialises the Queensgate Controller Library
-  * \param[in] libPath The path and filename of the Queensgate Library so/DLL.
+  * \param[in] libPath The path and filename of the Queensgate Library so/DLL, or "emu:<options>" for the emulator.
   * \return error if failed to initialise */
 asynStatus QgateController::initController(const char* libPath) {
     DllAdapterStatus result = DLL_ADAPTER_STATUS_SUCCESS;
@@ -155,7 +386,6 @@ asynStatus QgateController::initController(const char* libPath) {
 asynStatus QgateController::initSession() {
     int dllVersionMajor, dllVersionMinor, dllVersionBuild;
     DllAdapterStatus result = DLL_ADAPTER_STATUS_SUCCESS;
-    QGList listresName, listresVal;
 
     printf("Initialising Controller Session %s on %s\n", nameCtrl.c_str(), portDevice.c_str());
 
@@ -187,77 +417,288 @@ asynStatus QgateController::initSession() {
   * \return error if failed to communicate */
 asynStatus QgateController::initialChecks() {
     DllAdapterStatus result = DLL_ADAPTER_STATUS_SUCCESS;
-    QGList listresName, listresVal;
 
     maxAxes = qg.GetChannels();
-    //Initialise/reset deferred move storage
-    deferredMove.clear();
-    deferredMove.reserve(maxAxes);
-    for(int i=0; i<maxAxes; i++) {
-        deferredMove.push_back("");
-    }
-    getCmd("identity.hardware.part.get", 0, model);
-    getCmd("identity.hardware.serial.get", 0, serialNum);
-    getCmd("identity.software.version.get", 0, ctrl_firmware);
-    result = getCmd("controller.security.user.get", 0, securityLevel);
-    if(securityLevel.compare("Queensgate user")!=0) {
-        //TODO: set security level back to user -- this goes here or somewhere else?
-        result = qg.DoCommand("controller.security.user.set 0xDEC0DED", listresName, listresVal);
-        //TODO: check outcome changed
-        getCmd("controller.security.user.get", 0, securityLevel);
+    //Reset deferred moves
+    for(size_t i=0; i<moveGroups.size(); i++) {
+        moveGroups[i]->cancelAll();
+    }
+    pollReq.command.reserve(QG_CMD_STRLEN * QGCMD_NUM * (numAxes + 1));
+    //Controller and stages identified in one go, or one by one if not possible.
+    //When the identity is cached, only check it is still the same controller
+    bool verify = identityCached && (stageIdentity.size() == (size_t)maxAxes);
+    std::string cachedSerial(serialNum), cachedFirmware(ctrl_firmware);
+    stageIdentity.resize(maxAxes);
+    result = identify(!verify);
+    if(verify && result == DLL_ADAPTER_STATUS_SUCCESS 
+            && (serialNum != cachedSerial || ctrl_firmware != cachedFirmware)) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, "Controller %s S/N %s firmware %s does not match its cached identity (S/N %s firmware %s)\n", 
+                    nameCtrl.c_str(), serialNum.c_str(), ctrl_firmware.c_str(), cachedSerial.c_str(), cachedFirmware.c_str());
+        verify = false;
+        result = identify(true);
+    }
+    if(result != DLL_ADAPTER_STATUS_SUCCESS) {
+        verify = false;
+        result = identifyEach();
+    }
+    if(result == DLL_ADAPTER_STATUS_SUCCESS) {
+        if(!verify) {
+            saveIdentity();
+        }
+        result = enforceSecurity();
     }
 
     if(result != DLL_ADAPTER_STATUS_SUCCESS) {
         return asynError;   //comms failed (again)
     }
+    identityFresh = true;   //For the axes to initialise from on this poll cycle
+    publishIdentity();
+    return asynSuccess;
+}
+
+/** Publishes the controller identification and the report of its stages */
+void QgateController::publishIdentity() {
     setStringParam(QG_CtrlModel, model.c_str());
     setStringParam(QG_CtrlSerialNum, serialNum.c_str());
     setStringParam(QG_CtrlFirmware, ctrl_firmware.c_str());
-    setIntegerParam(QG_CtrlMaxStages, maxAxes);
+    int numStages = (int)stageIdentity.size();
+    setIntegerParam(QG_CtrlMaxStages, numStages);
     setIntegerParam(QG_CtrlMaxAxes, numAxes);
-    setStringParam(QG_CtrlSecurity, securityLevel.c_str());
     
     //List all detected/connected stages, from 1 to maximum detected
     std::ostringstream reportTxt;
     reportTxt << "queensgateNPC Controller " << model << " " << nameCtrl <<
                 " - S/N:" << serialNum << 
-                " - up to " << maxAxes << " channels." << std::endl;
-    for(int i=1; i<=maxAxes; ++i) {
-        std::ostringstream stageCmd;
-        stageCmd << "identity.stage.part.get " << i;
-        result = qg.DoCommand(stageCmd.str(), listresName, listresVal);
+                " - up to " << numStages << " channels." << std::endl;
+    for(int i=1; i<=numStages; ++i) {
+        const std::string &stagePart = stageIdentity[i-1].part;
         reportTxt << "Stage[" << i << "]:";
-        if(result== DLL_ADAPTER_STATUS_SUCCESS) {
-            //Controller reports non-connected stage as FAILED, and it sounds too dramatic
-            if(listresVal.front().compare("FAILED")) {
-                reportTxt << listresVal.front();
-            } else {
-                reportTxt << "Not found";    
-            }
-        } else {
+        if(stagePart.empty()) {
             reportTxt << "Error accessing stage";
+        } else if(stagePart.compare("FAILED")) {
+            reportTxt << stagePart;
+        } else {
+            //Controller reports non-connected stage as FAILED, and it sounds too dramatic
+            reportTxt << "Not found";    
         }
         reportTxt << std::endl;
     }
     printf("%s", reportTxt.str().c_str());
     setStringParam(QG_CtrlReport, reportTxt.str().c_str());
-    return asynSuccess;
+}
+
+/** Identifies the controller and the stages connected to all its channels
+  * using a single multi-line request, so a reconnection does not take a
+  * request per item. Every command contributes its reply values in order.
+  * \param[in] full Retrieve everything, or only what is not kept on the
+  *             identity cache (i.e. the part numbers are already known)
+  * \return error if failed to communicate or reply could not be decoded */
+DllAdapterStatus QgateController::identify(bool full) {
+    const QgateCommand ctrlIdentity[] = {QGCMD_CTRL_PART, QGCMD_CTRL_SERIAL, QGCMD_CTRL_VERSION, QGCMD_SECURITY_GET};
+    const size_t numCtrlIdentity = sizeof(ctrlIdentity)/sizeof(ctrlIdentity[0]);
+    std::string *ctrlValue[] = {&model, &serialNum, &ctrl_firmware, &securityLevel};
+    size_t numReplies = 0;
+    DllAdapterStatus result = DLL_ADAPTER_STATUS_ERROR_UNKNOWN_COMMAND;
+    QgateRequest *request = ioQueue.acquire();
+
+    for(size_t i=(full)? 0 : 1; i<numCtrlIdentity; i++) {
+        request->command.append(ctrlCmd[ctrlIdentity[i]]);
+        request->command.append(1, '\n');
+        numReplies += qgateCommandTable[ctrlIdentity[i]].numReplies;
+    }
+    for(int i=1; i<=maxAxes; ++i) {
+        QgateCommandSet stageCmd(i);
+        request->command.append(stageCmd[QGCMD_STAGE_CONNECTED]);
+        request->command.append(1, '\n');
+        numReplies += qgateCommandTable[QGCMD_STAGE_CONNECTED].numReplies;
+        if(full) {
+            request->command.append(stageCmd[QGCMD_STAGE_PART]);
+            request->command.append(1, '\n');
+            numReplies += qgateCommandTable[QGCMD_STAGE_PART].numReplies;
+        }
+    }
+    if(sendRequest(*request) == DLL_ADAPTER_STATUS_SUCCESS) {
+        const QgateReply &reply = request->reply;
+        if(reply.size() == numReplies) {
+            size_t index = 0;
+            for(size_t i=(full)? 0 : 1; i<numCtrlIdentity; i++) {
+                ctrlValue[i]->assign(reply.value(index), reply.valueLength(index));
+                index += qgateCommandTable[ctrlIdentity[i]].numReplies;
+            }
+            for(int i=0; i<maxAxes; ++i) {
+                int stageConnected = 0;
+                stageIdentity[i].connected = (reply.getInt(index, stageConnected) && stageConnected);
+                index += qgateCommandTable[QGCMD_STAGE_CONNECTED].numReplies;
+                if(full) {
+                    stageIdentity[i].part.assign(reply.value(index), reply.valueLength(index));
+                    index += qgateCommandTable[QGCMD_STAGE_PART].numReplies;
+                }
+            }
+            result = DLL_ADAPTER_STATUS_SUCCESS;
+        } else {
+            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, "Controller %s identification replied %lu values instead of %lu: identifying one by one\n", 
+                        nameCtrl.c_str(), (unsigned long)reply.size(), (unsigned long)numReplies);
+        }
+    }
+    ioQueue.release(request);
+    return result;
+}
+
+/** Identifies the controller and its stages one request at a time, for
+  * when the combined identification request is not possible.
+  * \return error if failed to communicate */
+DllAdapterStatus QgateController::identifyEach() {
+    DllAdapterStatus result = DLL_ADAPTER_STATUS_SUCCESS;
+
+    getCmd(ctrlCmd[QGCMD_CTRL_PART], 0, model);
+    getCmd(ctrlCmd[QGCMD_CTRL_SERIAL], 0, serialNum);
+    getCmd(ctrlCmd[QGCMD_CTRL_VERSION], 0, ctrl_firmware);
+    result = getCmd(ctrlCmd[QGCMD_SECURITY_GET], 0, securityLevel);
+    if(result != DLL_ADAPTER_STATUS_SUCCESS) {
+        return result;
+    }
+    for(int i=1; i<=maxAxes; ++i) {
+        QgateCommandSet stageCmd(i);
+        int stageConnected = 0;
+        stageIdentity[i-1].connected = (getCmd(stageCmd[QGCMD_STAGE_CONNECTED], i, stageConnected) == DLL_ADAPTER_STATUS_SUCCESS
+                                        && stageConnected);
+        getCmd(stageCmd[QGCMD_STAGE_PART], i, stageIdentity[i-1].part);
+    }
+    return result;
+}
+
+/** Loads the last known controller identity from its cache file.
+  * \return false if there is no valid cached identity */
+bool QgateController::loadIdentity() {
+    FILE *file = fopen(identityCachePath.c_str(), "r");
+    if(file == NULL) {
+        return false;   //Not cached yet
+    }
+    char line[QG_CMD_STRLEN];
+    int numStages = -1;
+    std::string cachedModel, cachedSerial, cachedFirmware;
+    std::vector<QgateStageIdentity> cachedStages;
+    while(fgets(line, sizeof(line), file) != NULL) {
+        std::string text(line);
+        text.erase(text.find_last_not_of("\r\n") + 1);
+        size_t separator = text.find('=');
+        if(separator == std::string::npos) {
+            continue;
+        }
+        std::string name = text.substr(0, separator);
+        std::string value = text.substr(separator + 1);
+        int stage = 0;
+        if(name == "model") {
+            cachedModel = value;
+        } else if(name == "serial") {
+            cachedSerial = value;
+        } else if(name == "firmware") {
+            cachedFirmware = value;
+        } else if(name == "channels") {
+            numStages = atoi(value.c_str());
+            if(numStages >= 0) {
+                cachedStages.resize(numStages);
+            }
+        } else if(sscanf(name.c_str(), "stage%d", &stage) == 1 && stage >= 1 && stage <= (int)cachedStages.size()) {
+            cachedStages[stage-1].connected = false;
+            cachedStages[stage-1].part = value;
+        }
+    }
+    fclose(file);
+    if(cachedSerial.empty() || cachedFirmware.empty() || numStages < 0) {
+        printf("queensgateNPC: Ignoring invalid identity cache file %s\n", identityCachePath.c_str());
+        return false;
+    }
+    model = cachedModel;
+    serialNum = cachedSerial;
+    ctrl_firmware = cachedFirmware;
+    stageIdentity = cachedStages;
+    return true;
+}
+
+/** Saves the controller identity on its cache file, when there is one */
+void QgateController::saveIdentity() {
+    if(identityCachePath.empty()) {
+        return;
+    }
+    //Written aside and then renamed, so a cache file is never left half-written
+    std::string tempPath(identityCachePath + ".tmp");
+    FILE *file = fopen(tempPath.c_str(), "w");
+    if(file == NULL) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, "Controller %s failed to write identity cache file %s\n", 
+                    nameCtrl.c_str(), tempPath.c_str());
+        return;
+    }
+    fprintf(file, "model=%s\n", model.c_str());
+    fprintf(file, "serial=%s\n", serialNum.c_str());
+    fprintf(file, "firmware=%s\n", ctrl_firmware.c_str());
+    fprintf(file, "channels=%d\n", (int)stageIdentity.size());
+    for(size_t i=0; i<stageIdentity.size(); i++) {
+        fprintf(file, "stage%d=%s\n", (int)i+1, stageIdentity[i].part.c_str());
+    }
+    if(fclose(file) != 0 || rename(tempPath.c_str(), identityCachePath.c_str()) != 0) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, "Controller %s failed to write identity cache file %s\n", 
+                    nameCtrl.c_str(), identityCachePath.c_str());
+        return;
+    }
+    identityCached = true;
+}
+
+/** Gets the last known part number of a stage: cached or identified
+  * \param[in] axisNum Axis stage number [1..n]
+  * \param[out] part Stage part number
+  * \return false if not known */
+bool QgateController::getStagePart(int axisNum, std::string &part) {
+    if(axisNum < 1 || axisNum > (int)stageIdentity.size() || stageIdentity[axisNum-1].part.empty()) {
+        return false;
+    }
+    part = stageIdentity[axisNum-1].part;
+    return true;
+}
+
+/** Gets the identification of a stage, when retrieved along with the controller
+  * on this same poll cycle (i.e. when the controller just (re)connected).
+  * \param[in] axisNum Axis stage number [1..n]
+  * \param[out] identity Stage identification
+  * \return false if not identified on this poll cycle: to be asked to the controller */
+bool QgateController::getStageIdentity(int axisNum, QgateStageIdentity &identity) {
+    if(!identityFresh || axisNum < 1 || axisNum > (int)stageIdentity.size()) {
+        return false;
+    }
+    identity = stageIdentity[axisNum-1];
+    return true;
 }
 
 /** Polls the controller and updates values
   * \return always asynsuccess as no fatal or urecoverable errors considered */
 asynStatus QgateController::poll() {
-    TakeLock takeLock(this, /*alreadyTaken=*/true);
-	FreeLock freeLock(takeLock);
+    identityFresh = false;  //Stage identification only valid for the poll cycle it was taken on
+
+    //Disconnected controller only probed when the reconnection backoff expires
+    if(!connected && !isRetryDue()) {
+        return asynSuccess;
+    }
+
+    //Poll controller and all axes in one go when possible
+    int batchPoll = 0;
+    getIntegerParam(QG_CtrlBatchPoll, &batchPoll);
+    if(connected && batchPoll) {
+        if(pollBatch() == asynSuccess) {
+            callParamCallbacks();
+            return asynSuccess;
+        }
+        //Batch failed: fall back to individual requests for this poll cycle
+    }
 
     //get controller status
     std::string reply;
-    if(getCmd("controller.status.get", 0, reply, 2) != DLL_ADAPTER_STATUS_SUCCESS) {
+    if(getCmd(ctrlCmd[QGCMD_CTRL_STATUS], 0, reply, 2) != DLL_ADAPTER_STATUS_SUCCESS) {
         setIntegerParam(QG_CtrlConnected, 0);
         if(connected) {
             connected = false;
             asynPrint(pasynUserSelf, ASYN_TRACEIO_DEVICE, "QueensgateNPC: controller %s %s disconnected\n", model.c_str(), nameCtrl.c_str());
         }
+        scheduleRetry(true);
     } else {
         if(!connected) {
             //Just re-connected to the controller
@@ -265,23 +706,17 @@ asynStatus QgateController::poll() {
             if(initialChecks() != asynSuccess) {
                 //Connection failed again
                 setIntegerParam(QG_CtrlConnected, 0);
-                return asynSuccess; //Controller disconnected: re-check on next polling
+                scheduleRetry(true);
+                callParamCallbacks();
+                return asynSuccess; //Controller disconnected: re-check when the backoff expires
             }
             asynPrint(pasynUserSelf, ASYN_TRACEIO_DEVICE, "QueensgateNPC: controller %s %s connected\n", model.c_str(), nameCtrl.c_str());
             setIntegerParam(QG_CtrlConnected, 1);
             connected = true;
-            if(getCmd("controller.status.get", 0, reply, 0) == DLL_ADAPTER_STATUS_SUCCESS) {
-                setStringParam(QG_CtrlSecurity, reply.c_str());
-            }
-        } else {
-            //TODO: check security level change
-            getCmd("controller.security.user.get", 0, securityLevel);
-            if(securityLevel.compare("Queensgate user")!=0) {
-                //TODO: set security level back to user -- this goes here or somewhere else?
-                QGList listresName, listresVal;
-                qg.DoCommand("controller.security.user.set 0xDEC0DED", listresName, listresVal);
-                //TODO: check outcome
-                getCmd("controller.security.user.get", 0, securityLevel);
+            scheduleRetry(false);
+        } else if(isSecurityCheckDue()) {
+            if(getCmd(ctrlCmd[QGCMD_SECURITY_GET], 0, securityLevel) == DLL_ADAPTER_STATUS_SUCCESS) {
+                enforceSecurity();
             }
         }
     }
@@ -293,124 +728,951 @@ asynStatus QgateController::poll() {
     return asynSuccess;
 }
 
-/** Processes deferred moves.
+/** Polls the controller and all its configured axes using a single multi-line
+  * request, in the same way as deferred moves are sent. Every command in the
+  * request contributes its reply values in order, so the reply list is split
+  * back sequentially: first the controller's, then each axis' in axis order.
+  * The axes keep the decoded values for their own poll() on this cycle.
+  * \return error if failed to communicate or reply could not be decoded */
+asynStatus QgateController::pollBatch() {
+    size_t numReplies = 0;
+    bool checkSecurity = isSecurityCheckDue();
+
+    //Controller status: (security,channels,status) and, from time to time, (security)
+    std::string &pollRequest = pollReq.command;
+    pollRequest.assign(ctrlCmd[QGCMD_CTRL_STATUS]);
+    numReplies += qgateCommandTable[QGCMD_CTRL_STATUS].numReplies;
+    if(checkSecurity) {
+        pollRequest.append(1, '\n');
+        pollRequest.append(ctrlCmd[QGCMD_SECURITY_GET]);
+        numReplies += qgateCommandTable[QGCMD_SECURITY_GET].numReplies;
+    }
+    for(int i=0; i<numAxes; i++) {
+        QgateAxis* pAxis = getQgateAxis(i);
+        if(pAxis) {
+            numReplies += pAxis->buildPollRequest(pollRequest);
+        }
+    }
+
+    asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER, "Controller %s batch poll CMD:'%s'\n", nameCtrl.c_str(), pollRequest.c_str());
+    pollReq.axisNum = 0;
+    if(sendRequest(pollReq) != DLL_ADAPTER_STATUS_SUCCESS) {
+        return asynError;
+    }
+    const QgateReply &pollReply = pollReq.reply;
+    if(pollReply.size() != numReplies) {
+        //Controller not replying to each command: never try batching again
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, "Controller %s batch poll replied %lu values instead of %lu: batched polling disabled\n", 
+                    nameCtrl.c_str(), (unsigned long)pollReply.size(), (unsigned long)numReplies);
+        setIntegerParam(QG_CtrlBatchPoll, 0);
+        return asynError;
+    }
+
+    //Split the reply list
+    size_t index = 0;
+    int status = pollReply.find("status");
+    if(status != QgateReply::NOTFOUND) {
+        setStringParam(QG_CtrlStatus, pollReply.value(status));
+    }
+    index += qgateCommandTable[QGCMD_CTRL_STATUS].numReplies;
+    if(checkSecurity) {
+        securityLevel.assign(pollReply.value(index), pollReply.valueLength(index));
+        index += qgateCommandTable[QGCMD_SECURITY_GET].numReplies;
+    }
+    for(int i=0; i<numAxes; i++) {
+        QgateAxis* pAxis = getQgateAxis(i);
+        if(pAxis) {
+            pAxis->processPollReply(pollReply, index);
+        }
+    }
+
+    if(checkSecurity) {
+        enforceSecurity();
+    }
+    return asynSuccess;
+}
+
+/** Tells if a disconnected controller has to be probed on this poll
+  * \return true once the reconnection backoff has expired */
+bool QgateController::isRetryDue() {
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+    return (epicsTimeDiffInSeconds(&now, &nextRetry) >= 0.0);
+}
+
+/** Schedules the next reconnection probe. The backoff doubles on every failed
+  * probe, from QG_CtrlRetryMin up to QG_CtrlRetryMax seconds, and is randomised
+  * so controllers sharing a network do not retry in step.
+  * \param[in] failed true if the probe failed, false when connected */
+void QgateController::scheduleRetry(bool failed) {
+    if(!failed) {
+        retryDelay = 0.0;
+        setDoubleParam(QG_CtrlRetryDelay, retryDelay);
+        setStringParam(QG_CtrlRetryNext, "");
+        return;
+    }
+    double minDelay = 0.0;
+    double maxDelay = 0.0;
+    getDoubleParam(QG_CtrlRetryMin, &minDelay);
+    getDoubleParam(QG_CtrlRetryMax, &maxDelay);
+    retryDelay = (retryDelay > 0.0)? retryDelay * 2.0 : minDelay;
+    if(retryDelay > maxDelay) {
+        retryDelay = maxDelay;
+    }
+    retrySeed = retrySeed * 1103515245u + 12345u;
+    double jitter = (((retrySeed >> 8) & 0xFFFFFF) / (double)0x1000000 * 2.0 - 1.0) * QGATE_RETRY_JITTER;
+    char timeStr[QG_VALUE_STRLEN];
+    epicsTimeGetCurrent(&nextRetry);
+    epicsTimeAddSeconds(&nextRetry, retryDelay * (1.0 + jitter));
+    epicsTimeToStrftime(timeStr, QG_VALUE_STRLEN, "%Y-%m-%d %H:%M:%S", &nextRetry);
+    setDoubleParam(QG_CtrlRetryDelay, retryDelay);
+    setStringParam(QG_CtrlRetryNext, timeStr);
+}
+
+/** Tells if the security level watchdog has to check the controller on this poll.
+  * The level seldom changes, so it is checked every QG_CtrlSecurityPeriod seconds
+  * only, or straight away when a command was refused.
+  * \return true when the security level has to be retrieved */
+bool QgateController::isSecurityCheckDue() {
+    if(securityCheckForced) {
+        return true;
+    }
+    double period = 0.0;
+    epicsTimeStamp now;
+    getDoubleParam(QG_CtrlSecurityPeriod, &period);
+    epicsTimeGetCurrent(&now);
+    return (epicsTimeDiffInSeconds(&now, &securityChecked) >= period);
+}
+
+/** Security level watchdog: sets the controller back to user level if it changed.
+  * To be called once securityLevel has been retrieved from the controller.
+  * \return error if failed to communicate */
+DllAdapterStatus QgateController::enforceSecurity() {
+    DllAdapterStatus result = DLL_ADAPTER_STATUS_SUCCESS;
+    char timeStr[QG_VALUE_STRLEN];
+
+    securityCheckForced = false;
+    epicsTimeGetCurrent(&securityChecked);
+    epicsTimeToStrftime(timeStr, QG_VALUE_STRLEN, "%Y-%m-%d %H:%M:%S", &securityChecked);
+    setStringParam(QG_CtrlSecurityChecked, timeStr);
+    if(securityLevel.compare(QG_SECURITY_USER_LEVEL)!=0) {
+        //User level needed for commanding positions
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, "Controller %s security level '%s': setting it back to user level\n", 
+                    nameCtrl.c_str(), securityLevel.c_str());
+        result = sendCmd(ctrlCmd[QGCMD_SECURITY_SET], 0);
+        setIntegerParam(QG_CtrlSecurityEnforced, ++securityEnforced);
+        if(result == DLL_ADAPTER_STATUS_SUCCESS &&
+                    getCmd(ctrlCmd[QGCMD_SECURITY_GET], 0, securityLevel) == DLL_ADAPTER_STATUS_SUCCESS &&
+                    securityLevel.compare(QG_SECURITY_USER_LEVEL)!=0) {
+            //Level not changed: moves refused till set by other means
+            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, "Controller %s security level still '%s' after setting user level\n", 
+                        nameCtrl.c_str(), securityLevel.c_str());
+        }
+    }
+    setStringParam(QG_CtrlSecurity, securityLevel.c_str());
+    return result;
+}
+
+/** Tells if a command was refused because of the controller security level.
+  * Commands not permitted at the current level are refused by DoCommand as if they
+  * were not valid commands, without being sent (see the Controller Interface Library
+  * manual, 2.3). The commands sent come from the command table, so that refusal
+  * from a controller still answering is taken as a security one. Errors reported
+  * by the controller itself are replied as "FAILED" instead (2.4).
+  * \param[in] request Request failed
+  * \return true if refused as not permitted */
+bool QgateController::isSecurityError(const QgateRequest &request) {
+    return request.result == DLL_ADAPTER_STATUS_ERROR_UNKNOWN_COMMAND && connected;
+}
+
+/** Statistics thread: computes and publishes the axes' position statistics
+  * and the request latency statistics every QG_CtrlStatsPeriod seconds,
+  * out of the poller. */
+void QgateController::statsThread() {
+    double period = 1.0;
+    while(!statsExiting) {
+        lock();
+        getDoubleParam(QG_CtrlStatsPeriod, &period);
+        unlock();
+        statsEvent.wait((period > 0.0)? period : 1.0);
+        if(statsExiting) {
+            break;
+        }
+        for(int i=0; i<numAxes; i++) {
+            QgateAxis* pAxis = getQgateAxis(i);
+            if(pAxis) {
+                pAxis->updateStats();
+            }
+        }
+        updateLatency();
+    }
+    statsExitEvent.signal();
+}
+
+/** Hung link watchdog: checks every QGATE_WATCHDOG_PERIOD seconds that the
+  * request being sent has not overrun its deadline (QG_CtrlCmdDeadline seconds
+  * per request, see QgateIOQueue::setDeadline()), and recovers the controller session when it has.
+  * It takes no lock while the link is in use, so it is not held up by it,
+  * and only does parameter callbacks when the deadline statistics change. */
+void QgateController::watchdogThread() {
+    double requestDeadline = 0.0;
+    double elapsed = 0.0;
+    double worstTime = 0.0;
+    double lastWorstTime = -1.0;
+    size_t numOverruns = 0;
+    size_t lastOverruns = 0;
+    DllAdapterStatus result;
+    while(!watchdogExiting) {
+        watchdogEvent.wait(QGATE_WATCHDOG_PERIOD);
+        if(watchdogExiting) {
+            break;
+        }
+        lock();
+        getDoubleParam(QG_CtrlCmdDeadline, &requestDeadline);
+        unlock();
+        ioQueue.setDeadline(requestDeadline);
+        if(ioQueue.checkDeadline(elapsed)) {
+            recoverSession(elapsed);
+        }
+        if(ioQueue.getRecovered(result)) {
+            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, "QueensgateNPC: controller %s session re-opened: %s\n", 
+                        nameCtrl.c_str(), (result == DLL_ADAPTER_STATUS_SUCCESS)? "OK" : "failed");
+        }
+        ioQueue.getDeadlineStats(numOverruns, worstTime);
+        if(numOverruns != lastOverruns || worstTime != lastWorstTime) {
+            lastOverruns = numOverruns;
+            lastWorstTime = worstTime;
+            TakeLock takeLock(this);
+            setIntegerParam(QG_CtrlCmdOverruns, (int)numOverruns);
+            setDoubleParam(QG_CtrlCmdWorst, worstTime);
+        }
+    }
+    watchdogExitEvent.signal();
+}
+
+/** Recovers the controller session after a request overran its deadline.
+  * The controller is marked as disconnected, and the requesters waiting on the
+  * link fail at their deadline. DoCommand cannot be aborted, and the library
+  * calls block each other (manual 2.5), so closing the session from here would
+  * just hang too: the I/O thread closes and reopens it once the hung request
+  * returns, sending no other request meanwhile. The controller is then
+  * reconnected by the poller as after any disconnection.
+  * \param[in] elapsed Time taken so far by the hung request (secs) */
+void QgateController::recoverSession(double elapsed) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, "QueensgateNPC: controller %s request overran its deadline (%.3f secs): recovering session\n", 
+                nameCtrl.c_str(), elapsed);
+    {
+        TakeLock takeLock(this);
+        setIntegerParam(QG_CtrlConnected, 0);
+        if(connected) {
+            connected = false;
+            scheduleRetry(true);
+        }
+    }
+    ioQueue.recover(portDevice);
+}
+
+/** Publishes the request latency statistics and the link load. Every array
+  * is indexed by request type (QgateCommand, QGCMD_BATCH for multi-line
+  * requests), with latencies in milliseconds. */
+void QgateController::updateLatency() {
+    double calls[QGCMD_NUMTYPES], errors[QGCMD_NUMTYPES], timeouts[QGCMD_NUMTYPES];
+    double p50[QGCMD_NUMTYPES], p99[QGCMD_NUMTYPES], max[QGCMD_NUMTYPES];
+    double histogram[QG_LATENCY_NUMBINS], bins[QG_LATENCY_NUMBINS];
+    QgateLatencySummary summary;
+    double timeout = 1.0;
+    double maxRate = 0.0;
+    int selected = QGCMD_NUMTYPES;
+
+    {
+        TakeLock takeLock(this);
+        getDoubleParam(QG_CtrlCmdTimeout, &timeout);
+        getDoubleParam(QG_CtrlIOMaxRate, &maxRate);
+        getIntegerParam(QG_CtrlLatSelect, &selected);
+    }
+    latency.setTimeout(timeout);
+    ioQueue.setMaxRate(maxRate);
+
+    //Link load: fraction of time spent on requests since the last update
+    double busyTime = 0.0, load = 0.0;
+    size_t numServed = 0;
+    epicsTimeStamp now;
+    ioQueue.getLoad(busyTime, numServed);
+    epicsTimeGetCurrent(&now);
+    double elapsed = epicsTimeDiffInSeconds(&now, &ioLoadTime);
+    if(elapsed > 0.0) {
+        load = 100.0 * (busyTime - ioBusyTime) / elapsed;
+    }
+    ioBusyTime = busyTime;
+    ioLoadTime = now;
+    for(int i=0; i<QGCMD_NUMTYPES; i++) {
+        latency.getSummary(i, summary);
+        calls[i] = summary.calls;
+        errors[i] = summary.errors;
+        timeouts[i] = summary.timeouts;
+        p50[i] = summary.p50 * 1.0e3;
+        p99[i] = summary.p99 * 1.0e3;
+        max[i] = summary.max * 1.0e3;
+    }
+    //Out of range selects all the requests
+    latency.getHistogram((selected >= 0)? selected : latency.getTotalType(), histogram);
+    for(int i=0; i<QG_LATENCY_NUMBINS; i++) {
+        bins[i] = QgateLatencyStats::binLimits[i] * 1.0e3;
+    }
+    latency.getSummary(latency.getTotalType(), summary);
+
+    TakeLock takeLock(this);
+    doCallbacksFloat64Array(calls, QGCMD_NUMTYPES, QG_CtrlLatCalls, 0);
+    doCallbacksFloat64Array(errors, QGCMD_NUMTYPES, QG_CtrlLatErrors, 0);
+    doCallbacksFloat64Array(timeouts, QGCMD_NUMTYPES, QG_CtrlLatTimeouts, 0);
+    doCallbacksFloat64Array(p50, QGCMD_NUMTYPES, QG_CtrlLatP50, 0);
+    doCallbacksFloat64Array(p99, QGCMD_NUMTYPES, QG_CtrlLatP99, 0);
+    doCallbacksFloat64Array(max, QGCMD_NUMTYPES, QG_CtrlLatMax, 0);
+    doCallbacksFloat64Array(histogram, QG_LATENCY_NUMBINS, QG_CtrlLatHistogram, 0);
+    doCallbacksFloat64Array(bins, QG_LATENCY_NUMBINS - 1, QG_CtrlLatBins, 0);    //Last bin unbounded
+    setIntegerParam(QG_CtrlLatAllCalls, (int)summary.calls);
+    setIntegerParam(QG_CtrlLatAllErrors, (int)summary.errors);
+    setIntegerParam(QG_CtrlLatAllTimeouts, (int)summary.timeouts);
+    setDoubleParam(QG_CtrlLatAllP50, summary.p50 * 1.0e3);
+    setDoubleParam(QG_CtrlLatAllP99, summary.p99 * 1.0e3);
+    setDoubleParam(QG_CtrlLatAllMax, summary.max * 1.0e3);
+    setDoubleParam(QG_CtrlIOLoad, load);
+}
+
+/** Classifies a request for the latency statistics.
+  * \param[in] command Controller request
+  * \return command of a single-line request, QGCMD_BATCH for a multi-line
+  *         one, or QGCMD_NUMTYPES if not recognised */
+QgateCommand QgateController::requestType(const std::string &command) {
+    size_t end = command.find('\n');
+    if(end != std::string::npos && end + 1 < command.size()) {
+        return QGCMD_BATCH;
+    }
+    for(int i=0; i<QGCMD_NUM; i++) {
+        size_t length = strlen(qgateCommandTable[i].cmd);
+        if(command.compare(0, length, qgateCommandTable[i].cmd) == 0
+                && (command.size() == length || command[length] == ' ' || command[length] == '\n')) {
+            return (QgateCommand)i;
+        }
+    }
+    return QGCMD_NUMTYPES;
+}
+
+/** Processes the moves deferred by the motor records.
   * \param[in] deferMoves defer moves till later (true) or process moves now (false)
   * \return error if failed to communicate */
 asynStatus QgateController::setDeferredMoves(bool deferMoves) {
-    DllAdapterStatus result = DLL_ADAPTER_STATUS_ERROR_UNKNOWN_COMMAND;
     //coming from motorDeferMoves_
-    
     asynPrint(pasynUserSelf, ASYN_TRACEIO_FILTER, ".....Commanded to %sDEFER MOVES (%d)\n", (deferMoves)?"":"Flush ", deferMoves);
-    if(!deferMoves && deferringMode) {
+    QgateMoveGroup &group = *moveGroups[0];
+    if(!deferMoves && group.isDeferring()) {
         //Requesting to Flush moves
-        QGList listresName, listresVal;
-        std::string syncMove;
-                
-        printdefmoves();
-
-        //Compose deferred move message for the controller
-        for(int i=0; i<maxAxes; i++) {
-            syncMove.append(deferredMove[i]);
-            syncMove.append("\n");  //Separator between commands
-            deferredMove[i].clear();
-        }
-            
-        asynPrint(pasynUserSelf, ASYN_TRACEIO_FILTER, "Deferred moves requested: '\n%s'\n", syncMove.c_str());
-
-        deferringMode = false;
-        result = qg.DoCommand(syncMove.c_str(), listresName, listresVal);
-        if(result != DLL_ADAPTER_STATUS_SUCCESS) {
-            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, "Failed to execute deferred command: %d\n", result);
-            return asynError;
-        }
+        group.setDeferring(false);
+        return flushMoveGroup(group);
     }
     if (deferMoves) {
         //Enable deferring moves mode. Move requests on all axes are delayed until commanded
-        deferringMode = true;
+        group.setDeferring(true);
+    }
+    return asynSuccess;
+}
+
+/** Creates a named coordinated move group, deferred independently of the
+  * motor records through its own parameters: QGATE_GROUP_DEFER_<name> and
+  * QGATE_GROUP_FAILED_<name>. To be called before iocInit.
+  * \param[in] groupName Name of the group
+  * \param[in] axisList Axis stage numbers of the group, separated by commas (e.g. "1,2,3")
+  * \return error if the group could not be created */
+asynStatus QgateController::configMoveGroup(const char *groupName, const char *axisList) {
+    if(groupName == NULL || groupName[0] == '\0' || axisList == NULL 
+            || moveGroups.size() > QG_MAX_MOVE_GROUPS) {
+        return asynError;
+    }
+    for(size_t i=1; i<moveGroups.size(); i++) {
+        if(moveGroups[i]->getName() == groupName) {
+            return asynError;   //Already there
+        }
+    }
+    QgateMoveGroup *group = new QgateMoveGroup(groupName, numAxes);
+    std::istringstream axes(axisList);
+    std::string axis;
+    while(std::getline(axes, axis, ',')) {
+        int axisNum = atoi(axis.c_str());
+        bool grouped = false;
+        for(size_t i=1; i<moveGroups.size(); i++) {
+            grouped |= moveGroups[i]->hasAxis(axisNum);
+        }
+        if(axisNum < 1 || axisNum > numAxes || grouped) {
+            delete group;
+            return asynError;   //Not an axis, or already on another group
+        }
+        group->addAxis(axisNum);
     }
+    std::string paramName(QG_GroupDeferCmd);
+    createParam(paramName.append(groupName).c_str(), asynParamInt32, &group->deferParam);
+    paramName.assign(QG_GroupFailedCmd);
+    createParam(paramName.append(groupName).c_str(), asynParamInt32, &group->failedParam);
+    setIntegerParam(group->deferParam, 0);
+    setIntegerParam(group->failedParam, 0);
+    moveGroups.push_back(group);
     return asynSuccess;
 }
 
+/** Finds the group deferring the moves of an axis: its named group, or else the motor records' group.
+  * \param[in] axisNum Axis stage number [1..n]
+  * \return group deferring the axis' moves, NULL if not deferred */
+QgateMoveGroup* QgateController::getDeferringGroup(int axisNum) {
+    for(size_t i=1; i<moveGroups.size(); i++) {
+        if(moveGroups[i]->hasAxis(axisNum) && moveGroups[i]->isDeferring()) {
+            return moveGroups[i];
+        }
+    }
+    return (moveGroups[0]->isDeferring())? moveGroups[0] : NULL;
+}
+
+/** Discards the deferred move of an axis, if any.
+  * \param[in] axisNum Axis stage number [1..n]
+  * \return true if the axis' moves are being deferred */
+bool QgateController::cancelDeferredMove(int axisNum) {
+    bool deferring = false;
+    for(size_t i=0; i<moveGroups.size(); i++) {
+        if(moveGroups[i]->hasAxis(axisNum)) {
+            deferring |= moveGroups[i]->cancel(axisNum);
+        }
+    }
+    return deferring;
+}
+
+/** Tells if a command of a multi-line reply failed: its values replied as
+  * "FAILED" by the controller (2.4), or not replied at all.
+  * \param[in] reply Multi-line request reply
+  * \param[in] first Position of the command's first value on the reply
+  * \param[in] count Amount of values replied by the command
+  * \return true if the command failed */
+static bool isReplyFailed(const QgateReply &reply, size_t first, size_t count) {
+    if(first + count > reply.size()) {
+        return true;
+    }
+    for(size_t i=first; i<first+count; i++) {
+        if(strncmp(reply.value(i), "FAILED", 6) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/** Sends all the moves pending on a group in a single multi-line request,
+  * and tells each axis the outcome of its own move, decoded from its line of
+  * the reply: only the moves replied "FAILED", or not replied (when the
+  * request fails part way), are failed. A failed move is never sent again,
+  * as sending the group again could repeat the moves already done.
+  * Must be called with the lock taken.
+  * \param[in] group Group to flush
+  * \return error if any move failed */
+asynStatus QgateController::flushMoveGroup(QgateMoveGroup &group) {
+    if(group.flushing) {
+        return asynError;   //Already being flushed
+    }
+    group.flushing = true;
+    printdefmoves();
+    std::vector<int> &axes = group.flushAxes;
+    size_t numMoves = group.getPending(axes);
+    int numFailed = 0;
+    QgateRequest &request = group.request;
+    request.axisNum = 0;
+    if(numMoves > 0) {
+        request.command.clear();
+        for(size_t i=0; i<numMoves; i++) {
+            request.command.append(group.getMove(axes[i]));
+            request.command.append(1, '\n');  //Separator between commands
+        }
+        asynPrint(pasynUserSelf, ASYN_TRACEIO_FILTER, "Deferred moves requested: '\n%s'\n", request.command.c_str());
+        DllAdapterStatus result = sendRequest(request, QgateIOQueue::PRIORITY_HIGH);
+        bool securityRefused = (result != DLL_ADAPTER_STATUS_SUCCESS && isSecurityError(request));
+        if(securityRefused) {
+            securityCheckForced = true;     //Check security level on next poll
+        }
+        //Replies in command order, as many values per move
+        size_t numReplies = qgateCommandTable[QGCMD_POS_ABSOLUTE_SET].numReplies;
+        for(size_t i=0; i<numMoves; i++) {
+            bool failed = isReplyFailed(request.reply, i * numReplies, numReplies);
+            if(failed) {
+                numFailed++;
+            }
+            QgateAxis* pAxis = getQgateAxis(axes[i]-1);
+            if(pAxis == NULL) {
+                continue;
+            }
+            if(failed) {
+                //Not replied: lost on the link, unless refused for security
+                bool commsError = (i * numReplies >= request.reply.size()) && !securityRefused;
+                pAxis->moveCompleted(false, commsError);
+            } else {
+                pAxis->moveStarted();
+            }
+        }
+        if(numFailed > 0) {
+            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, "Controller %s failed %d of %d deferred moves of group '%s'\n", 
+                        nameCtrl.c_str(), numFailed, (int)numMoves, group.getName().c_str());
+        }
+    }
+    for(size_t i=0; i<numMoves; i++) {
+        group.cancel(axes[i]);
+    }
+    group.flushing = false;
+    setIntegerParam(group.failedParam, numFailed);
+    callParamCallbacks();
+    if(numFailed < (int)numMoves) {
+        wakeupPoller();     //Moves started: poll them as moving straight away
+    }
+    return (numFailed == 0)? asynSuccess : asynError;
+}
+
+/** Handles the writes to integer parameters not handled by the motor controller.
+  * \param[in] pasynUser asynUser structure that encodes the reason and address
+  * \param[in] value Value to write
+  * \return error if the value could not be applied */
+asynStatus QgateController::writeInt32(asynUser *pasynUser, epicsInt32 value) {
+    int function = pasynUser->reason;
+    int axisNo = 0;
+
+    if(function == QG_AxisAcq) {
+        //Sensor buffered acquisition start/stop
+        getAddress(pasynUser, &axisNo);
+        QgateAxis* pAxis = getQgateAxis(axisNo);
+        if(pAxis == NULL || !pAxis->setAcquisition(value != 0)) {
+            return asynError;
+        }
+        setIntegerParam(axisNo, function, value);
+        callParamCallbacks(axisNo);
+        return asynSuccess;
+    }
+    for(size_t i=1; i<moveGroups.size(); i++) {
+        if(function == moveGroups[i]->deferParam) {
+            //Named move group: defer its moves, or flush them
+            QgateMoveGroup &group = *moveGroups[i];
+            setIntegerParam(function, value);
+            callParamCallbacks();
+            if(value) {
+                group.setDeferring(true);
+            } else if(group.isDeferring()) {
+                group.setDeferring(false);
+                return flushMoveGroup(group);
+            }
+            return asynSuccess;
+        }
+    }
+    if(function == QG_AxisSettleReset) {
+        //Forget the settle times learned
+        getAddress(pasynUser, &axisNo);
+        QgateAxis* pAxis = getQgateAxis(axisNo);
+        if(pAxis == NULL) {
+            return asynError;
+        }
+        pAxis->resetSettle();
+        return asynSuccess;
+    }
+    if(function == QG_AxisFbEnable) {
+        //Feedback loop closed/opened
+        getAddress(pasynUser, &axisNo);
+        QgateAxis* pAxis = getQgateAxis(axisNo);
+        setIntegerParam(axisNo, function, value);
+        bool applied = (pAxis != NULL && pAxis->updateFeedback());
+        if(!applied) {
+            setIntegerParam(axisNo, function, 0);
+        }
+        callParamCallbacks(axisNo);
+        return (applied)? asynSuccess : asynError;
+    }
+    if(function == QG_CtrlStopAll) {
+        return stopAll();
+    }
+    if(function == QG_CtrlLatReset) {
+        //Clear the latency statistics and publish them straight away
+        latency.reset();
+        updateLatency();
+        return asynSuccess;
+    }
+    return asynMotorController::writeInt32(pasynUser, value);
+}
+
+/** Handles the writes to float parameters, passing the new feedback settings to its loop.
+  * \param[in] pasynUser asynUser structure that encodes the reason and address
+  * \param[in] value Value to write
+  * \return error if the value could not be applied */
+asynStatus QgateController::writeFloat64(asynUser *pasynUser, epicsFloat64 value) {
+    int function = pasynUser->reason;
+    int axisNo = 0;
+
+    asynStatus status = asynMotorController::writeFloat64(pasynUser, value);
+    if(function == QG_AxisFbSetpoint || function == QG_AxisFbKp || function == QG_AxisFbKi ||
+                function == QG_AxisFbKd || function == QG_AxisFbOutLow || function == QG_AxisFbOutHigh) {
+        getAddress(pasynUser, &axisNo);
+        QgateAxis* pAxis = getQgateAxis(axisNo);
+        if(pAxis == NULL || !pAxis->updateFeedback()) {
+            status = asynError;
+        }
+    }
+    return status;
+}
+
+/** Enables the profile moves, creating the profile thread.
+  * To be called once all the axes are created.
+  * \param[in] maxPoints Maximum amount of points of a profile
+  * \return error if already configured or invalid amount of points */
+asynStatus QgateController::configProfile(size_t maxPoints) {
+    if(profile != NULL || maxPoints < 1) {
+        return asynError;
+    }
+    TakeLock takeLock(this);
+    initializeProfile(maxPoints);
+    profile = new QgateProfile(*this);
+    return asynSuccess;
+}
+
+/** Enables the shared memory export of the live axis state (see queensgateNPCshm.h),
+  * updated by the poller on every poll.
+  * \return error if already configured or the region could not be created */
+asynStatus QgateController::configSharedMemory() {
+    TakeLock takeLock(this);
+    if(shmExport != NULL) {
+        return asynError;
+    }
+    shmExport = QgateShmExport::create(nameCtrl, numAxes);
+    return (shmExport != NULL)? asynSuccess : asynError;
+}
+
+/** Builds the profile move, checking it can be executed.
+  * \return error if not valid, or profile moves not configured */
+asynStatus QgateController::buildProfile() {
+    if(profile == NULL) {
+        setIntegerParam(profileBuildStatus_, PROFILE_STATUS_FAILURE);
+        setStringParam(profileBuildMessage_, "Profile moves not configured");
+        callParamCallbacks();
+        return asynError;
+    }
+    return profile->build();
+}
+
+/** Starts executing the profile move, on the profile thread.
+  * \return error if not built, or profile moves not configured */
+asynStatus QgateController::executeProfile() {
+    if(profile == NULL) {
+        setIntegerParam(profileExecuteStatus_, PROFILE_STATUS_FAILURE);
+        setStringParam(profileExecuteMessage_, "Profile moves not configured");
+        callParamCallbacks();
+        return asynError;
+    }
+    return profile->execute();
+}
+
+/** Aborts the profile move being executed.
+  * \return error if profile moves not configured */
+asynStatus QgateController::abortProfile() {
+    return (profile == NULL)? asynError : profile->abort();
+}
+
+/** Publishes the positions and times captured by the last profile move.
+  * \return error if being executed, or profile moves not configured */
+asynStatus QgateController::readbackProfile() {
+    if(profile == NULL) {
+        setIntegerParam(profileReadbackStatus_, PROFILE_STATUS_FAILURE);
+        setStringParam(profileReadbackMessage_, "Profile moves not configured");
+        callParamCallbacks();
+        return asynError;
+    }
+    return profile->readback();
+}
+
+/** Stops all the stages at once, in a single request sent ahead of any other
+  * request waiting. Deferred moves are discarded and any profile move aborted.
+  * Must be called with the lock taken.
+  * \return error if failed to communicate */
+asynStatus QgateController::stopAll() {
+    if(profile != NULL) {
+        profile->abort();
+    }
+    QgateRequest *request = ioQueue.acquire();
+    int numStopped = 0;
+    for(int i=0; i<numAxes; i++) {
+        QgateAxis* pAxis = getQgateAxis(i);
+        if(pAxis && pAxis->appendStop(request->command)) {
+            numStopped++;
+        }
+    }
+    DllAdapterStatus result = DLL_ADAPTER_STATUS_SUCCESS;
+    if(numStopped > 0) {
+        asynPrint(pasynUserSelf, ASYN_TRACEIO_FILTER, "Controller %s stopping %d stages: '%s'\n", nameCtrl.c_str(), numStopped, request->command.c_str());
+        result = sendRequest(*request, QgateIOQueue::PRIORITY_HIGH);
+        wakeupPoller();
+    }
+    ioQueue.release(request);
+    return (result == DLL_ADAPTER_STATUS_SUCCESS)? asynSuccess : asynError;
+}
+
 /** Prints all the pending deferred move Controller commands */
 void QgateController::printdefmoves() {
-    for (unsigned int i=0;i<deferredMove.size();i++) {
-        asynPrint(pasynUserSelf, ASYN_TRACEIO_FILTER, "\t[%d]=%s\n", i, deferredMove[i].c_str());
+    for(size_t g=0; g<moveGroups.size(); g++) {
+        for(int i=1; i<=numAxes; i++) {
+            if(moveGroups[g]->hasAxis(i)) {
+                asynPrint(pasynUserSelf, ASYN_TRACEIO_FILTER, "\t%s[%d]=%s\n", 
+                            moveGroups[g]->getName().c_str(), i, moveGroups[g]->getMove(i).c_str());
+            }
+        }
     }
 }
 
-/** Process a Move command request and send it to the Controller
-  * \param[in] cmd Controller basic command string.
+/** Process a Move command request and send it to the Controller.
+  * The move is queued ahead of polling and its outcome is delivered later
+  * to requestCompleted(), so the motor record is not held by the link.
+  * \param[in] cmd Controller command string, already rendered for the axis (see QgateCommandSet).
   * \param[in] axisNum Axis stage to move
   * \param[in] value Amount of movement
+  * \param[out] deferred Set when the move was kept by a deferring group, started once flushed
   * \return error if failed to communicate */
-DllAdapterStatus QgateController::moveCmd(std::string cmd, int axisNum, double value) {
-    DllAdapterStatus result = DLL_ADAPTER_STATUS_ERROR_UNKNOWN_COMMAND;
-    QGList listresName, listresVal;
-    std::ostringstream stageCmd;    //Used for composing full command
-   
+DllAdapterStatus QgateController::moveCmd(const std::string &cmd, int axisNum, double value, bool &deferred) {
+    char valueStr[QG_VALUE_STRLEN];
+
     //Compose move command for controller
-    stageCmd << cmd << " " << axisNum << " " << std::fixed << value;
+    snprintf(valueStr, QG_VALUE_STRLEN, " %f", value);
 
-    //The Controller stores all the axes' move request to be able to execute them in one go
-    if (deferringMode) {
+    //The Controller stores the move requests of a deferring group to be able to execute them in one go
+    QgateMoveGroup *group = getDeferringGroup(axisNum);
+    deferred = (group != NULL);
+    if(group != NULL) {
         //Store the request
-        deferredMove[axisNum-1] = stageCmd.str();   //Only the last request is stored per axis
+        group->store(axisNum, cmd, valueStr);   //Only the last request is stored per axis
         printdefmoves();        //Print current list of moves
         return DLL_ADAPTER_STATUS_SUCCESS;
     }
 
-    asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER, "Stage %s-%d moving CMD:'%s'\n", nameCtrl.c_str(), axisNum, stageCmd.str().c_str());
-    result = qg.DoCommand(stageCmd.str().c_str(), listresName, listresVal);
+    QgateRequest *request = ioQueue.acquire();
+    request->command.assign(cmd);
+    request->command.append(valueStr);
+    request->axisNum = axisNum;
+    request->type = requestType(request->command);
+    request->completion = this;
+    asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER, "Stage %s-%d moving CMD:'%s'\n", nameCtrl.c_str(), axisNum, request->command.c_str());
+    ioQueue.submit(*request, QgateIOQueue::PRIORITY_HIGH);
+    return DLL_ADAPTER_STATUS_SUCCESS;
+}
+
+/** Receives the outcome of a move request, from the I/O thread.
+  * \param[in] request Request processed, given back to the queue from here */
+void QgateController::requestCompleted(QgateRequest &request) {
+    TakeLock takeLock(this);    //Parameter callbacks done when released
+    bool refused = false;       //Move refused by the controller, rather than lost on the link
+    if(request.result==DLL_ADAPTER_STATUS_SUCCESS) {
+        refused = isReplyFailed(request.reply, 0, qgateCommandTable[QGCMD_POS_ABSOLUTE_SET].numReplies);
+        if(refused) {
+            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, "Stage %s-%d move refused by the controller --> %s\n",
+                        nameCtrl.c_str(), request.axisNum, request.command.c_str());
+        }
+        double newValue = 0.0;
+        request.reply.getDouble(0, newValue);
+        double resultMicrons = PM_TO_MICRONS(newValue);
+        asynPrint(pasynUserSelf, ASYN_TRACEIO_FILTER, "Stage %s-%d requested '%s', moved=%lf (%lf microns)\n",
+                    nameCtrl.c_str(), request.axisNum, request.command.c_str(), newValue, resultMicrons);
+    } else {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, "Stage %s-%d Failed request %d: %s --> %s\n",
+                    nameCtrl.c_str(), request.axisNum, request.result, request.errorText.c_str(), request.command.c_str());
+        if(isSecurityError(request)) {
+            securityCheckForced = true;     //Check security level on next poll
+            refused = true;
+        }
+    }
+    QgateAxis* pAxis = getQgateAxis(request.axisNum-1);
+    if(pAxis) {
+        bool success = (request.result==DLL_ADAPTER_STATUS_SUCCESS) && !refused;
+        pAxis->moveCompleted(success, !success && !refused);
+    }
+    ioQueue.release(&request);
+}
 
+/** Sends a request to the Controller through the I/O thread and waits for its outcome.
+  * Must be called with the lock taken: it is released while waiting, so other
+  * requesters (e.g. the motor record) are not blocked by the link meanwhile.
+  * No parameter callbacks are done, so a poll publishes its updates at once.
+  * \param[in,out] request Request to send. Returns with its result and reply.
+  * \param[in] priority Urgency of the request
+  * \return error if failed to communicate */
+DllAdapterStatus QgateController::sendRequest(QgateRequest &request, QgateIOQueue::PRIORITY priority) {
+    DllAdapterStatus result = DLL_ADAPTER_STATUS_ERROR_UNKNOWN_COMMAND;
+    request.type = requestType(request.command);
+    //Plain unlock: parameter callbacks only done where the caller intends them
+    unlock();
+    result = ioQueue.execute(request, priority);
+    lock();
+    replySampled = request.sampled;
+    replyUncertainty = request.roundTrip / 2.0;
     if(result==DLL_ADAPTER_STATUS_SUCCESS) {
-        asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER, "Stage %s-%d request's reply:'%s'\n", nameCtrl.c_str(), axisNum, listresVal.print().c_str());
-        //XXX:
-        double resultMicrons = PM_TO_MICRONS(atof(listresVal.begin()->c_str()));
-        double newValue = atof(listresVal.begin()->c_str());
-        asynPrint(pasynUserSelf, ASYN_TRACEIO_FILTER, "Stage %s-%d %s requested to move req=%lf, moved=%lf (%lf microns)\n", 
-                    nameCtrl.c_str(), axisNum, (result==DLL_ADAPTER_STATUS_SUCCESS)?"":"NOT", value, newValue, resultMicrons);
+        if(pasynTrace->getTraceMask(pasynUserSelf) & ASYN_TRACEIO_DRIVER) {
+            asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER, "Stage %s-%d request's reply:'%s'\n", nameCtrl.c_str(), request.axisNum, request.reply.print().c_str());
+        }
     } else {
-        std::ostringstream errorStr;
-        qg.GetErrorText(errorStr, result);
-        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, "Stage %s-%d Failed request %d: %s --> %s\n", nameCtrl.c_str(), axisNum, result, errorStr.str().c_str(), stageCmd.str().c_str());
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, "Stage %s-%d Failed request %d: %s --> %s\n", nameCtrl.c_str(), request.axisNum, result, request.errorText.c_str(), request.command.c_str());
     }
     return result;
 }
 
+/** Sends a command request to the Controller, ignoring its reply.
+  * \param[in] cmd Controller command string, already rendered for the axis (see QgateCommandSet).
+  * \param[in] axisNum Axis stage the command is for, 0 if no stage implied (i.e. a command for the Controller)
+  * \return error if failed to communicate */
+DllAdapterStatus QgateController::sendCmd(const std::string &cmd, int axisNum) {
+    QgateRequest *request = ioQueue.acquire();
+    request->command.assign(cmd);
+    request->axisNum = axisNum;
+    DllAdapterStatus result = sendRequest(*request);
+    ioQueue.release(request);
+    return result;
+}
+
 /** Process any Get command request and send it to the Controller, obtaining the outcome
-  * \param[in] cmd Controller basic command string.
+  * \param[in] cmd Controller command string, already rendered for the axis (see QgateCommandSet).
   * \param[in] axisNum Axis stage to move, 0 if no stage implied (i.e. a command for the Controller)
   * \param[out] value Data from Controller reply
   * \param[in] valueID Index of the data to get from Controller reply
   * \return error if failed to communicate */
-DllAdapterStatus QgateController::getCmd(std::string cmd, int axisNum, std::string &value, int valueID) {
+DllAdapterStatus QgateController::getCmd(const std::string &cmd, int axisNum, std::string &value, int valueID) {
     DllAdapterStatus result = DLL_ADAPTER_STATUS_ERROR_UNKNOWN_COMMAND;
-    QGList listresName, listresVal;
-    std::ostringstream stageCmd;    //Used for composing full command
+    QgateRequest *request = ioQueue.acquire();
 
-    //Compose command for controller
-    stageCmd << cmd;
-    if(axisNum > 0) {
-        //Axis 0 is the controller itself and does not need this parameter on the string to send
-        stageCmd << " " << axisNum;
-    }
-    asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER, "Stage %s-%d requesting CMD:'%s'\n", nameCtrl.c_str(), axisNum, stageCmd.str().c_str());
-    result = qg.DoCommand(stageCmd.str().c_str(), listresName, listresVal);
+    asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER, "Stage %s-%d requesting CMD:'%s'\n", nameCtrl.c_str(), axisNum, cmd.c_str());
+    request->command.assign(cmd);
+    request->axisNum = axisNum;
+    result = sendRequest(*request);
     if(result==DLL_ADAPTER_STATUS_SUCCESS) {
-        value = listresVal.find(valueID);
-        asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER, "Stage %s-%d request's reply:'%s'\n", nameCtrl.c_str(), axisNum, value.c_str());
+        value.assign(request->reply.value(valueID), request->reply.valueLength(valueID));
     } else {
-        std::ostringstream errorStr;
-        qg.GetErrorText(errorStr, result);
-        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, "Stage %s-%d Failed request %d: %s --> %s\n", nameCtrl.c_str(), axisNum, result, errorStr.str().c_str(), stageCmd.str().c_str());
         value.clear();  //return empty string
     }
+    ioQueue.release(request);
+    return result;
+}
+
+/** Process a Get command request of an integer value and send it to the Controller, obtaining the outcome
+  * \param[in] cmd Controller command string, already rendered for the axis (see QgateCommandSet).
+  * \param[in] axisNum Axis stage to move, 0 if no stage implied (i.e. a command for the Controller)
+  * \param[out] value Data from Controller reply
+  * \param[in] valueID Index of the data to get from Controller reply
+  * \return error if failed to communicate or the reply is not a number */
+DllAdapterStatus QgateController::getCmd(const std::string &cmd, int axisNum, int &value, int valueID) {
+    DllAdapterStatus result = DLL_ADAPTER_STATUS_ERROR_UNKNOWN_COMMAND;
+    QgateRequest *request = ioQueue.acquire();
+
+    asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER, "Stage %s-%d requesting CMD:'%s'\n", nameCtrl.c_str(), axisNum, cmd.c_str());
+    request->command.assign(cmd);
+    request->axisNum = axisNum;
+    result = sendRequest(*request);
+    if(result==DLL_ADAPTER_STATUS_SUCCESS && !request->reply.getInt(valueID, value)) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, "Stage %s-%d unexpected reply '%s' --> %s\n", nameCtrl.c_str(), axisNum, request->reply.value(valueID), cmd.c_str());
+        result = DLL_ADAPTER_STATUS_ERROR_UNKNOWN_COMMAND;
+    }
+    ioQueue.release(request);
     return result;
 }
 
+/** Process a Get command request of a floating point value and send it to the Controller, obtaining the outcome
+  * \param[in] cmd Controller command string, already rendered for the axis (see QgateCommandSet).
+  * \param[in] axisNum Axis stage to move, 0 if no stage implied (i.e. a command for the Controller)
+  * \param[out] value Data from Controller reply
+  * \param[in] valueID Index of the data to get from Controller reply
+  * \return error if failed to communicate or the reply is not a number */
+DllAdapterStatus QgateController::getCmd(const std::string &cmd, int axisNum, double &value, int valueID) {
+    DllAdapterStatus result = DLL_ADAPTER_STATUS_ERROR_UNKNOWN_COMMAND;
+    QgateRequest *request = ioQueue.acquire();
+
+    asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER, "Stage %s-%d requesting CMD:'%s'\n", nameCtrl.c_str(), axisNum, cmd.c_str());
+    request->command.assign(cmd);
+    request->axisNum = axisNum;
+    result = sendRequest(*request);
+    if(result==DLL_ADAPTER_STATUS_SUCCESS && !request->reply.getDouble(valueID, value)) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, "Stage %s-%d unexpected reply '%s' --> %s\n", nameCtrl.c_str(), axisNum, request->reply.value(valueID), cmd.c_str());
+        result = DLL_ADAPTER_STATUS_ERROR_UNKNOWN_COMMAND;
+    }
+    ioQueue.release(request);
+    return result;
+}
+
+/** Gets the Queensgate axis object for a given axis index
+  * \param[in] axisNo Axis index number [0..n-1]
+  * \return axis object, or NULL if the axis is not configured */
+QgateAxis* QgateController::getQgateAxis(int axisNo) {
+    return static_cast<QgateAxis*>(getAxis(axisNo));
+}
+
+/** Gets a poll scheduler setting, as a poll count
+  * \param[in] index Index of the scheduler parameter (e.g. QG_PollDivider[QGPOLL_IDLE])
+  * \return setting value, at least 1 */
+int QgateController::getPollParam(int index) {
+    int value = 1;
+    getIntegerParam(index, &value);
+    return (value < 1)? 1 : value;
+}
+
+/** Tells when the reply of the last request sent was sampled.
+  * Must be called with the lock taken, straight after the request.
+  * \param[out] sampled Estimated time of the sampling: midpoint of the request's round trip
+  * \param[out] uncertainty Half the round trip (secs) */
+void QgateController::getReplyTime(epicsTimeStamp &sampled, double &uncertainty) {
+    sampled = replySampled;
+    uncertainty = replyUncertainty;
+}
+
+/** Sets the timestamp of the parameter callbacks, through the port's timestamp source.
+  * Must be called with the lock taken.
+  * \param[in] sampled Time the values were sampled, NULL for the current time */
+void QgateController::setReadingTime(const epicsTimeStamp *sampled) {
+    readingTimeSet = (sampled != NULL);
+    if(readingTimeSet) {
+        readingTime = *sampled;
+    }
+    updateTimeStamp();
+}
+
+/** Port's timestamp source: the time the readbacks being published were
+  * sampled, or the current time.
+  * \param[out] timeStamp Timestamp for the parameter callbacks */
+void QgateController::getReadingTime(epicsTimeStamp *timeStamp) {
+    if(readingTimeSet) {
+        *timeStamp = readingTime;
+    } else {
+        epicsTimeGetCurrent(timeStamp);
+    }
+}
+
+/** Wakes up the poller after a delay, unless it is already due to be woken up earlier.
+  * Used by the axes to poll around the time they expect their moves completed.
+  * \param[in] delay Time from now (secs) */
+void QgateController::scheduleWakeup(double delay) {
+    epicsTime expireTime = epicsTime::getCurrent() + delay;
+    {
+        TakeLock takeLock(&wakeupMutex);
+        if(wakeupPending && (wakeupTime - expireTime) <= 0.0) {
+            return;     //Woken up earlier anyway
+        }
+        wakeupPending = true;
+        wakeupTime = expireTime;
+    }
+    wakeupTimer.start(*this, expireTime);
+}
+
+/** Wake-up timer expired: polls straight away, from the timer thread.
+  * \param[in] currentTime Time of expiration
+  * \return no restart, as the axes schedule the next wake-up when polled */
+epicsTimerNotify::expireStatus QgateController::expire(const epicsTime &currentTime) {
+    {
+        TakeLock takeLock(&wakeupMutex);
+        wakeupPending = false;
+    }
+    wakeupPoller();
+    return expireStatus(noRestart);
+}
+
 /** Gets the Library Controller adapter object associated to this
   * \return controller adapter object */
-DllAdapter& QgateController::getAdapter() {
+QgateAdapter& QgateController::getAdapter() {
     return qg;
 }
 
@@ -419,7 +1681,8 @@ DllAdapter& QgateController::getAdapter() {
   * \return true if stage is present */
 bool QgateController::isAxisPresent(int axisNum) {
     std::string value;  //Store result here
-    if(getCmd("identity.stage.part.get", axisNum, value) == DLL_ADAPTER_STATUS_SUCCESS) {
+    QgateCommandSet stageCmd(axisNum);
+    if(getCmd(stageCmd[QGCMD_STAGE_PART], axisNum, value) == DLL_ADAPTER_STATUS_SUCCESS) {
         //THe Queensgate Controller reports non-connected stage as "FAILED"
         if(value.compare("FAILED")) {
                 //Stage connected
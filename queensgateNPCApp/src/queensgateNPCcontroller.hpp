@@ -3,11 +3,20 @@
 
 #include <asynMotorController.h>
 #include <asynMotorAxis.h>
+#include <epicsMutex.h>
+#include <epicsTime.h>
+#include <epicsEvent.h>
+#include <epicsTimer.h>
 #include <TakeLock.h>
 #include <FreeLock.h>
 
 #include "controller_interface.h"
-#include "dll_adapter.hpp"
+#include "queensgateNPCadapter.hpp"
+
+#include "queensgateNPCreply.hpp"
+#include "queensgateNPCio.hpp"
+#include "queensgateNPCgroup.hpp"
+#include "queensgateNPCexport.hpp"
 
 //Convert native picometres to micrometres
 #define PM_TO_MICRONS(value)    ((value) * 1.0e-6 )
@@ -50,6 +59,70 @@
                     reply: (value)=(1)      [0 or 1]
  */
 
+/* Controller commands, as documented above. Index to the command table */
+enum QgateCommand {
+    QGCMD_CTRL_STATUS = 0,      //controller.status.get
+    QGCMD_CTRL_PART,            //identity.hardware.part.get
+    QGCMD_CTRL_SERIAL,          //identity.hardware.serial.get
+    QGCMD_CTRL_VERSION,         //identity.software.version.get
+    QGCMD_SECURITY_GET,         //controller.security.user.get
+    QGCMD_SECURITY_SET,         //controller.security.user.set
+    QGCMD_STAGE_CONNECTED,      //stage.status.stage-connected.get
+    QGCMD_STAGE_PART,           //identity.stage.part.get
+    QGCMD_POS_ABSOLUTE_GET,     //stage.position.absolute-command.get
+    QGCMD_POS_ABSOLUTE_SET,     //stage.position.absolute-command.set
+    QGCMD_POS_RELATIVE_GET,     //stage.position.command.get
+    QGCMD_POS_RELATIVE_SET,     //stage.position.command.set
+    QGCMD_POS_MEASURED,         //stage.position.measured.get
+    QGCMD_INPOS_UNCONFIRMED,    //stage.status.in-position.unconfirmed.get
+    QGCMD_INPOS_LPF,            //stage.status.in-position.lpf-confirmed.get
+    QGCMD_INPOS_WINDOW,         //stage.status.in-position.window-filter-confirmed.get
+    QGCMD_STAGE_MOVING,         //stage.status.stage-moving.get
+    QGCMD_DIGITAL_MODE,         //stage.mode.digital-command.get
+    QGCMD_NUM,                  //Amount of commands
+    QGCMD_BATCH = QGCMD_NUM,    //Multi-line request (batched poll, deferred moves), for latency statistics
+    QGCMD_NUMTYPES              //Amount of request types, for latency statistics
+};
+
+//Controller command table entry
+struct QgateCommandDef {
+    const char* cmd;        //Command string
+    int numReplies;         //Amount of values in the command reply
+};
+extern const QgateCommandDef qgateCommandTable[QGCMD_NUM];
+
+#define QG_SECURITY_USER_CODE   "0xDEC0DED"     //User level code
+#define QG_SECURITY_USER_LEVEL  "Queensgate user"   //Security level reported when at user level
+#define QG_IDENTITY_CACHE_EXT   ".identity"     //Extension of the controller identity cache files
+#define QG_VALUE_STRLEN         (32)            //Max length of a formatted value sent to the controller
+
+//Controller command strings already rendered for a given axis
+class QgateCommandSet {
+public:
+    QgateCommandSet(int axisNum=0);
+    const std::string& operator[](QgateCommand cmd) const { return cmds[cmd]; }
+private:
+    std::string cmds[QGCMD_NUM];
+};
+
+//Stage identification, as retrieved along with the controller's
+struct QgateStageIdentity {
+    bool connected;         //Stage connected to the channel
+    std::string part;       //Stage part number, "FAILED" if not connected
+};
+
+/* Axis polling states, used by the axes' poll scheduler.
+ * Each state has its own poll divider: the axis is polled once every
+ * that many poll cycles, so the link is spent on the axes that move. */
+enum QgatePollState {
+    QGPOLL_MOVING = 0,          //Axis reported moving
+    QGPOLL_SETTLING,            //Axis stopped recently: still settling in position
+    QGPOLL_IDLE,                //Axis not moving
+    QGPOLL_DISCONNECTED,        //No stage connected: only checks reconnection
+    QGPOLL_SENSOR,              //Sensor: position only, never moves
+    QGPOLL_NUMSTATES            //Amount of polling states
+};
+
 /* EPICS asyn Commands */
 #define QG_CtrlConnectedCmd         "QGATE_CONNECTED"
 #define QG_CtrlStatusCmd            "QGATE_STATUS"
@@ -60,7 +133,53 @@
 #define QG_CtrlMaxAxesCmd           "QGATE_MAXAXES"
 #define QG_CtrlDLLverCmd            "QGATE_DLLVER"
 #define QG_CtrlSecurityCmd          "QGATE_SECURITY"
+#define QG_CtrlSecurityPeriodCmd    "QGATE_SECURITY_PERIOD"
+#define QG_CtrlSecurityCheckedCmd   "QGATE_SECURITY_CHECKED"
+#define QG_CtrlSecurityEnforcedCmd  "QGATE_SECURITY_ENFORCED"
+#define QG_CtrlRetryMinCmd          "QGATE_RETRY_MIN"
+#define QG_CtrlRetryMaxCmd          "QGATE_RETRY_MAX"
+#define QG_CtrlRetryDelayCmd        "QGATE_RETRY_DELAY"
+#define QG_CtrlRetryNextCmd         "QGATE_RETRY_NEXT"
+#define QG_CtrlStatsPeriodCmd       "QGATE_STATS_PERIOD"
+#define QG_CtrlCmdTimeoutCmd        "QGATE_CMD_TIMEOUT"
+#define QG_CtrlCmdDeadlineCmd       "QGATE_CMD_DEADLINE"
+#define QG_CtrlCmdOverrunsCmd       "QGATE_CMD_OVERRUNS"
+#define QG_CtrlCmdWorstCmd          "QGATE_CMD_WORST"
+#define QG_CtrlIOMaxRateCmd         "QGATE_IO_MAXRATE"
+#define QG_CtrlIOLoadCmd            "QGATE_IO_LOAD"
+#define QG_CtrlLatResetCmd          "QGATE_LAT_RESET"
+#define QG_CtrlLatCallsCmd          "QGATE_LAT_CALLS"
+#define QG_CtrlLatErrorsCmd         "QGATE_LAT_ERRORS"
+#define QG_CtrlLatTimeoutsCmd       "QGATE_LAT_TIMEOUTS"
+#define QG_CtrlLatP50Cmd            "QGATE_LAT_P50"
+#define QG_CtrlLatP99Cmd            "QGATE_LAT_P99"
+#define QG_CtrlLatMaxCmd            "QGATE_LAT_MAX"
+#define QG_CtrlLatSelectCmd         "QGATE_LAT_SELECT"
+#define QG_CtrlLatHistogramCmd      "QGATE_LAT_HISTOGRAM"
+#define QG_CtrlLatBinsCmd           "QGATE_LAT_BINS"
+#define QG_CtrlLatAllCallsCmd       "QGATE_LAT_ALL_CALLS"
+#define QG_CtrlLatAllErrorsCmd      "QGATE_LAT_ALL_ERRORS"
+#define QG_CtrlLatAllTimeoutsCmd    "QGATE_LAT_ALL_TIMEOUTS"
+#define QG_CtrlLatAllP50Cmd         "QGATE_LAT_ALL_P50"
+#define QG_CtrlLatAllP99Cmd         "QGATE_LAT_ALL_P99"
+#define QG_CtrlLatAllMaxCmd         "QGATE_LAT_ALL_MAX"
+#define QG_CtrlStopAllCmd           "QGATE_STOPALL"
+#define QG_CtrlMoveFailedCmd        "QGATE_MOVE_FAILED"
+#define QG_GroupDeferCmd            "QGATE_GROUP_DEFER_"    //Followed by the group name
+#define QG_GroupFailedCmd           "QGATE_GROUP_FAILED_"   //Followed by the group name
+#define QG_CtrlProfileTimeoutCmd    "QGATE_PROFILE_TIMEOUT"
+#define QG_CtrlProfileTimesCmd      "QGATE_PROFILE_TIMES"
+#define QG_CtrlPublishMaxAgeCmd     "QGATE_PUBLISH_MAXAGE"
 #define QG_CtrlReportCmd            "QGATE_REPORT"
+#define QG_CtrlBatchPollCmd         "QGATE_BATCHPOLL"
+#define QG_PollDivMovingCmd         "QGATE_POLLDIV_MOVING"
+#define QG_PollDivSettlingCmd       "QGATE_POLLDIV_SETTLING"
+#define QG_PollDivIdleCmd           "QGATE_POLLDIV_IDLE"
+#define QG_PollDivDisconnCmd        "QGATE_POLLDIV_DISCONN"
+#define QG_PollDivSensorCmd         "QGATE_POLLDIV_SENSOR"
+#define QG_PollDivSlowCmd           "QGATE_POLLDIV_SLOW"
+#define QG_PollSettleCmd            "QGATE_POLL_SETTLE"
+#define QG_PollPredictCmd           "QGATE_POLL_PREDICT"
 #define QG_AxisNameCmd              "QGATE_NAMEAXIS"
 #define QG_AxisModelCmd             "QGATE_STAGEMODEL"
 #define QG_AxisConnectedCmd         "QGATE_AXISCONN"
@@ -71,20 +190,55 @@
 #define QG_AxisInPosUnconfirmedCmd  "QGATE_INPOSU"
 #define QG_AxisInPosLPFCmd          "QGATE_INPOSLPF"
 #define QG_AxisInPosWindowCmd       "QGATE_INPOSWIN"
+#define QG_AxisPollStateCmd         "QGATE_POLLSTATE"
+#define QG_AxisAcqCmd               "QGATE_ACQ"
+#define QG_AxisAcqPositionsCmd      "QGATE_ACQ_POSITIONS"
+#define QG_AxisAcqTimesCmd          "QGATE_ACQ_TIMES"
+#define QG_AxisAcqMeanCmd           "QGATE_ACQ_MEAN"
+#define QG_AxisAcqRateCmd           "QGATE_ACQ_RATE"
+#define QG_AxisAcqCountCmd          "QGATE_ACQ_COUNT"
+#define QG_AxisFlightCmd            "QGATE_FLIGHT"
+#define QG_AxisFlightPositionsCmd   "QGATE_FLIGHT_POSITIONS"
+#define QG_AxisFlightTimesCmd       "QGATE_FLIGHT_TIMES"
+#define QG_AxisFlightCountCmd       "QGATE_FLIGHT_COUNT"
+#define QG_AxisFlightRateCmd        "QGATE_FLIGHT_RATE"
+#define QG_AxisPosDeadbandCmd       "QGATE_POS_DEADBAND"
+#define QG_AxisStatsWindowCmd       "QGATE_STATS_WINDOW"
+#define QG_AxisPosMeanCmd           "QGATE_POS_MEAN"
+#define QG_AxisPosStdDevCmd         "QGATE_POS_STDDEV"
+#define QG_AxisPosMinCmd            "QGATE_POS_MIN"
+#define QG_AxisPosMaxCmd            "QGATE_POS_MAX"
+#define QG_AxisPosP2PCmd            "QGATE_POS_P2P"
+#define QG_AxisStatsSamplesCmd      "QGATE_STATS_SAMPLES"
+#define QG_AxisPosUncertaintyCmd    "QGATE_POS_UNCERTAINTY"
+#define QG_AxisSettlePredictedCmd   "QGATE_SETTLE_PREDICTED"
+#define QG_AxisSettleMeasuredCmd    "QGATE_SETTLE_MEASURED"
+#define QG_AxisSettleResetCmd       "QGATE_SETTLE_RESET"
+#define QG_AxisFbEnableCmd          "QGATE_FB_ENABLE"
+#define QG_AxisFbSetpointCmd        "QGATE_FB_SETPOINT"
+#define QG_AxisFbKpCmd              "QGATE_FB_KP"
+#define QG_AxisFbKiCmd              "QGATE_FB_KI"
+#define QG_AxisFbKdCmd              "QGATE_FB_KD"
+#define QG_AxisFbOutLowCmd          "QGATE_FB_OUT_LOW"
+#define QG_AxisFbOutHighCmd         "QGATE_FB_OUT_HIGH"
+#define QG_AxisFbErrorCmd           "QGATE_FB_ERROR"
+#define QG_AxisFbOutputCmd          "QGATE_FB_OUTPUT"
+#define QG_AxisFbRateCmd            "QGATE_FB_RATE"
+#define QG_AxisFbOverrunsCmd        "QGATE_FB_OVERRUNS"
+#define QG_AxisFbFaultsCmd          "QGATE_FB_FAULTS"
 
 #define MAX_N_REPLIES (20)
 
-//DLL's DoCommand Result list
-class QGList : public std::list<std::string> {
-public:
-    QGList() {};
-    std::string find(const int position);
-    std::string print();
-};
+class QgateAxis;
+class QgateProfile;
 
 //Class for Queensgate controller
-class QgateController : public asynMotorController {
+class QgateController : public asynMotorController, public QgateCompletion, public epicsTimerNotify {
     friend class QgateAxis;
+    friend class QgateSensorAcq;
+    friend class QgateFlightCapture;
+    friend class QgateFeedback;
+    friend class QgateProfile;
 public:
     enum {NOAXIS=-1};
 public:
@@ -93,11 +247,29 @@ public:
                     const int maxNumAxes,
                     double movingPollPeriod, 
                     double idlePollPeriod,
-                    const char* libraryPath);
+                    const char* libraryPath,
+                    const char* identityCache=NULL,
+                    bool sharedIO=false);
     virtual ~QgateController();
     /* overridden methods */
     virtual asynStatus poll();
     virtual asynStatus setDeferredMoves(bool defer);
+    virtual asynStatus writeInt32(asynUser *pasynUser, epicsInt32 value);
+    virtual asynStatus writeFloat64(asynUser *pasynUser, epicsFloat64 value);
+    virtual asynStatus buildProfile();
+    virtual asynStatus executeProfile();
+    virtual asynStatus abortProfile();
+    virtual asynStatus readbackProfile();
+    asynStatus configProfile(size_t maxPoints);
+    asynStatus configMoveGroup(const char *groupName, const char *axisList);
+    asynStatus configSharedMemory();
+    /* QgateCompletion: outcome of the requests not waited for */
+    virtual void requestCompleted(QgateRequest &request);
+    /* epicsTimerNotify: poller wake-up */
+    virtual expireStatus expire(const epicsTime &currentTime);
+    void statsThread();
+    void getReadingTime(epicsTimeStamp *timeStamp);
+    void watchdogThread();
 
 protected:
     // New parameters
@@ -110,7 +282,47 @@ protected:
     int QG_CtrlMaxAxes;
     int QG_CtrlDLLver;
     int QG_CtrlSecurity;
+    int QG_CtrlSecurityPeriod;
+    int QG_CtrlSecurityChecked;
+    int QG_CtrlSecurityEnforced;
+    int QG_CtrlRetryMin;
+    int QG_CtrlRetryMax;
+    int QG_CtrlRetryDelay;
+    int QG_CtrlRetryNext;
+    int QG_CtrlStatsPeriod;
+    int QG_CtrlCmdTimeout;
+    int QG_CtrlCmdDeadline;
+    int QG_CtrlCmdOverruns;
+    int QG_CtrlCmdWorst;
+    int QG_CtrlIOMaxRate;
+    int QG_CtrlIOLoad;
+    int QG_CtrlLatReset;
+    int QG_CtrlLatCalls;
+    int QG_CtrlLatErrors;
+    int QG_CtrlLatTimeouts;
+    int QG_CtrlLatP50;
+    int QG_CtrlLatP99;
+    int QG_CtrlLatMax;
+    int QG_CtrlLatSelect;
+    int QG_CtrlLatHistogram;
+    int QG_CtrlLatBins;
+    int QG_CtrlLatAllCalls;
+    int QG_CtrlLatAllErrors;
+    int QG_CtrlLatAllTimeouts;
+    int QG_CtrlLatAllP50;
+    int QG_CtrlLatAllP99;
+    int QG_CtrlLatAllMax;
+    int QG_CtrlStopAll;
+    int QG_CtrlMoveFailed;
+    int QG_CtrlProfileTimeout;
+    int QG_CtrlProfileTimes;
+    int QG_CtrlPublishMaxAge;
     int QG_CtrlReport;
+    int QG_CtrlBatchPoll;
+    int QG_PollDivider[QGPOLL_NUMSTATES];
+    int QG_PollDivSlow;
+    int QG_PollSettle;
+    int QG_PollPredict;
     int QG_AxisName;
     int QG_AxisModel;
     int QG_AxisConnected;
@@ -120,17 +332,65 @@ protected:
     int QG_AxisInPosUnconfirmed;
     int QG_AxisInPosLPF;
     int QG_AxisInPosWindow;
+    int QG_AxisPollState;
+    int QG_AxisAcq;
+    int QG_AxisAcqPositions;
+    int QG_AxisAcqTimes;
+    int QG_AxisAcqMean;
+    int QG_AxisAcqRate;
+    int QG_AxisAcqCount;
+    int QG_AxisFlight;
+    int QG_AxisFlightPositions;
+    int QG_AxisFlightTimes;
+    int QG_AxisFlightCount;
+    int QG_AxisFlightRate;
+    int QG_AxisPosDeadband;
+    int QG_AxisStatsWindow;
+    int QG_AxisPosMean;
+    int QG_AxisPosStdDev;
+    int QG_AxisPosMin;
+    int QG_AxisPosMax;
+    int QG_AxisPosP2P;
+    int QG_AxisStatsSamples;
+    int QG_AxisPosUncertainty;
+    int QG_AxisSettlePredicted;
+    int QG_AxisSettleMeasured;
+    int QG_AxisSettleReset;
+    int QG_AxisFbEnable;
+    int QG_AxisFbSetpoint;
+    int QG_AxisFbKp;
+    int QG_AxisFbKi;
+    int QG_AxisFbKd;
+    int QG_AxisFbOutLow;
+    int QG_AxisFbOutHigh;
+    int QG_AxisFbError;
+    int QG_AxisFbOutput;
+    int QG_AxisFbRate;
+    int QG_AxisFbOverruns;
+    int QG_AxisFbFaults;
 
 protected:
     /* Methods for use by the axes */
-    DllAdapter& getAdapter();
+    QgateAdapter& getAdapter();
+    QgateAxis* getQgateAxis(int axisNo);
     bool isAxisPresent(int axisNum);
-    DllAdapterStatus moveCmd(std::string cmd, int axisNum, double value);
-    DllAdapterStatus getCmd(std::string cmd, int axisNum, std::string &value, int valueID=0);
+    int getPollParam(int index);
+    void scheduleWakeup(double delay);
+    void getReplyTime(epicsTimeStamp &sampled, double &uncertainty);
+    void setReadingTime(const epicsTimeStamp *sampled);
+    bool getStageIdentity(int axisNum, QgateStageIdentity &identity);
+    bool getStagePart(int axisNum, std::string &part);
+    DllAdapterStatus moveCmd(const std::string &cmd, int axisNum, double value, bool &deferred);
+    bool cancelDeferredMove(int axisNum);
+    DllAdapterStatus getCmd(const std::string &cmd, int axisNum, std::string &value, int valueID=0);
+    DllAdapterStatus getCmd(const std::string &cmd, int axisNum, int &value, int valueID=0);
+    DllAdapterStatus getCmd(const std::string &cmd, int axisNum, double &value, int valueID=0);
 
 private:
     asynUser* serialPortUser;
-    DllAdapter qg;  //Queensgate adapter
+    QgateAdapter& qg;  //Controller library: Queensgate adapter or emulator (owned)
+    QgateLatencyStats latency;  //Latency of the requests, per type of request
+    QgateIOQueue ioQueue;   //All requests to the controller go through here
     /* Config */
     std::string versionDLL;
     std::string model;
@@ -140,18 +400,75 @@ private:
     int numAxes;    //Configured amount of axes
     int maxAxes;    //Max amount of axes supported by the connected controller
     std::string portDevice;
+    const QgateCommandSet ctrlCmd;  //Controller-level commands
+    QgateRequest pollReq;   //Batched poll request, only used by the poller
+    double ioBusyTime;      //Link busy time at the last load update (secs)
+    epicsTimeStamp ioLoadTime;  //Time of the last load update
+    /* Security watchdog */
+    epicsTimeStamp securityChecked; //Time of the last security level check
+    bool securityCheckForced;       //Check security level on next poll
+    int securityEnforced;           //Times the security level had to be set back to user
+    /* Readback timestamps */
+    epicsTimeStamp replySampled;    //Time the reply of the last request sent was sampled
+    double replyUncertainty;        //Uncertainty of replySampled: half the round trip (secs)
+    bool readingTimeSet;            //Parameter callbacks stamped with readingTime, instead of the current time
+    epicsTimeStamp readingTime;
+    /* Reconnection */
+    double retryDelay;              //Current reconnection backoff (secs), 0 when connected
+    epicsTimeStamp nextRetry;       //Time of the next reconnection probe
+    unsigned int retrySeed;         //Pseudo-random generator state for the backoff jitter
+    /* Position statistics */
+    epicsEvent statsEvent;          //Signalled for the statistics thread to end
+    epicsEvent statsExitEvent;      //Signalled when the statistics thread ends
+    bool statsExiting;
+    /* Hung link watchdog */
+    epicsEvent watchdogEvent;       //Signalled for the watchdog thread to end
+    epicsEvent watchdogExitEvent;   //Signalled when the watchdog thread ends
+    bool watchdogExiting;
+    /* Predictive polling */
+    epicsTimerQueueActive &timerQueue;
+    epicsTimer &wakeupTimer;        //Wakes up the poller when an axis expects its move completed
+    epicsMutex wakeupMutex;         //Protects the wake-up time
+    bool wakeupPending;             //Wake-up timer started
+    epicsTime wakeupTime;           //Time the wake-up timer expires
+    /* Profile moves */
+    QgateProfile *profile;          //Profile moves, when configured
+    /* Shared memory export */
+    QgateShmExport *shmExport;      //Live axis state export, when configured
 protected:
     /* Status */
     std::string nameCtrl;
     bool initialised;   //Library comms successfully initialised
     bool connected;
-    typedef std::vector<std::string> DeferredMoves;
-    DeferredMoves deferredMove; //Stores the move commands to be deferred
-    bool deferringMode;         //Moves are being deferred
+    typedef std::vector<QgateMoveGroup*> MoveGroups;
+    MoveGroups moveGroups;      //Coordinated move groups. The first one, for all the axes, deferred by the motor records
+    std::vector<QgateStageIdentity> stageIdentity;  //Stages per channel, as identified along with the controller
+    bool identityFresh;         //Stages identified on this poll cycle
+    std::string identityCachePath;  //Identity cache file, empty for none
+    bool identityCached;        //Identity known from the cache: only verified on connection
 private:
     asynStatus initController(const char* libPath);
     asynStatus initSession();
     asynStatus initialChecks();
+    DllAdapterStatus identify(bool full);
+    DllAdapterStatus identifyEach();
+    void publishIdentity();
+    bool loadIdentity();
+    void saveIdentity();
+    asynStatus pollBatch();
+    bool isSecurityCheckDue();
+    bool isRetryDue();
+    void scheduleRetry(bool failed);
+    DllAdapterStatus enforceSecurity();
+    bool isSecurityError(const QgateRequest &request);
+    static QgateCommand requestType(const std::string &command);
+    void updateLatency();
+    void recoverSession(double elapsed);
+    DllAdapterStatus sendRequest(QgateRequest &request, QgateIOQueue::PRIORITY priority=QgateIOQueue::PRIORITY_NORMAL);
+    QgateMoveGroup* getDeferringGroup(int axisNum);
+    asynStatus flushMoveGroup(QgateMoveGroup &group);
+    asynStatus stopAll();
+    DllAdapterStatus sendCmd(const std::string &cmd, int axisNum);
     void printdefmoves();
 };
 
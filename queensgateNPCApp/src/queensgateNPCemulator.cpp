@@ -0,0 +1,448 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <sstream>
+
+#include <epicsThread.h>
+#include <epicsAtomic.h>
+
+#include "queensgateNPCcontroller.hpp"
+#include "queensgateNPCemulator.hpp"
+
+#define QG_EMULATOR_MODEL       "NPC6330"       //Model emulated when not given by the port name
+#define QG_EMULATOR_STAGE       "NPS-X-15A"     //Stage model emulated
+#define QG_EMULATOR_SENSOR      "NS-X-15A"      //Sensor model emulated
+#define QG_EMULATOR_SERIAL      "100000"
+#define QG_EMULATOR_FIRMWARE    "100990979"
+#define QG_SECURITY_PRODUCTION  "Queensgate production"
+
+QgateEmulator::QgateEmulator()
+    : numChannels(3)
+    , numStages(3)
+    , numSensors(0)
+    , latency(0.002)
+    , jitter(0.0)
+    , velocity(1.0e9)
+    , settleTime(0.01)
+    , inPosWindow(1000.0)
+    , noise(0.0)
+    , faultRate(0.0)
+    , disconnectRate(0.0)
+    , downtime(2.0)
+    , hangRate(0.0)
+    , hangTime(30.0)
+    , seed(1)
+    , sessionOpen(false)
+    , model(QG_EMULATOR_MODEL)
+    , securityLevel(QG_SECURITY_PRODUCTION)
+    , disconnected(false)
+    , numRequests(0)
+    , numLines(0)
+{
+    reconnectTime.secPastEpoch = 0;
+    reconnectTime.nsec = 0;
+}
+
+QgateEmulator::~QgateEmulator() {}
+
+/** Configures the emulator.
+  * \param[in] libPath "emu:" followed by a comma-separated list of option=value
+  * \return error if an option is not valid */
+DllAdapterStatus QgateEmulator::Init(const std::string &libPath) {
+    std::string options = libPath.substr(strlen(QG_EMULATOR_PREFIX));
+    std::istringstream optionList(options);
+    std::string option;
+    while(std::getline(optionList, option, ',')) {
+        if(option.empty()) {
+            continue;
+        }
+        size_t equal = option.find('=');
+        std::string name = option.substr(0, equal);
+        double value = 0.0;
+        if(equal == std::string::npos ||
+                    !QgateReply::parseDouble(option.c_str() + equal + 1, option.size() - equal - 1, value) ||
+                    !setOption(name, value)) {
+            printf("queensgateNPC emulator: invalid option '%s'\n", option.c_str());
+            errorText = "Invalid emulator option";
+            return DLL_ADAPTER_STATUS_ERROR_UNKNOWN_COMMAND;
+        }
+    }
+    if(numStages > numChannels) {
+        numStages = numChannels;
+    }
+    if(numSensors > numStages) {
+        numSensors = numStages;
+    }
+    printf("queensgateNPC emulator: %d channels, %d stages (%d sensors), %g secs latency\n",
+            numChannels, numStages, numSensors, latency);
+    return DLL_ADAPTER_STATUS_SUCCESS;
+}
+
+/** Sets an emulator option.
+  * \param[in] name Name of the option
+  * \param[in] value Value of the option
+  * \return false if not a valid option */
+bool QgateEmulator::setOption(const std::string &name, double value) {
+    if(value < 0.0) {
+        return false;
+    }
+    if(name == "channels") {
+        numChannels = (int)value;
+    } else if(name == "stages") {
+        numStages = (int)value;
+    } else if(name == "sensors") {
+        numSensors = (int)value;
+    } else if(name == "latency") {
+        latency = value;
+    } else if(name == "jitter") {
+        jitter = value;
+    } else if(name == "velocity") {
+        velocity = value;
+    } else if(name == "settle") {
+        settleTime = value;
+    } else if(name == "window") {
+        inPosWindow = value;
+    } else if(name == "noise") {
+        noise = value;
+    } else if(name == "faults") {
+        faultRate = value;
+    } else if(name == "disconnect") {
+        disconnectRate = value;
+    } else if(name == "downtime") {
+        downtime = value;
+    } else if(name == "hang") {
+        hangRate = value;
+    } else if(name == "hangtime") {
+        hangTime = value;
+    } else if(name == "seed") {
+        seed = (unsigned int)value;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/** Opens the emulated controller session.
+  * \param[in] port Any port name. Ending in "/NPCxxxx" sets the emulated model, as on the SDK simulator */
+DllAdapterStatus QgateEmulator::OpenSession(const std::string &port) {
+    size_t slash = port.rfind('/');
+    if(slash != std::string::npos && port.compare(slash + 1, 2, "NP") == 0) {
+        model = port.substr(slash + 1);
+    }
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+    stages.resize(numChannels);
+    for(int i=0; i<numChannels; i++) {
+        Stage &stage = stages[i];
+        stage.connected = (i < numStages);
+        stage.sensor = (i >= numStages - numSensors) && stage.connected;
+        stage.start = stage.target = stage.relative = 0.0;
+        stage.moveStart = now;
+    }
+    securityLevel = QG_SECURITY_PRODUCTION;
+    disconnected = false;
+    sessionOpen = true;
+    return DLL_ADAPTER_STATUS_SUCCESS;
+}
+
+DllAdapterStatus QgateEmulator::CloseSession() {
+    sessionOpen = false;
+    return DLL_ADAPTER_STATUS_SUCCESS;
+}
+
+int QgateEmulator::GetChannels() {
+    return numChannels;
+}
+
+void QgateEmulator::GetDllVersion(int &major, int &minor, int &build) {
+    major = 0;
+    minor = 0;
+    build = 0;
+}
+
+void QgateEmulator::GetErrorText(std::ostringstream &text, DllAdapterStatus status) {
+    text << "Emulator: " << errorText;
+}
+
+/** Reports the amount of traffic received, for load testing.
+  * \param[out] requests Requests received so far
+  * \param[out] lines Command lines received so far */
+void QgateEmulator::getCounters(size_t &requests, size_t &lines) {
+    requests = epicsAtomicGetSizeT(&numRequests);
+    lines = epicsAtomicGetSizeT(&numLines);
+}
+
+/** Runs a controller request: one or more commands, one per line.
+  * Every command takes the configured latency, as on a serial link.
+  * \param[in] command Controller request
+  * \param[out] names Names of the reply values
+  * \param[out] values Reply values
+  * \return error if any command failed */
+DllAdapterStatus QgateEmulator::DoCommand(const std::string &command,
+                                            std::list<std::string> &names,
+                                            std::list<std::string> &values) {
+    std::istringstream lines(command);
+    std::string line;
+    DllAdapterStatus result = DLL_ADAPTER_STATUS_SUCCESS;
+
+    epicsAtomicIncrSizeT(&numRequests);
+    while(std::getline(lines, line)) {
+        if(line.empty()) {
+            continue;
+        }
+        epicsAtomicIncrSizeT(&numLines);
+        double delay = latency + jitter * random();
+        if(delay > 0.0) {
+            epicsThreadSleep(delay);
+        }
+        if(!checkLink() || !doLine(line, names, values)) {
+            result = DLL_ADAPTER_STATUS_ERROR_UNKNOWN_COMMAND;
+            break;
+        }
+    }
+    return result;
+}
+
+/** Checks the emulated link, injecting the configured faults.
+  * \return false when the controller does not reply */
+bool QgateEmulator::checkLink() {
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+    if(!sessionOpen) {
+        errorText = "Session not open";
+        return false;
+    }
+    if(disconnected) {
+        if(epicsTimeDiffInSeconds(&now, &reconnectTime) < 0.0) {
+            errorText = "Controller not responding";
+            return false;
+        }
+        disconnected = false;
+    }
+    if(disconnectRate > 0.0 && random() < disconnectRate) {
+        disconnected = true;
+        reconnectTime = now;
+        epicsTimeAddSeconds(&reconnectTime, downtime);
+        errorText = "Controller not responding";
+        return false;
+    }
+    if(faultRate > 0.0 && random() < faultRate) {
+        errorText = "Communication error";
+        return false;
+    }
+    if(hangRate > 0.0 && random() < hangRate) {
+        //Link stalled, as a hung serial port, till the library gives up on it
+        epicsThreadSleep(hangTime);
+        errorText = "Controller not responding";
+        return false;
+    }
+    return true;
+}
+
+/** Runs a single controller command.
+  * \param[in] line Command and its arguments, e.g. "stage.position.measured.get 1"
+  * \param[out] names Names of the reply values
+  * \param[out] values Reply values
+  * \return false if the command failed */
+bool QgateEmulator::doLine(const std::string &line, std::list<std::string> &names, std::list<std::string> &values) {
+    std::istringstream args(line);
+    std::string cmd;
+    int channel = 0;
+    std::string valueStr;
+    double value = 0.0;
+
+    args >> cmd;
+    int cmdIndex = QGCMD_NUM;
+    for(int i=0; i<QGCMD_NUM; i++) {
+        //Table entries may include arguments, e.g. the security code
+        const char* tableCmd = qgateCommandTable[i].cmd;
+        size_t length = strcspn(tableCmd, " ");
+        if(cmd.size() == length && cmd.compare(0, length, tableCmd, length) == 0) {
+            cmdIndex = i;
+            break;
+        }
+    }
+
+    //Arguments: channel first, then value
+    Stage* stage = NULL;
+    if(cmdIndex >= QGCMD_STAGE_CONNECTED && cmdIndex < QGCMD_NUM) {
+        args >> channel;
+        stage = getStage(channel);
+        if(stage == NULL) {
+            errorText = "Invalid channel";
+            return false;
+        }
+    }
+    args >> valueStr;
+    bool hasValue = QgateReply::parseDouble(valueStr.c_str(), valueStr.size(), value);
+
+    StageStatus status;
+    if(stage != NULL) {
+        getStageStatus(*stage, status);
+    }
+    switch(cmdIndex) {
+        case QGCMD_CTRL_STATUS:
+            addReply(names, values, "security", securityLevel);
+            addReply(names, values, "channels", numChannels);
+            addReply(names, values, "status", std::string("0x0000"));
+            break;
+        case QGCMD_CTRL_PART:
+            addReply(names, values, "part", model);
+            break;
+        case QGCMD_CTRL_SERIAL:
+            addReply(names, values, "serial", std::string(QG_EMULATOR_SERIAL));
+            break;
+        case QGCMD_CTRL_VERSION:
+            addReply(names, values, "version", std::string(QG_EMULATOR_FIRMWARE));
+            break;
+        case QGCMD_SECURITY_GET:
+            addReply(names, values, "security", securityLevel);
+            break;
+        case QGCMD_SECURITY_SET:
+            if(valueStr.compare(QG_SECURITY_USER_CODE) != 0) {
+                errorText = "Invalid security code";
+                return false;
+            }
+            securityLevel = QG_SECURITY_USER_LEVEL;
+            addReply(names, values, "security", securityLevel);
+            break;
+        case QGCMD_STAGE_CONNECTED:
+            addReply(names, values, "value", (int)stage->connected);
+            break;
+        case QGCMD_STAGE_PART:
+            addReply(names, values, "part", std::string(
+                        (!stage->connected)? "FAILED" : (stage->sensor)? QG_EMULATOR_SENSOR : QG_EMULATOR_STAGE));
+            break;
+        case QGCMD_POS_ABSOLUTE_GET:
+            addReply(names, values, "value", stage->target);
+            break;
+        case QGCMD_POS_RELATIVE_GET:
+            addReply(names, values, "value", stage->relative);
+            break;
+        case QGCMD_POS_ABSOLUTE_SET:
+        case QGCMD_POS_RELATIVE_SET:
+            if(!hasValue) {
+                errorText = "Missing value";
+                return false;
+            }
+            if(securityLevel.compare(QG_SECURITY_USER_LEVEL) != 0) {
+                errorText = "Command refused: security level";
+                return false;
+            }
+            if(!stage->connected || stage->sensor) {
+                errorText = "Stage not available";
+                return false;
+            }
+            if(cmdIndex == QGCMD_POS_RELATIVE_SET) {
+                stage->relative = value;
+                value += stage->target;
+            }
+            moveStage(*stage, value);
+            addReply(names, values, "value", value);
+            break;
+        case QGCMD_POS_MEASURED:
+            addReply(names, values, "value", (stage->connected)? status.measured : 0.0);
+            break;
+        case QGCMD_INPOS_UNCONFIRMED:
+            addReply(names, values, "value", (int)(stage->connected && status.inPosition));
+            break;
+        case QGCMD_INPOS_LPF:
+        case QGCMD_INPOS_WINDOW:
+            addReply(names, values, "value", (int)(stage->connected && status.inPosition && status.settled));
+            break;
+        case QGCMD_STAGE_MOVING:
+            addReply(names, values, "value", (int)(stage->connected && status.moving));
+            break;
+        case QGCMD_DIGITAL_MODE:
+            addReply(names, values, "value", 1);
+            break;
+        default:
+            errorText = "Unknown command";
+            return false;
+    }
+    return true;
+}
+
+/** Gets an emulated stage.
+  * \param[in] channel Channel number [1..n]
+  * \return stage, NULL if not a valid channel */
+QgateEmulator::Stage* QgateEmulator::getStage(int channel) {
+    if(channel < 1 || channel > (int)stages.size()) {
+        return NULL;
+    }
+    return &stages[channel-1];
+}
+
+/** Gets the current state of a stage: moves at the configured velocity
+  * towards the target, and then takes the settling time to settle.
+  * \param[in] stage Emulated stage
+  * \param[out] status State of the stage now */
+void QgateEmulator::getStageStatus(Stage &stage, StageStatus &status) {
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+    double elapsed = epicsTimeDiffInSeconds(&now, &stage.moveStart);
+    double distance = stage.target - stage.start;
+    double moveTime = (velocity > 0.0)? fabs(distance) / velocity : 0.0;
+    if(elapsed < moveTime) {
+        status.measured = stage.start + distance * elapsed / moveTime;
+        status.moving = true;
+    } else {
+        status.measured = stage.target;
+        status.moving = false;
+    }
+    if(noise > 0.0) {
+        status.measured += noise * randomGauss();
+    }
+    status.inPosition = !status.moving && (fabs(status.measured - stage.target) <= inPosWindow);
+    status.settled = (elapsed >= moveTime + settleTime);
+}
+
+/** Starts moving a stage from its current position.
+  * \param[in] stage Emulated stage
+  * \param[in] target Absolute position to move to (pm) */
+void QgateEmulator::moveStage(Stage &stage, double target) {
+    StageStatus status;
+    getStageStatus(stage, status);
+    stage.start = status.measured;
+    stage.target = target;
+    epicsTimeGetCurrent(&stage.moveStart);
+}
+
+/** Pseudo-random generator, repeatable for a given seed.
+  * \return random number in [0,1) */
+double QgateEmulator::random() {
+    seed = seed * 1103515245u + 12345u;
+    return ((seed >> 8) & 0xFFFFFF) / (double)0x1000000;
+}
+
+/** Pseudo-random generator with normal distribution.
+  * \return random number of mean 0 and standard deviation 1 */
+double QgateEmulator::randomGauss() {
+    double u1 = random();
+    double u2 = random();
+    if(u1 < 1.0e-12) {
+        u1 = 1.0e-12;
+    }
+    return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+void QgateEmulator::addReply(std::list<std::string> &names, std::list<std::string> &values,
+                            const char* name, const std::string &value) {
+    names.push_back(name);
+    values.push_back(value);
+}
+
+void QgateEmulator::addReply(std::list<std::string> &names, std::list<std::string> &values,
+                            const char* name, double value) {
+    char valueStr[QG_VALUE_STRLEN];
+    snprintf(valueStr, QG_VALUE_STRLEN, "%.9e", value);    //As the controller does
+    addReply(names, values, name, std::string(valueStr));
+}
+
+void QgateEmulator::addReply(std::list<std::string> &names, std::list<std::string> &values,
+                            const char* name, int value) {
+    char valueStr[QG_VALUE_STRLEN];
+    snprintf(valueStr, QG_VALUE_STRLEN, "%d", value);
+    addReply(names, values, name, std::string(valueStr));
+}
@@ -0,0 +1,109 @@
+#ifndef QGATENPCemulator_H_
+#define QGATENPCemulator_H_
+
+#include <string>
+#include <vector>
+
+#include <epicsTime.h>
+
+#include "queensgateNPCadapter.hpp"
+
+/* Queensgate controller emulator.
+ * Replies to all the controller commands used by the driver (see
+ * queensgateNPCcontroller.hpp), with simulated stages, so the driver can be
+ * run and load-tested without hardware. Selected with a library path
+ * "emu:<option>=<value>,..." on qgateCtrlConfig. Options:
+ *   channels=3         Channels of the controller
+ *   stages=3           Channels with a stage connected, from channel 1
+ *   sensors=0          Connected stages that are sensors, from the last one
+ *   latency=0.002      Time taken by each command line (secs)
+ *   jitter=0           Additional random time taken by each command line (secs)
+ *   velocity=1e9       Stage velocity (pm/sec)
+ *   settle=0.01        Settling time after reaching the target (secs)
+ *   window=1000        In-position window (pm)
+ *   noise=0            Measured position noise, standard deviation (pm)
+ *   faults=0           Probability of a request failing
+ *   disconnect=0       Probability of the controller disconnecting on a request
+ *   downtime=2         Time disconnected (secs)
+ *   hang=0             Probability of a request hanging, as a stalled link
+ *   hangtime=30        Time a hung request stalls before failing (secs)
+ *   seed=1             Random generator seed, for repeatable runs
+ * e.g. "emu:channels=3,latency=0.005,faults=0.001"
+ */
+class QgateEmulator : public QgateAdapter {
+public:
+    QgateEmulator();
+    virtual ~QgateEmulator();
+    virtual DllAdapterStatus Init(const std::string &libPath);
+    virtual DllAdapterStatus OpenSession(const std::string &port);
+    virtual DllAdapterStatus CloseSession();
+    virtual DllAdapterStatus DoCommand(const std::string &command,
+                                        std::list<std::string> &names,
+                                        std::list<std::string> &values);
+    virtual int GetChannels();
+    virtual void GetDllVersion(int &major, int &minor, int &build);
+    virtual void GetErrorText(std::ostringstream &text, DllAdapterStatus status);
+    void getCounters(size_t &requests, size_t &lines);
+private:
+    //Simulated stage
+    struct Stage {
+        bool connected;
+        bool sensor;
+        double start;           //Position when the last move started (pm)
+        double target;          //Commanded absolute position (pm)
+        double relative;        //Commanded relative position (pm)
+        epicsTimeStamp moveStart;
+    };
+    //Stage state at a given time
+    struct StageStatus {
+        double measured;
+        bool moving;
+        bool inPosition;        //Within the in-position window
+        bool settled;           //Settled after reaching the target
+    };
+private:
+    bool setOption(const std::string &name, double value);
+    bool doLine(const std::string &line, std::list<std::string> &names, std::list<std::string> &values);
+    Stage* getStage(int channel);
+    void getStageStatus(Stage &stage, StageStatus &status);
+    void moveStage(Stage &stage, double target);
+    bool checkLink();
+    double random();
+    double randomGauss();
+    void addReply(std::list<std::string> &names, std::list<std::string> &values,
+                    const char* name, const std::string &value);
+    void addReply(std::list<std::string> &names, std::list<std::string> &values,
+                    const char* name, double value);
+    void addReply(std::list<std::string> &names, std::list<std::string> &values,
+                    const char* name, int value);
+private:
+    /* Configuration */
+    int numChannels;
+    int numStages;
+    int numSensors;
+    double latency;
+    double jitter;
+    double velocity;
+    double settleTime;
+    double inPosWindow;
+    double noise;
+    double faultRate;
+    double disconnectRate;
+    double downtime;
+    double hangRate;
+    double hangTime;
+    unsigned int seed;
+    /* Status */
+    bool sessionOpen;
+    std::string model;
+    std::string securityLevel;
+    std::vector<Stage> stages;
+    epicsTimeStamp reconnectTime;   //Time the controller reconnects after an injected disconnection
+    bool disconnected;
+    std::string errorText;          //Description of the last error
+    /* Counters */
+    size_t numRequests;             //Requests received
+    size_t numLines;                //Command lines received
+};
+
+#endif //QGATENPCemulator_H_
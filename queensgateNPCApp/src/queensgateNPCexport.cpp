@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <epicsAtomic.h>
+
+#include "queensgateNPCexport.hpp"
+
+/** Creates the shared memory region of a controller.
+  * \param[in] ctrlName Controller port name, used for naming the region
+  * \param[in] numAxes Amount of axis slots
+  * \return region exporter, NULL if it could not be created */
+QgateShmExport* QgateShmExport::create(const std::string &ctrlName, int numAxes) {
+    std::string objectName(QGATE_SHM_PREFIX);
+    objectName.append(ctrlName);
+    size_t size = QGATE_SHM_SIZE(numAxes);
+    int fd = shm_open(objectName.c_str(), O_CREAT | O_RDWR, 0644);
+    if(fd < 0) {
+        printf("queensgateNPC: shared memory %s not created: %s\n", objectName.c_str(), strerror(errno));
+        return NULL;
+    }
+    void *base = MAP_FAILED;
+    if(ftruncate(fd, size) == 0) {
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if(base == MAP_FAILED) {
+        printf("queensgateNPC: shared memory %s not mapped: %s\n", objectName.c_str(), strerror(errno));
+        close(fd);
+        shm_unlink(objectName.c_str());
+        return NULL;
+    }
+    close(fd);  //Mapping kept
+    return new QgateShmExport(objectName, base, size, numAxes);
+}
+
+/** Shared memory region, initialised with no axis state
+  * \param[in] objectName Shared memory object name
+  * \param[in] base Region mapped
+  * \param[in] size Region size (bytes)
+  * \param[in] numAxes Amount of axis slots */
+QgateShmExport::QgateShmExport(const std::string &objectName, void *base, size_t size, int numAxes)
+    : objectName(objectName)
+    , base(base)
+    , size(size)
+    , numAxes(numAxes)
+{
+    memset(base, 0, size);
+    qgateShmHeader *header = (qgateShmHeader*)base;
+    header->version = QGATE_SHM_VERSION;
+    header->numAxes = numAxes;
+    header->slotSize = QGATE_SHM_SLOTSIZE;
+    strncpy(header->name, objectName.c_str() + strlen(QGATE_SHM_PREFIX), sizeof(header->name) - 1);
+    epicsAtomicWriteMemoryBarrier();    //Header complete before readers accept it
+    header->magic = QGATE_SHM_MAGIC;
+}
+
+QgateShmExport::~QgateShmExport() {
+    munmap(base, size);
+    shm_unlink(objectName.c_str());
+}
+
+/** Writes the state of an axis. Only to be called from the poller.
+  * \param[in] axisNo Axis index [0..n-1]
+  * \param[in] flags QGATE_SHM_* status flags
+  * \param[in] position Latest measured position (picometres)
+  * \param[in] sampled Time the position was sampled
+  * \param[in] uncertainty Uncertainty of the sampling time (secs) */
+void QgateShmExport::update(int axisNo, unsigned int flags, double position,
+                            const epicsTimeStamp &sampled, double uncertainty) {
+    if(axisNo < 0 || axisNo >= numAxes) {
+        return;
+    }
+    qgateShmAxis *slot = (qgateShmAxis*)QGATE_SHM_AXIS(base, axisNo);
+    slot->sequence = slot->sequence + 1;    //Odd: being written
+    epicsAtomicWriteMemoryBarrier();
+    slot->flags = flags;
+    slot->position = position;
+    slot->uncertainty = uncertainty;
+    slot->secPastEpoch = sampled.secPastEpoch;
+    slot->nsec = sampled.nsec;
+    slot->updates++;
+    epicsAtomicWriteMemoryBarrier();
+    slot->sequence = slot->sequence + 1;    //Even: written
+}
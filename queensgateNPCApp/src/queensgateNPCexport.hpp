@@ -0,0 +1,30 @@
+#ifndef QGATENPCexport_H_
+#define QGATENPCexport_H_
+
+#include <string>
+
+#include <epicsTime.h>
+
+#include "queensgateNPCshm.h"
+
+/* Shared memory export of the live axis state (see queensgateNPCshm.h).
+ * The region is created when configured and removed with the controller.
+ * Each axis slot is only written by the poller, with a sequence lock, so
+ * readers on other processes get a consistent copy without any locking.
+ */
+class QgateShmExport {
+public:
+    static QgateShmExport* create(const std::string &ctrlName, int numAxes);
+    virtual ~QgateShmExport();
+    void update(int axisNo, unsigned int flags, double position,
+                const epicsTimeStamp &sampled, double uncertainty);
+private:
+    QgateShmExport(const std::string &objectName, void *base, size_t size, int numAxes);
+private:
+    std::string objectName;     //Shared memory object name
+    void *base;                 //Region mapped
+    size_t size;                //Region size (bytes)
+    int numAxes;
+};
+
+#endif //QGATENPCexport_H_
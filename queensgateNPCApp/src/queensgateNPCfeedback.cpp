@@ -0,0 +1,276 @@
+#include <stdio.h>
+
+#include <epicsAtomic.h>
+#include <TakeLock.h>
+
+#include "queensgateNPCcontroller.hpp"
+#include "queensgateNPCfeedback.hpp"
+
+#define QGATE_FB_PUBLISH_PERIOD (0.2)   //Loop status published every... (secs)
+#define QGATE_FB_MAX_FAULTS     (5)     //Consecutive failed cycles that disable the loop
+
+static void loopThreadC(void *pPvt) {
+    QgateFeedback *pFeedback = (QgateFeedback*)pPvt;
+    pFeedback->loopThread();
+}
+
+/** Feedback loop of a stage on a sensor, disabled.
+  * \param[in] stageController Controller of the stage, holding the loop parameters
+  * \param[in] stageAxisNumber Stage axis number [1..n]
+  * \param[in] sensorController Controller of the sensor, may be the stage one
+  * \param[in] sensorAxisNumber Sensor axis number [1..n]
+  * \param[in] period Loop period (secs) */
+QgateFeedback::QgateFeedback(QgateController &stageController, int stageAxisNumber,
+                             QgateController &sensorController, int sensorAxisNumber, double period)
+    : stageCtrl(stageController)
+    , sensorCtrl(sensorController)
+    , stageAxisNum(stageAxisNumber)
+    , stageAxisNo(stageAxisNumber-1)
+    , sensorAxisNum(sensorAxisNumber)
+    , period(period)
+    , running(false)
+    , primed(false)
+    , bias(0.0)
+    , integral(0.0)
+    , lastMeasured(0.0)
+    , lastError(0.0)
+    , lastOutput(0.0)
+    , numOverruns(0)
+    , numFaults(0)
+    , consecutiveFaults(0)
+    , exiting(0)
+{
+    QgateCommandSet sensorCmd(sensorAxisNumber);
+    QgateCommandSet stageCmd(stageAxisNumber);
+    measuredCmd = sensorCmd[QGCMD_POS_MEASURED];
+    commandGetCmd = stageCmd[QGCMD_POS_ABSOLUTE_GET];
+    commandSetCmd = stageCmd[QGCMD_POS_ABSOLUTE_SET];
+    settings.enable = false;
+    settings.setpoint = 0.0;
+    settings.kp = 0.0;
+    settings.ki = 0.0;
+    settings.kd = 0.0;
+    settings.outLow = 0.0;
+    settings.outHigh = 0.0;
+    lastSampled.secPastEpoch = 0;
+    lastSampled.nsec = 0;
+
+    char name[QG_VALUE_STRLEN];
+    snprintf(name, QG_VALUE_STRLEN, "%s_FB%d", stageCtrl.nameCtrl.c_str(), stageAxisNum);
+    threadName = name;
+    epicsThreadCreate(threadName.c_str(),
+                    epicsThreadPriorityHigh,
+                    epicsThreadGetStackSize(epicsThreadStackMedium),
+                    (EPICSTHREADFUNC)loopThreadC, this);
+}
+
+QgateFeedback::~QgateFeedback() {
+    epicsAtomicSetIntT(&exiting, 1);
+    wakeEvent.signal();
+    exitEvent.wait();
+}
+
+/** Applies new loop settings, taken by the loop on its next cycle.
+  * \param[in] newSettings Loop settings */
+void QgateFeedback::configure(const QgateFeedbackSettings &newSettings) {
+    bool starting;
+    {
+        TakeLock takeLock(&stateMutex);
+        starting = newSettings.enable && !settings.enable;
+        settings = newSettings;
+    }
+    if(starting) {
+        wakeEvent.signal();
+    }
+}
+
+/** Disables the loop, e.g. when the stage is stopped. Once returned, the
+  * loop queues no further stage command, and one already queued is sent
+  * before a stop queued afterwards (same priority), so it does not undo it.
+  * \return true if it was enabled */
+bool QgateFeedback::disable() {
+    TakeLock takeLock(&stateMutex);
+    bool wasEnabled = settings.enable;
+    settings.enable = false;
+    return wasEnabled;
+}
+
+/** Tells if the loop is enabled, so the stage is commanded by it */
+bool QgateFeedback::isEnabled() {
+    TakeLock takeLock(&stateMutex);
+    return settings.enable;
+}
+
+/** Loop thread: runs the enabled loop at a fixed rate */
+void QgateFeedback::loopThread() {
+    QgateRequest *sensorRequest = sensorCtrl.ioQueue.acquire();
+    QgateRequest *stageRequest = stageCtrl.ioQueue.acquire();
+    sensorRequest->axisNum = sensorAxisNum;
+    sensorRequest->type = QGCMD_POS_MEASURED;
+    stageRequest->axisNum = stageAxisNum;
+    epicsUInt64 periodNs = (epicsUInt64)(period * 1.0e9);
+    epicsUInt64 next = epicsMonotonicGet();
+    epicsUInt64 published = next;
+    int numCycles = 0;
+    while(!epicsAtomicGetIntT(&exiting)) {
+        QgateFeedbackSettings current;
+        {
+            TakeLock takeLock(&stateMutex);
+            current = settings;
+        }
+        if(!current.enable) {
+            if(running) {
+                running = false;
+                publish(0.0);
+            }
+            wakeEvent.wait();
+            next = epicsMonotonicGet();
+            published = next;
+            numCycles = 0;
+            continue;
+        }
+        if(!running) {
+            running = start(*stageRequest);
+            if(!running) {
+                continue;   //Disabled by the failure
+            }
+        }
+        if(step(*sensorRequest, *stageRequest, current)) {
+            consecutiveFaults = 0;
+        } else {
+            numFaults++;
+            if(++consecutiveFaults >= QGATE_FB_MAX_FAULTS) {
+                fail("failed to communicate");
+                continue;
+            }
+        }
+        numCycles++;
+
+        //Wait for the next cycle, skipping the ones already missed
+        epicsUInt64 now = epicsMonotonicGet();
+        next += periodNs;
+        if(now >= next) {
+            numOverruns++;
+            next = now;
+        }
+        if(now - published >= (epicsUInt64)(QGATE_FB_PUBLISH_PERIOD * 1.0e9)) {
+            publish(numCycles * 1.0e9 / (now - published));
+            published = now;
+            numCycles = 0;
+        }
+        while(!epicsAtomicGetIntT(&exiting) && (now = epicsMonotonicGet()) < next) {
+            wakeEvent.wait((next - now) * 1.0e-9);
+        }
+    }
+    sensorCtrl.ioQueue.release(sensorRequest);
+    stageCtrl.ioQueue.release(stageRequest);
+    exitEvent.signal();
+}
+
+/** Closes the loop: the current stage command becomes the output offset.
+  * \param[in,out] stageRequest Request to the stage controller
+  * \return false if the stage command could not be read (loop disabled) */
+bool QgateFeedback::start(QgateRequest &stageRequest) {
+    stageRequest.command.assign(commandGetCmd);
+    stageRequest.type = QGCMD_POS_ABSOLUTE_GET;
+    if(stageCtrl.ioQueue.execute(stageRequest, QgateIOQueue::PRIORITY_HIGH) != DLL_ADAPTER_STATUS_SUCCESS ||
+                !stageRequest.reply.getDouble(0, bias)) {
+        fail("failed to read the stage command");
+        return false;
+    }
+    integral = 0.0;
+    primed = false;
+    lastOutput = bias;
+    consecutiveFaults = 0;
+    return true;
+}
+
+/** Runs a loop cycle: measures the sensor and commands the stage.
+  * \param[in,out] sensorRequest Request to the sensor controller
+  * \param[in,out] stageRequest Request to the stage controller
+  * \param[in] current Loop settings for this cycle
+  * \return false if failed to communicate */
+bool QgateFeedback::step(QgateRequest &sensorRequest, QgateRequest &stageRequest, 
+                         const QgateFeedbackSettings &current) {
+    double measured = 0.0;
+    sensorRequest.command.assign(measuredCmd);
+    if(sensorCtrl.ioQueue.execute(sensorRequest, QgateIOQueue::PRIORITY_HIGH) != DLL_ADAPTER_STATUS_SUCCESS ||
+                !sensorRequest.reply.getDouble(0, measured)) {
+        primed = false;
+        return false;       //Output held
+    }
+
+    //Time step taken from the sampling times, as the link may delay a cycle
+    double dt = period;
+    if(primed) {
+        double elapsed = epicsTimeDiffInSeconds(&sensorRequest.sampled, &lastSampled);
+        if(elapsed > 0.0) {
+            dt = elapsed;
+        }
+    }
+    double error = current.setpoint - measured;
+    double increment = current.ki * error * dt;
+    integral += increment;
+    double derivative = (primed)? -current.kd * (measured - lastMeasured) / dt : 0.0;
+    double output = bias + current.kp * error + integral + derivative;
+    if(output > current.outHigh) {
+        output = current.outHigh;
+        if(increment > 0.0) {
+            integral -= increment;  //Anti-windup: no further into the clamp
+        }
+    } else if(output < current.outLow) {
+        output = current.outLow;
+        if(increment < 0.0) {
+            integral -= increment;
+        }
+    }
+    lastMeasured = measured;
+    lastSampled = sensorRequest.sampled;
+    lastError = error;
+    primed = true;
+
+    char valueStr[QG_VALUE_STRLEN];
+    snprintf(valueStr, QG_VALUE_STRLEN, " %f", output);
+    stageRequest.command.assign(commandSetCmd);
+    stageRequest.command.append(valueStr);
+    stageRequest.type = QGCMD_POS_ABSOLUTE_SET;
+    {
+        //Queued only while enabled: a stop disabling the loop is queued after it
+        TakeLock takeLock(&stateMutex);
+        if(!settings.enable) {
+            return true;    //Disabled meanwhile (e.g. stopped): stage left alone
+        }
+        stageCtrl.ioQueue.send(stageRequest, QgateIOQueue::PRIORITY_HIGH);
+    }
+    if(stageCtrl.ioQueue.waitFor(stageRequest) != DLL_ADAPTER_STATUS_SUCCESS) {
+        return false;
+    }
+    lastOutput = output;
+    return true;
+}
+
+/** Disables the loop after a failure, leaving the stage where it was last commanded.
+  * \param[in] message Reason of the failure */
+void QgateFeedback::fail(const char *message) {
+    asynPrint(stageCtrl.pasynUserSelf, ASYN_TRACE_ERROR, "Controller %s feedback of axis %d disabled: %s\n",
+                stageCtrl.nameCtrl.c_str(), stageAxisNum, message);
+    {
+        TakeLock takeLock(&stateMutex);
+        settings.enable = false;
+    }
+    running = false;
+    TakeLock takeLock(&stageCtrl);  //Parameter callbacks done when released
+    stageCtrl.setIntegerParam(stageAxisNo, stageCtrl.QG_AxisFbEnable, 0);
+    stageCtrl.setIntegerParam(stageAxisNo, stageCtrl.QG_AxisFbFaults, numFaults);
+}
+
+/** Publishes the loop status.
+  * \param[in] rate Loop cycles per second achieved since last published */
+void QgateFeedback::publish(double rate) {
+    TakeLock takeLock(&stageCtrl);  //Parameter callbacks done when released
+    stageCtrl.setDoubleParam(stageAxisNo, stageCtrl.QG_AxisFbError, lastError);
+    stageCtrl.setDoubleParam(stageAxisNo, stageCtrl.QG_AxisFbOutput, lastOutput);
+    stageCtrl.setDoubleParam(stageAxisNo, stageCtrl.QG_AxisFbRate, rate);
+    stageCtrl.setIntegerParam(stageAxisNo, stageCtrl.QG_AxisFbOverruns, numOverruns);
+    stageCtrl.setIntegerParam(stageAxisNo, stageCtrl.QG_AxisFbFaults, numFaults);
+}
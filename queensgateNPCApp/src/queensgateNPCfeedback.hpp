@@ -0,0 +1,84 @@
+#ifndef QGATENPCfeedback_H_
+#define QGATENPCfeedback_H_
+
+#include <string>
+
+#include <epicsMutex.h>
+#include <epicsEvent.h>
+#include <epicsThread.h>
+#include <epicsTime.h>
+
+class QgateController;
+class QgateRequest;
+
+//Settings of a feedback loop, as set on its parameters
+struct QgateFeedbackSettings {
+    bool enable;
+    double setpoint;    //Sensor position to hold (picometres)
+    double kp;          //Proportional gain
+    double ki;          //Integral gain (1/secs)
+    double kd;          //Derivative gain (secs)
+    double outLow;      //Stage position range commanded (picometres)
+    double outHigh;
+};
+
+/* Closed-loop feedback between a sensor and a stage axis.
+ * A loop thread, at a fixed rate, reads the measured position of the sensor
+ * and commands the absolute position of the stage from a PID on the error
+ * to the setpoint. The derivative acts on the measurement, the output is
+ * clamped to its range, and the integral stops growing while clamped. When
+ * enabled, the current stage command is taken as the output offset, so the
+ * loop starts from where the stage is rather than from zero.
+ * Both requests go straight to the controllers' I/O queues, at high
+ * priority, and the loop thread only takes the stage controller lock to
+ * publish its status a few times per second. The sensor may be on another
+ * controller (e.g. an NS sensor controlling an NPC stage).
+ */
+class QgateFeedback {
+public:
+    QgateFeedback(QgateController &stageController, int stageAxisNumber,
+                  QgateController &sensorController, int sensorAxisNumber, double period);
+    virtual ~QgateFeedback();
+    void configure(const QgateFeedbackSettings &newSettings);
+    bool disable();
+    bool isEnabled();
+    void loopThread();
+private:
+    bool start(QgateRequest &stageRequest);
+    bool step(QgateRequest &sensorRequest, QgateRequest &stageRequest, const QgateFeedbackSettings &current);
+    void fail(const char *message);
+    void publish(double rate);
+private:
+    QgateController &stageCtrl;
+    QgateController &sensorCtrl;
+    int stageAxisNum;           //Stage axis number [1..n]
+    int stageAxisNo;            //Stage axis index [0..n-1], as the asyn address
+    int sensorAxisNum;          //Sensor axis number [1..n], on the sensor controller
+    double period;              //Loop period (secs)
+    std::string measuredCmd;    //Measured position command for the sensor
+    std::string commandGetCmd;  //Absolute position command readback for the stage
+    std::string commandSetCmd;  //Absolute position command for the stage
+    std::string threadName;
+    /* Settings, protected by stateMutex. Also held while queueing a stage
+     * command, so none is queued once disabled. */
+    epicsMutex stateMutex;
+    QgateFeedbackSettings settings;
+    /* Loop state, only used by the loop thread */
+    bool running;               //Loop closed since last enabled
+    bool primed;                //Previous measurement known, for the derivative
+    double bias;                //Stage command when enabled (picometres)
+    double integral;            //Integral term (picometres)
+    double lastMeasured;        //Previous sensor measurement (picometres)
+    epicsTimeStamp lastSampled; //Time the previous measurement was sampled
+    double lastError;           //Latest error (picometres)
+    double lastOutput;          //Latest stage command (picometres)
+    int numOverruns;            //Cycles that took longer than the period
+    int numFaults;              //Cycles that failed to communicate
+    int consecutiveFaults;
+    /* Thread control */
+    epicsEvent wakeEvent;       //Signalled when enabled, or when exiting
+    epicsEvent exitEvent;       //Signalled when the loop thread ends
+    int exiting;                //Accessed atomically
+};
+
+#endif //QGATENPCfeedback_H_
@@ -0,0 +1,123 @@
+#include <stdio.h>
+
+#include <TakeLock.h>
+
+#include "queensgateNPCcontroller.hpp"
+#include "queensgateNPCflight.hpp"
+
+static void captureThreadC(void *pPvt) {
+    QgateFlightCapture *pCapture = (QgateFlightCapture*)pPvt;
+    pCapture->captureThread();
+}
+
+/** Flight capture of a stage axis.
+  * \param[in] controller Controller object
+  * \param[in] axisNumber Axis stage number [1..n]
+  * \param[in] maxSamples Maximum amount of samples of a move trace */
+QgateFlightCapture::QgateFlightCapture(QgateController &controller, int axisNumber, size_t maxSamples)
+    : ctrler(controller)
+    , axisNum(axisNumber)
+    , axisNo(axisNumber-1)
+    , startPending(false)
+    , finishPending(false)
+    , exiting(false)
+{
+    QgateCommandSet axisCmd(axisNumber);
+    measuredCmd = axisCmd[QGCMD_POS_MEASURED];
+    positions.resize((maxSamples < 1)? 1 : maxSamples);
+    times.resize(positions.size());
+    pendingStart.secPastEpoch = 0;
+    pendingStart.nsec = 0;
+
+    char name[QG_VALUE_STRLEN];
+    snprintf(name, QG_VALUE_STRLEN, "%s_FLIGHT%d", ctrler.nameCtrl.c_str(), axisNum);
+    threadName = name;
+    epicsThreadCreate(threadName.c_str(),
+                    epicsThreadPriorityMedium,
+                    epicsThreadGetStackSize(epicsThreadStackMedium),
+                    (EPICSTHREADFUNC)captureThreadC, this);
+}
+
+QgateFlightCapture::~QgateFlightCapture() {
+    exiting = true;
+    startEvent.signal();
+    exitEvent.wait();
+}
+
+/** Starts capturing the trace of a move. A trace being captured is published as it is.
+  * \param[in] moveStart Time the move started, origin of the sample times */
+void QgateFlightCapture::start(const epicsTimeStamp &moveStart) {
+    {
+        TakeLock takeLock(&stateMutex);
+        startPending = true;
+        finishPending = false;
+        pendingStart = moveStart;
+    }
+    startEvent.signal();
+}
+
+/** Ends the trace being captured, once the move is completed */
+void QgateFlightCapture::finish() {
+    TakeLock takeLock(&stateMutex);
+    finishPending = true;
+}
+
+/** Capture thread: samples the position back-to-back from a move start to its completion */
+void QgateFlightCapture::captureThread() {
+    QgateRequest *request = ctrler.ioQueue.acquire();
+    request->axisNum = axisNum;
+    request->type = QGCMD_POS_MEASURED;
+    while(!exiting) {
+        startEvent.wait();
+        epicsTimeStamp origin;
+        {
+            TakeLock takeLock(&stateMutex);
+            if(!startPending) {
+                continue;
+            }
+            startPending = false;
+            origin = pendingStart;
+        }
+        size_t numSamples = 0;
+        while(!exiting && numSamples < positions.size()) {
+            {
+                TakeLock takeLock(&stateMutex);
+                if(startPending || (finishPending && numSamples > 0)) {
+                    break;      //Another move started, or this one completed
+                }
+            }
+            double position = 0.0;
+            request->command.assign(measuredCmd);
+            if(ctrler.ioQueue.execute(*request) != DLL_ADAPTER_STATUS_SUCCESS || 
+                        !request->reply.getDouble(0, position)) {
+                break;          //Trace cut short by the link
+            }
+            positions[numSamples] = position;
+            times[numSamples] = epicsTimeDiffInSeconds(&request->sampled, &origin);
+            numSamples++;
+        }
+        if(!exiting) {
+            publish(numSamples);
+        }
+        TakeLock takeLock(&stateMutex);
+        if(startPending) {
+            startEvent.signal();    //Capture the next move straight away
+        }
+    }
+    ctrler.ioQueue.release(request);
+    exitEvent.signal();
+}
+
+/** Publishes the trace captured.
+  * \param[in] numSamples Samples of the trace */
+void QgateFlightCapture::publish(size_t numSamples) {
+    double rate = 0.0;
+    if(numSamples > 1 && times[numSamples-1] > times[0]) {
+        rate = (numSamples - 1) / (times[numSamples-1] - times[0]);
+    }
+    TakeLock takeLock(&ctrler);     //Parameter callbacks done when released
+    ctrler.doCallbacksFloat64Array(&positions[0], numSamples, ctrler.QG_AxisFlightPositions, axisNo);
+    ctrler.doCallbacksFloat64Array(&times[0], numSamples, ctrler.QG_AxisFlightTimes, axisNo);
+    ctrler.setIntegerParam(axisNo, ctrler.QG_AxisFlightCount, (int)numSamples);
+    ctrler.setDoubleParam(axisNo, ctrler.QG_AxisFlightRate, rate);
+}
@@ -0,0 +1,53 @@
+#ifndef QGATENPCflight_H_
+#define QGATENPCflight_H_
+
+#include <string>
+#include <vector>
+
+#include <epicsMutex.h>
+#include <epicsEvent.h>
+#include <epicsThread.h>
+#include <epicsTime.h>
+
+class QgateController;
+
+/* Flight capture of a stage: its position trace during a move.
+ * When a move starts, a capture thread reads the measured position
+ * back-to-back through the controller's I/O queue, as fast as the link
+ * allows, until the axis reports the move completed (in position, as its
+ * mode configures it) or the buffer is full. The whole trace, overshoot
+ * and settling included, is then published as waveforms: positions, and
+ * sample times since the move started.
+ * The buffers are allocated when configured, and the capture thread only
+ * takes the controller lock for publishing the trace.
+ */
+class QgateFlightCapture {
+public:
+    QgateFlightCapture(QgateController &controller, int axisNumber, size_t maxSamples);
+    virtual ~QgateFlightCapture();
+    void start(const epicsTimeStamp &moveStart);
+    void finish();
+    void captureThread();
+private:
+    void publish(size_t numSamples);
+private:
+    QgateController &ctrler;
+    int axisNum;                //Axis number [1..n]
+    int axisNo;                 //Axis index [0..n-1], as the asyn address
+    std::string measuredCmd;    //Measured position command for this axis
+    std::string threadName;
+    /* Trace, only used by the capture thread */
+    std::vector<double> positions;
+    std::vector<double> times;  //Sample times since the move started (secs)
+    /* Requests from the axis, protected by stateMutex */
+    epicsMutex stateMutex;
+    bool startPending;          //Move started: capture its trace
+    bool finishPending;         //Move completed: publish the trace
+    epicsTimeStamp pendingStart;    //Time the move started
+    /* Thread control */
+    epicsEvent startEvent;      //Signalled when a move starts, or when exiting
+    epicsEvent exitEvent;       //Signalled when the capture thread ends
+    bool exiting;
+};
+
+#endif //QGATENPCflight_H_
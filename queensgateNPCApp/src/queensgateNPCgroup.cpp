@@ -0,0 +1,74 @@
+#include "queensgateNPCgroup.hpp"
+
+/** Coordinated move group, with no axes.
+  * \param[in] groupName Name of the group
+  * \param[in] numAxes Amount of axes of the controller */
+QgateMoveGroup::QgateMoveGroup(const char *groupName, int numAxes)
+    : flushing(false)
+    , deferParam(-1)
+    , failedParam(-1)
+    , name(groupName)
+    , members(numAxes, false)
+    , moves(numAxes)
+    , deferring(false)
+{
+    for(int i=0; i<numAxes; i++) {
+        moves[i].reserve(QG_CMD_STRLEN);
+    }
+    flushAxes.reserve(numAxes);
+    request.command.reserve(QG_CMD_STRLEN * numAxes);
+}
+
+/** Adds an axis to the group
+  * \param[in] axisNum Axis stage number [1..n] */
+void QgateMoveGroup::addAxis(int axisNum) {
+    if(axisNum >= 1 && (size_t)axisNum <= members.size()) {
+        members[axisNum-1] = true;
+    }
+}
+
+/** Tells if an axis belongs to the group
+  * \param[in] axisNum Axis stage number [1..n] */
+bool QgateMoveGroup::hasAxis(int axisNum) const {
+    return axisNum >= 1 && (size_t)axisNum <= members.size() && members[axisNum-1];
+}
+
+/** Keeps the move of an axis until the group is flushed. Only the latest move is kept per axis.
+  * \param[in] axisNum Axis stage number [1..n]
+  * \param[in] cmd Controller command string, already rendered for the axis (see QgateCommandSet)
+  * \param[in] valueStr Formatted value of the command */
+void QgateMoveGroup::store(int axisNum, const std::string &cmd, const char *valueStr) {
+    std::string &move = moves[axisNum-1];
+    move.assign(cmd);
+    move.append(valueStr);
+}
+
+/** Discards the pending move of an axis
+  * \param[in] axisNum Axis stage number [1..n]
+  * \return true if the group is deferring moves */
+bool QgateMoveGroup::cancel(int axisNum) {
+    if(axisNum >= 1 && (size_t)axisNum <= moves.size()) {
+        moves[axisNum-1].clear();
+    }
+    return deferring;
+}
+
+/** Discards all the pending moves */
+void QgateMoveGroup::cancelAll() {
+    for(size_t i=0; i<moves.size(); i++) {
+        moves[i].clear();
+    }
+}
+
+/** Lists the axes with a move pending
+  * \param[out] axes Axis stage numbers [1..n], in axis order
+  * \return amount of moves pending */
+size_t QgateMoveGroup::getPending(std::vector<int> &axes) {
+    axes.clear();
+    for(size_t i=0; i<moves.size(); i++) {
+        if(!moves[i].empty()) {
+            axes.push_back(i+1);
+        }
+    }
+    return axes.size();
+}
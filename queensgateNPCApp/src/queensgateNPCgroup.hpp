@@ -0,0 +1,47 @@
+#ifndef QGATENPCgroup_H_
+#define QGATENPCgroup_H_
+
+#include <string>
+#include <vector>
+
+#include "queensgateNPCio.hpp"
+
+#define QG_MAX_MOVE_GROUPS  (8)         //Max amount of named move groups per controller
+
+/* Coordinated move group.
+ * While the group defers its moves, the latest move requested for each of
+ * its axes is kept, and all of them are sent together as a single
+ * multi-line request when the group is flushed. The move slots and the
+ * request are allocated when the group is created, so deferring and
+ * flushing moves does not allocate memory.
+ * Every controller has a group for all its axes, deferred by the motor
+ * records (motorDeferMoves_), and can have named groups of some axes,
+ * deferred independently.
+ */
+class QgateMoveGroup {
+public:
+    QgateMoveGroup(const char *groupName, int numAxes);
+    const std::string& getName() const { return name; }
+    void addAxis(int axisNum);
+    bool hasAxis(int axisNum) const;
+    void setDeferring(bool defer) { deferring = defer; }
+    bool isDeferring() const { return deferring; }
+    void store(int axisNum, const std::string &cmd, const char *valueStr);
+    bool cancel(int axisNum);
+    void cancelAll();
+    size_t getPending(std::vector<int> &axes);
+    const std::string& getMove(int axisNum) const { return moves[axisNum-1]; }
+public:
+    QgateRequest request;       //Request to flush the group, only used while flushing
+    std::vector<int> flushAxes; //Axes being flushed, in request order
+    bool flushing;              //Moves being sent
+    int deferParam;             //Parameter to defer the group, -1 if deferred by the motor records
+    int failedParam;            //Parameter reporting the moves failed on the last flush
+private:
+    std::string name;
+    std::vector<bool> members;  //Axes in the group, by axis index [0..n-1]
+    std::vector<std::string> moves; //Move command pending per axis, empty for none
+    bool deferring;             //Moves are being deferred
+};
+
+#endif //QGATENPCgroup_H_
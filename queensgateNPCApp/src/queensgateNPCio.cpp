@@ -0,0 +1,633 @@
+#include <sstream>
+
+#include <epicsTime.h>
+#include <TakeLock.h>
+
+#include "queensgateNPCio.hpp"
+#include "queensgateNPCpool.hpp"
+
+#define QGATE_IO_REQUESTS (8)   //Requests allocated in advance
+#define QGATE_IO_ANCHOR (10.0)  //Time between anchors of the monotonic clock to EPICS time (secs)
+#define QGATE_IO_CHECK (0.1)    //Time between deadline checks of a requester waiting (secs)
+#define QGATE_IO_LINE_ALLOWANCE (0.05)  //Deadline added per extra command line of a request (secs)
+#define QGATE_IO_DEADLINE_MAX (2.0)     //Longest deadline of a request, in request deadlines
+
+QgateRequest::QgateRequest()
+    : axisNum(0)
+    , type(0)
+    , result(DLL_ADAPTER_STATUS_SUCCESS)
+    , roundTrip(0.0)
+    , completion(NULL)
+    , pending(false)
+    , next(NULL)
+{
+    command.reserve(QG_CMD_STRLEN);
+    sampled.secPastEpoch = 0;
+    sampled.nsec = 0;
+}
+
+QgateRequest::~QgateRequest() {}
+
+/** Controller command queue.
+  * \param[in] adapter Controller library with the controller session
+  * \param[in] name Name of the controller, used for naming the I/O thread */
+QgateIOQueue::QgateIOQueue(QgateAdapter &adapter, QgateLatencyStats &latencyStats, const char *name)
+    : qg(adapter)
+    , latency(latencyStats)
+    , threadName(name)
+    , head(NULL)
+    , tail(NULL)
+    , lastHigh(NULL)
+    , pool(NULL)
+    , running(false)
+    , shuttingDown(false)
+    , maxRate(0.0)
+    , busyTime(0.0)
+    , numServed(0)
+    , deadline(0.0)
+    , inFlight(NULL)
+    , inFlightDeadline(0.0)
+    , overrunFlagged(false)
+    , inFlightAbandoned(false)
+    , numOverruns(0)
+    , worstTime(0.0)
+    , suspended(false)
+    , recoverPending(false)
+    , recoveryDone(false)
+    , recoveryResult(DLL_ADAPTER_STATUS_SUCCESS)
+    , anchorMonotonic(0)
+    , anchored(false)
+{
+    nextAllowed.secPastEpoch = 0;
+    nextAllowed.nsec = 0;
+    threadName.append("_IO");
+    sendCommand.reserve(QG_CMD_STRLEN);
+    freeRequests.reserve(QGATE_IO_REQUESTS * 2);
+    for(int i=0; i<QGATE_IO_REQUESTS; i++) {
+        freeRequests.push_back(new QgateRequest());
+    }
+}
+
+QgateIOQueue::~QgateIOQueue() {
+    stop();
+    for(size_t i=0; i<freeRequests.size(); i++) {
+        delete freeRequests[i];
+    }
+}
+
+static void ioThreadC(void *pPvt) {
+    QgateIOQueue *pQueue = (QgateIOQueue*)pPvt;
+    pQueue->ioThread();
+}
+
+/** Starts serving the queue
+  * \param[in] ioPool Shared pool to be served by, NULL for a dedicated I/O thread */
+void QgateIOQueue::start(QgateIOPool *ioPool) {
+    {
+        TakeLock takeLock(&queueMutex);
+        if(running) {
+            return;
+        }
+        running = true;
+        shuttingDown = false;
+        pool = ioPool;
+    }
+    if(pool != NULL) {
+        pool->attach(*this);
+        return;
+    }
+    epicsThreadCreate(threadName.c_str(),
+                    epicsThreadPriorityMedium,
+                    epicsThreadGetStackSize(epicsThreadStackMedium),
+                    (EPICSTHREADFUNC)ioThreadC, this);
+}
+
+/** Stops serving the queue, once the request being processed (if any) is finished */
+void QgateIOQueue::stop() {
+    {
+        TakeLock takeLock(&queueMutex);
+        if(!running || shuttingDown) {
+            return;
+        }
+        shuttingDown = true;
+    }
+    if(pool != NULL) {
+        pool->detach(*this);
+        drain();
+    } else {
+        queueEvent.signal();
+        exitEvent.wait();
+    }
+    TakeLock takeLock(&queueMutex);
+    running = false;
+}
+
+/** Caps the rate of requests sent to the controller
+  * \param[in] rate Maximum requests per second, 0 for no limit */
+void QgateIOQueue::setMaxRate(double rate) {
+    {
+        TakeLock takeLock(&queueMutex);
+        maxRate = (rate > 0.0)? rate : 0.0;
+    }
+    if(pool != NULL) {
+        pool->notify();
+    } else {
+        queueEvent.signal();
+    }
+}
+
+/** Reports the link usage so far
+  * \param[out] busyTime Total time spent on requests (secs)
+  * \param[out] numServed Requests sent */
+void QgateIOQueue::getLoad(double &busyTime, size_t &numServed) {
+    TakeLock takeLock(&queueMutex);
+    busyTime = this->busyTime;
+    numServed = this->numServed;
+}
+
+/** Sets the deadline of the requests sent from now on. Multi-line requests
+  * get QGATE_IO_LINE_ALLOWANCE more per extra line, up to QGATE_IO_DEADLINE_MAX
+  * times the deadline, so a batched poll is not given up much later than a
+  * single command.
+  * \param[in] requestTime Time allowed per request (secs), 0 for no deadline */
+void QgateIOQueue::setDeadline(double requestTime) {
+    TakeLock takeLock(&queueMutex);
+    deadline = (requestTime > 0.0)? requestTime : 0.0;
+}
+
+/** Checks if the request being sent has overrun its deadline.
+  * Each overrun is reported once only.
+  * \param[out] elapsed Time since the request was sent (secs), when overrun
+  * \return true if the request being sent has just been found overrun */
+bool QgateIOQueue::checkDeadline(double &elapsed) {
+    TakeLock takeLock(&queueMutex);
+    if(inFlight == NULL || overrunFlagged || inFlightDeadline <= 0.0) {
+        return false;
+    }
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+    elapsed = epicsTimeDiffInSeconds(&now, &inFlightSent);
+    if(elapsed <= inFlightDeadline) {
+        return false;
+    }
+    overrunFlagged = true;
+    numOverruns++;
+    return true;
+}
+
+/** Reports the deadline statistics so far
+  * \param[out] numOverruns Requests that overran their deadline
+  * \param[out] worstTime Longest time taken by a request, including the one being sent (secs) */
+void QgateIOQueue::getDeadlineStats(size_t &numOverruns, double &worstTime) {
+    TakeLock takeLock(&queueMutex);
+    numOverruns = this->numOverruns;
+    worstTime = this->worstTime;
+    if(inFlight != NULL) {
+        epicsTimeStamp now;
+        epicsTimeGetCurrent(&now);
+        double elapsed = epicsTimeDiffInSeconds(&now, &inFlightSent);
+        if(elapsed > worstTime) {
+            worstTime = elapsed;
+        }
+    }
+}
+
+/** Asks for the controller session to be closed and reopened, e.g. when the
+  * link hangs. It is done by the thread serving the queue, as soon as the
+  * request being sent (if any) returns. The requests processed until then fail.
+  * \param[in] device Device to reopen the session on */
+void QgateIOQueue::recover(const std::string &device) {
+    {
+        TakeLock takeLock(&queueMutex);
+        if(recoverPending) {
+            return;
+        }
+        recoverPending = true;
+        suspended = true;
+        sessionDevice = device;
+    }
+    if(pool != NULL) {
+        pool->notify();
+    } else {
+        queueEvent.signal();
+    }
+}
+
+/** Tells if the session has been reopened since last asked.
+  * \param[out] result Outcome of reopening the session, when reopened
+  * \return true if the session has just been reopened */
+bool QgateIOQueue::getRecovered(DllAdapterStatus &result) {
+    TakeLock takeLock(&queueMutex);
+    if(!recoveryDone) {
+        return false;
+    }
+    recoveryDone = false;
+    result = recoveryResult;
+    return true;
+}
+
+/** Closes and reopens the controller session. Only called by the thread
+  * serving the queue, so no other library call is in progress. */
+void QgateIOQueue::recoverSession() {
+    std::string device;
+    {
+        TakeLock takeLock(&queueMutex);
+        device = sessionDevice;
+    }
+    qg.CloseSession();
+    DllAdapterStatus result = qg.OpenSession(device);
+    TakeLock takeLock(&queueMutex);
+    recoverPending = false;
+    suspended = false;
+    recoveryDone = true;
+    recoveryResult = result;
+}
+
+/** Tells if the request being sent has overrun its deadline.
+  * Must be called with queueMutex taken.
+  * \return true if the link is hung */
+bool QgateIOQueue::isHung() {
+    if(inFlight == NULL || inFlightDeadline <= 0.0) {
+        return false;
+    }
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+    return (epicsTimeDiffInSeconds(&now, &inFlightSent) > inFlightDeadline);
+}
+
+/** Fails a request whose requester is no longer waiting for it.
+  * If queued, it is taken off the queue; if being sent, its outcome is
+  * discarded when DoCommand returns. Must be called with queueMutex taken.
+  * \param[in,out] request Pending request. Returns failed. */
+void QgateIOQueue::abandon(QgateRequest &request) {
+    QgateRequest *previous = NULL;
+    QgateRequest *queued = head;
+    while(queued != NULL && queued != &request) {
+        previous = queued;
+        queued = queued->next;
+    }
+    if(queued != NULL) {
+        if(previous == NULL) {
+            head = request.next;
+        } else {
+            previous->next = request.next;
+        }
+        if(tail == &request) {
+            tail = previous;
+        }
+        if(lastHigh == &request) {
+            lastHigh = previous;    //High priority requests are all at the front
+        }
+        request.next = NULL;
+    } else if(inFlight == &request) {
+        inFlightAbandoned = true;
+    }
+    request.pending = false;
+    reject(request);
+    request.errorText.assign("controller request deadline overrun");
+}
+
+/** Gets a request object ready to be used.
+  * \return request to be given back with release() when no longer needed */
+QgateRequest* QgateIOQueue::acquire() {
+    QgateRequest *request = NULL;
+    {
+        TakeLock takeLock(&queueMutex);
+        if(!freeRequests.empty()) {
+            request = freeRequests.back();
+            freeRequests.pop_back();
+        }
+    }
+    if(request == NULL) {
+        request = new QgateRequest();   //All in use: more requesters than expected
+    }
+    request->axisNum = 0;
+    request->completion = NULL;
+    request->command.clear();
+    return request;
+}
+
+/** Gives back a request object obtained by acquire().
+  * \param[in] request Request no longer needed */
+void QgateIOQueue::release(QgateRequest *request) {
+    TakeLock takeLock(&queueMutex);
+    freeRequests.push_back(request);
+}
+
+/** Sends a request to the controller and waits for its outcome.
+  * The wait ends with a failure if the request being sent (this one or
+  * another ahead of it) overruns its deadline.
+  * \param[in,out] request Request to send. Returns with its result and reply.
+  * \param[in] priority Urgency of the request
+  * \return request result */
+DllAdapterStatus QgateIOQueue::execute(QgateRequest &request, PRIORITY priority) {
+    send(request, priority);
+    return waitFor(request);
+}
+
+/** Queues a request to the controller, its outcome waited for with waitFor().
+  * Requests of the same priority are sent in the order queued.
+  * \param[in,out] request Request to send
+  * \param[in] priority Urgency of the request */
+void QgateIOQueue::send(QgateRequest &request, PRIORITY priority) {
+    request.completion = NULL;
+    if(!push(request, priority)) {
+        reject(request);
+        request.done.signal();
+    }
+}
+
+/** Waits for the outcome of a request queued with send().
+  * The wait ends with a failure if the request being sent (this one or
+  * another ahead of it) overruns its deadline.
+  * \param[in,out] request Request sent. Returns with its result and reply.
+  * \return request result */
+DllAdapterStatus QgateIOQueue::waitFor(QgateRequest &request) {
+    while(!request.done.wait(QGATE_IO_CHECK)) {
+        TakeLock takeLock(&queueMutex);
+        if(request.pending && isHung()) {
+            abandon(request);
+            break;
+        }
+    }
+    return request.result;
+}
+
+/** Sends a request to the controller without waiting for its outcome.
+  * \param[in] request Request to send, with the completion to deliver the outcome to.
+  *                 It must remain available until completed.
+  * \param[in] priority Urgency of the request */
+void QgateIOQueue::submit(QgateRequest &request, PRIORITY priority) {
+    if(!push(request, priority)) {
+        reject(request);
+        complete(request);
+    }
+}
+
+/** Puts a request on the queue.
+  * \param[in] request Request to queue
+  * \param[in] priority Urgency of the request: high priority requests go after
+  *                 other high priority requests, but before the normal ones
+  * \return false if the queue is no longer served */
+bool QgateIOQueue::push(QgateRequest &request, PRIORITY priority) {
+    {
+        TakeLock takeLock(&queueMutex);
+        if(!running || shuttingDown) {
+            return false;
+        }
+        request.next = NULL;
+        request.pending = true;
+        if(priority == PRIORITY_HIGH) {
+            if(lastHigh == NULL) {
+                request.next = head;
+                head = &request;
+            } else {
+                request.next = lastHigh->next;
+                lastHigh->next = &request;
+            }
+            lastHigh = &request;
+            if(request.next == NULL) {
+                tail = &request;
+            }
+        } else {
+            if(tail == NULL) {
+                head = &request;
+            } else {
+                tail->next = &request;
+            }
+            tail = &request;
+        }
+    }
+    if(pool != NULL) {
+        pool->notify();
+    } else {
+        queueEvent.signal();
+    }
+    return true;
+}
+
+/** Takes the next request from the queue. Must be called with queueMutex taken.
+  * \return next request, NULL if the queue is empty */
+QgateRequest* QgateIOQueue::pop() {
+    QgateRequest *request = head;
+    if(request != NULL) {
+        head = request->next;
+        if(head == NULL) {
+            tail = NULL;
+        }
+        if(lastHigh == request) {
+            lastHigh = NULL;
+        }
+        request->next = NULL;
+    }
+    return request;
+}
+
+/** Tells when the next request can be sent. Must be called with queueMutex taken.
+  * \return seconds to wait for the rate limit, 0 if it can be sent now,
+  *         or a negative value if there is nothing to send */
+double QgateIOQueue::pendingWait() {
+    if(head == NULL) {
+        return -1.0;
+    }
+    if(maxRate <= 0.0) {
+        return 0.0;
+    }
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+    double wait = epicsTimeDiffInSeconds(&nextAllowed, &now);
+    return (wait > 0.0)? wait : 0.0;
+}
+
+/** Sends the next request, if there is one that can be sent now.
+  * Used by the shared pool, that never serves a queue from two workers at once.
+  * \return false if nothing was sent */
+bool QgateIOQueue::serveNext() {
+    QgateRequest *request = NULL;
+    {
+        TakeLock takeLock(&queueMutex);
+        if(shuttingDown || pendingWait() != 0.0) {
+            return false;
+        }
+        request = pop();
+    }
+    if(process(*request)) {
+        complete(*request);
+    }
+    return true;
+}
+
+/** I/O thread: sends the queued requests to the controller one at a time */
+void QgateIOQueue::ioThread() {
+    while(true) {
+        QgateRequest *request = NULL;
+        double wait = 0.0;
+        {
+            TakeLock takeLock(&queueMutex);
+            if(shuttingDown) {
+                break;
+            }
+            wait = pendingWait();
+            if(wait == 0.0) {
+                request = pop();
+            }
+        }
+        if(request == NULL) {
+            if(wait > 0.0) {
+                queueEvent.wait(wait);      //Rate limited
+            } else {
+                queueEvent.wait();
+            }
+            continue;
+        }
+        if(process(*request)) {
+            complete(*request);
+        }
+    }
+    drain();
+    exitEvent.signal();
+}
+
+/** Gives back all pending requests, once nothing else will be sent */
+void QgateIOQueue::drain() {
+    while(true) {
+        QgateRequest *request = NULL;
+        {
+            TakeLock takeLock(&queueMutex);
+            request = pop();
+            if(request != NULL) {
+                request->pending = false;
+            }
+        }
+        if(request == NULL) {
+            break;
+        }
+        reject(*request);
+        complete(*request);
+    }
+}
+
+/** Delivers the outcome of a request to its requester.
+  * \param[in] request Request processed */
+void QgateIOQueue::complete(QgateRequest &request) {
+    if(request.completion != NULL) {
+        request.completion->requestCompleted(request);
+    } else {
+        request.done.signal();
+    }
+}
+
+/** Sets the outcome of a request that cannot be sent.
+  * \param[in,out] request Request not sent */
+void QgateIOQueue::reject(QgateRequest &request) {
+    request.result = DLL_ADAPTER_STATUS_ERROR_UNKNOWN_COMMAND;
+    request.reply.clear();
+    request.errorText.assign("controller I/O not running");
+}
+
+/** Sends a request to the controller and decodes its reply.
+  * \param[in,out] request Request to send. Returns with its result and reply.
+  * \return false if the request was abandoned meanwhile, so it is not to be completed */
+bool QgateIOQueue::process(QgateRequest &request) {
+    epicsTimeStamp sent;
+    bool sending = true;
+    bool recovering = false;
+    size_t type = request.type;
+    {
+        TakeLock takeLock(&queueMutex);
+        recovering = recoverPending;
+    }
+    if(recovering) {
+        recoverSession();
+    }
+    replyNames.clear();
+    replyValues.clear();
+    epicsUInt64 sentMonotonic = epicsMonotonicGet();
+    toEpicsTime(sentMonotonic, sent);
+    {
+        TakeLock takeLock(&queueMutex);
+        sending = !suspended;
+        if(sending) {
+            //Deadline extended for the extra command lines of the request, up to a maximum
+            size_t numLines = 1;
+            for(size_t pos = request.command.find('\n'); pos != std::string::npos; pos = request.command.find('\n', pos + 1)) {
+                numLines++;
+            }
+            double requestDeadline = deadline + QGATE_IO_LINE_ALLOWANCE * (numLines - 1);
+            if(requestDeadline > deadline * QGATE_IO_DEADLINE_MAX) {
+                requestDeadline = deadline * QGATE_IO_DEADLINE_MAX;
+            }
+            sendCommand.assign(request.command);
+            inFlight = &request;
+            inFlightSent = sent;
+            inFlightDeadline = (deadline > 0.0)? requestDeadline : 0.0;
+            overrunFlagged = false;
+            inFlightAbandoned = false;
+        } else {
+            request.pending = false;
+        }
+    }
+    if(!sending) {
+        reject(request);
+        request.errorText.assign("controller session being recovered");
+        return true;
+    }
+    DllAdapterStatus result = qg.DoCommand(sendCommand, replyNames, replyValues);
+    epicsUInt64 receivedMonotonic = epicsMonotonicGet();
+    double elapsed = (receivedMonotonic - sentMonotonic) * 1.0e-9;
+    latency.add(type, elapsed, (result == DLL_ADAPTER_STATUS_SUCCESS));
+    bool abandoned = false;
+    {
+        TakeLock takeLock(&queueMutex);
+        inFlight = NULL;
+        abandoned = inFlightAbandoned;
+        inFlightAbandoned = false;
+        if(!abandoned) {
+            request.pending = false;    //No longer abandoned by its requester
+        }
+        recovering = recoverPending;
+        if(elapsed > worstTime) {
+            worstTime = elapsed;
+        }
+        busyTime += elapsed;
+        numServed++;
+        if(maxRate > 0.0) {
+            nextAllowed = sent;
+            epicsTimeAddSeconds(&nextAllowed, 1.0 / maxRate);
+        }
+    }
+    if(recovering) {
+        recoverSession();   //Hung request finally returned
+    }
+    if(abandoned) {
+        return false;       //Requester already failed: the request may be in use again
+    }
+    request.result = result;
+    request.roundTrip = elapsed;
+    toEpicsTime(sentMonotonic + (receivedMonotonic - sentMonotonic) / 2, request.sampled);
+    //A failed multi-line request keeps the values replied before failing
+    request.reply.assign(replyNames, replyValues);
+    if(request.result == DLL_ADAPTER_STATUS_SUCCESS) {
+        request.errorText.clear();
+    } else {
+        std::ostringstream errorStr;
+        qg.GetErrorText(errorStr, request.result);
+        request.errorText = errorStr.str();
+    }
+    return true;
+}
+
+/** Converts a monotonic clock time to EPICS time. The clocks are anchored
+  * together every QGATE_IO_ANCHOR seconds, so the EPICS time adjustments
+  * are followed without stepping the times of the requests in between.
+  * \param[in] monotonic Monotonic clock time (ns)
+  * \param[out] time EPICS time */
+void QgateIOQueue::toEpicsTime(epicsUInt64 monotonic, epicsTimeStamp &time) {
+    if(!anchored || ((epicsInt64)(monotonic - anchorMonotonic)) * 1.0e-9 >= QGATE_IO_ANCHOR) {
+        epicsTimeGetCurrent(&anchorTime);
+        anchorMonotonic = epicsMonotonicGet();
+        anchored = true;
+    }
+    time = anchorTime;
+    epicsTimeAddSeconds(&time, ((epicsInt64)(monotonic - anchorMonotonic)) * 1.0e-9);
+}
@@ -0,0 +1,162 @@
+#ifndef QGATENPCio_H_
+#define QGATENPCio_H_
+
+#include <string>
+#include <vector>
+
+#include <epicsMutex.h>
+#include <epicsEvent.h>
+#include <epicsThread.h>
+#include <epicsTime.h>
+
+#include "queensgateNPCadapter.hpp"
+#include "queensgateNPCreply.hpp"
+#include "queensgateNPClatency.hpp"
+
+#define QG_CMD_STRLEN           (128)           //Max length expected for a single controller command
+
+class QgateRequest;
+class QgateIOPool;
+
+//Receiver of the outcome of requests submitted without waiting
+class QgateCompletion {
+public:
+    virtual ~QgateCompletion() {};
+    /** Called from the I/O thread when a request has been processed.
+      * The request can be released back to its queue from here. */
+    virtual void requestCompleted(QgateRequest &request) = 0;
+};
+
+//Controller request, to be sent by the I/O thread
+class QgateRequest {
+    friend class QgateIOQueue;
+public:
+    QgateRequest();
+    ~QgateRequest();
+public:
+    std::string command;        //Controller command string (single or multi-line)
+    int axisNum;                //Axis stage the command is for, 0 for the controller or several axes
+    size_t type;                //Type of request, for the latency statistics
+    DllAdapterStatus result;    //Outcome of the request
+    std::string errorText;      //Description of the error when failed
+    QgateReply reply;           //Decoded reply. When failed, the values replied before failing
+    epicsTimeStamp sampled;     //Estimated time the controller replied: midpoint of the round trip
+    double roundTrip;           //Round trip time of the request (secs)
+    QgateCompletion *completion;    //Receiver of the outcome when not waiting for it
+private:
+    bool pending;               //Queued or being sent, outcome not set yet
+    epicsEvent done;            //Signalled when processed
+    QgateRequest *next;         //Next request on the queue
+private:
+    QgateRequest(const QgateRequest& other);
+    QgateRequest& operator=(const QgateRequest& other);
+};
+
+/* Controller command queue.
+ * All the traffic with a controller goes through its queue, served by a
+ * dedicated I/O thread that is the only one calling the adapter's DoCommand.
+ * Requesters either wait for the outcome (execute, or send and then waitFor
+ * when the request must be queued under a lock of their own) or get it delivered to
+ * a QgateCompletion (submit), so they do not hold any lock while the
+ * request goes through the link. Urgent requests (e.g. moves) are queued
+ * ahead of the normal ones (e.g. polling).
+ * Requests are recycled through a free list, so the queue does not
+ * allocate memory once it has enough of them.
+ * The time taken by every request is recorded on the latency statistics.
+ * The queue is either served by its own I/O thread or by the workers of a
+ * shared QgateIOPool, and can be capped to a maximum request rate.
+ * Requests are timed with the monotonic clock, mapped to EPICS time from
+ * an anchor taken every so often, so the time a reply was sampled is not
+ * affected by the EPICS time being adjusted while the request was sent.
+ * Every request sent gets a deadline (capped for multi-line requests), for a
+ * watchdog to detect the link hanging (see checkDeadline()). A requester
+ * waiting on execute() fails once the request being sent overruns its
+ * deadline, rather than waiting for as long as the link hangs: the request
+ * is then abandoned, and its reply (if any ever comes) is discarded.
+ * DoCommand cannot be aborted, and the library calls block each other
+ * (manual 2.5), so the session is only closed and reopened by the thread
+ * serving the queue, once the hung request returns (see recover()).
+ * Meanwhile the requests processed fail without reaching the controller.
+ */
+class QgateIOQueue {
+    friend class QgateIOPool;
+public:
+    enum PRIORITY {
+        PRIORITY_NORMAL = 0,
+        PRIORITY_HIGH = 1
+    };
+public:
+    QgateIOQueue(QgateAdapter &adapter, QgateLatencyStats &latencyStats, const char *name);
+    virtual ~QgateIOQueue();
+    void start(QgateIOPool *ioPool=NULL);
+    void stop();
+    void setMaxRate(double rate);
+    void getLoad(double &busyTime, size_t &numServed);
+    void setDeadline(double lineTime);
+    bool checkDeadline(double &elapsed);
+    void getDeadlineStats(size_t &numOverruns, double &worstTime);
+    void recover(const std::string &device);
+    bool getRecovered(DllAdapterStatus &result);
+    const std::string& getName() const { return threadName; }
+    QgateRequest* acquire();
+    void release(QgateRequest *request);
+    DllAdapterStatus execute(QgateRequest &request, PRIORITY priority=PRIORITY_NORMAL);
+    void send(QgateRequest &request, PRIORITY priority=PRIORITY_NORMAL);
+    DllAdapterStatus waitFor(QgateRequest &request);
+    void submit(QgateRequest &request, PRIORITY priority=PRIORITY_NORMAL);
+    void ioThread();
+private:
+    bool push(QgateRequest &request, PRIORITY priority);
+    QgateRequest* pop();
+    double pendingWait();
+    bool serveNext();
+    void drain();
+    bool process(QgateRequest &request);
+    bool isHung();
+    void abandon(QgateRequest &request);
+    void recoverSession();
+    void toEpicsTime(epicsUInt64 monotonic, epicsTimeStamp &time);
+    void complete(QgateRequest &request);
+    void reject(QgateRequest &request);
+private:
+    QgateAdapter &qg;           //Controller library
+    QgateLatencyStats &latency; //Request latency statistics
+    std::string threadName;
+    epicsMutex queueMutex;      //Protects the queue and free list
+    epicsEvent queueEvent;      //Signalled when requests are queued
+    epicsEvent exitEvent;       //Signalled when the I/O thread ends
+    QgateRequest *head;         //Queue of pending requests
+    QgateRequest *tail;
+    QgateRequest *lastHigh;     //Last high priority request on the queue
+    std::string sendCommand;    //Copy of the command being sent, as the request can be abandoned
+    QGList replyNames;          //Reply lists as filled by the adapter
+    QGList replyValues;
+    std::vector<QgateRequest*> freeRequests;
+    QgateIOPool *pool;          //Shared pool serving the queue, NULL when served by its own thread
+    bool running;
+    bool shuttingDown;
+    double maxRate;             //Maximum requests per second, 0 for no limit
+    epicsTimeStamp nextAllowed; //Time from which the next request can be sent, when rate limited
+    double busyTime;            //Total time spent on requests (secs)
+    size_t numServed;           //Requests sent
+    /* Deadline watchdog */
+    double deadline;            //Time allowed per request (secs), 0 for no deadline
+    QgateRequest *inFlight;     //Request being sent, NULL for none
+    epicsTimeStamp inFlightSent;    //Time the request being sent was sent
+    double inFlightDeadline;    //Time allowed for the request being sent (secs), 0 for no deadline
+    bool overrunFlagged;        //Request being sent already reported as overrun
+    bool inFlightAbandoned;     //Requester of the request being sent no longer waiting
+    size_t numOverruns;         //Requests that overran their deadline
+    double worstTime;           //Longest time taken by a request (secs)
+    bool suspended;             //Session being recovered: requests not sent
+    bool recoverPending;        //Session to be reopened by the thread serving the queue
+    std::string sessionDevice;  //Device to reopen the session on
+    bool recoveryDone;          //Session reopened, not reported yet
+    DllAdapterStatus recoveryResult;    //Outcome of reopening the session
+    /* Monotonic clock mapping, only used while processing a request */
+    epicsUInt64 anchorMonotonic;    //Monotonic time (ns) of the anchor
+    epicsTimeStamp anchorTime;  //EPICS time of the anchor
+    bool anchored;
+};
+
+#endif //QGATENPCio_H_
@@ -0,0 +1,112 @@
+#include <string.h>
+
+#include <TakeLock.h>
+
+#include "queensgateNPClatency.hpp"
+
+/* Histogram bin upper limits, in seconds. The last bin takes everything above the previous limit */
+const double QgateLatencyStats::binLimits[QG_LATENCY_NUMBINS] = {
+    0.0005, 0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1.0, 2.0, 1.0e9
+};
+
+/** Request latency statistics.
+  * \param[in] numTypes Amount of types of request */
+QgateLatencyStats::QgateLatencyStats(size_t numTypes)
+    : numTypes(numTypes)
+    , histograms(numTypes + 1)
+    , timeoutThreshold(1.0)
+{
+    reset();
+}
+
+/** Records the latency of a request. Called from the I/O thread.
+  * \param[in] type Type of request [0..numTypes-1]
+  * \param[in] latency Time taken by the request (secs)
+  * \param[in] success Request succeeded */
+void QgateLatencyStats::add(size_t type, double latency, bool success) {
+    size_t bin = 0;
+    while(bin < QG_LATENCY_NUMBINS - 1 && latency > binLimits[bin]) {
+        bin++;
+    }
+    TakeLock takeLock(&mutex);
+    bool timedOut = (latency >= timeoutThreshold);
+    if(type < numTypes) {
+        addTo(histograms[type], bin, latency, success, timedOut);
+    }
+    addTo(histograms[numTypes], bin, latency, success, timedOut);
+}
+
+void QgateLatencyStats::addTo(Histogram &histogram, size_t bin, double latency, bool success, bool timedOut) {
+    histogram.counts[bin]++;
+    histogram.calls++;
+    if(!success) {
+        histogram.errors++;
+    }
+    if(timedOut) {
+        histogram.timeouts++;
+    }
+    if(latency > histogram.max) {
+        histogram.max = latency;
+    }
+}
+
+/** Clears all the statistics */
+void QgateLatencyStats::reset() {
+    TakeLock takeLock(&mutex);
+    for(size_t i=0; i<histograms.size(); i++) {
+        memset(&histograms[i], 0, sizeof(Histogram));
+    }
+}
+
+/** Sets the latency from which a request is counted as a timeout.
+  * \param[in] timeout Timeout threshold (secs) */
+void QgateLatencyStats::setTimeout(double timeout) {
+    TakeLock takeLock(&mutex);
+    timeoutThreshold = timeout;
+}
+
+/** Retrieves the latency summary of a type of request.
+  * \param[in] type Type of request, or getTotalType() for all of them
+  * \param[out] summary Latency summary */
+void QgateLatencyStats::getSummary(size_t type, QgateLatencySummary &summary) {
+    TakeLock takeLock(&mutex);
+    const Histogram &histogram = histograms[(type < numTypes)? type : numTypes];
+    summary.calls = histogram.calls;
+    summary.errors = histogram.errors;
+    summary.timeouts = histogram.timeouts;
+    summary.p50 = percentile(histogram, 0.50);
+    summary.p99 = percentile(histogram, 0.99);
+    summary.max = histogram.max;
+}
+
+/** Retrieves the latency histogram of a type of request.
+  * \param[in] type Type of request, or getTotalType() for all of them
+  * \param[out] counts Requests counted on each bin */
+void QgateLatencyStats::getHistogram(size_t type, double counts[QG_LATENCY_NUMBINS]) {
+    TakeLock takeLock(&mutex);
+    const Histogram &histogram = histograms[(type < numTypes)? type : numTypes];
+    memcpy(counts, histogram.counts, sizeof(histogram.counts));
+}
+
+/** Estimates a percentile, interpolating within the histogram bin it falls in.
+  * \param[in] histogram Histogram to use
+  * \param[in] fraction Percentile, as a fraction [0..1]
+  * \return latency estimated (secs), never above the maximum seen */
+double QgateLatencyStats::percentile(const Histogram &histogram, double fraction) {
+    if(histogram.calls <= 0.0) {
+        return 0.0;
+    }
+    double target = fraction * histogram.calls;
+    double accumulated = 0.0;
+    for(size_t bin=0; bin<QG_LATENCY_NUMBINS; bin++) {
+        double count = histogram.counts[bin];
+        if(count > 0.0 && accumulated + count >= target) {
+            double lower = (bin == 0)? 0.0 : binLimits[bin - 1];
+            double upper = (binLimits[bin] < histogram.max)? binLimits[bin] : histogram.max;
+            double value = lower + (upper - lower) * (target - accumulated) / count;
+            return (value < histogram.max)? value : histogram.max;
+        }
+        accumulated += count;
+    }
+    return histogram.max;
+}
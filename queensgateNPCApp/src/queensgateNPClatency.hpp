@@ -0,0 +1,55 @@
+#ifndef QGATENPClatency_H_
+#define QGATENPClatency_H_
+
+#include <vector>
+
+#include <epicsMutex.h>
+
+#define QG_LATENCY_NUMBINS  (13)        //Histogram bins, see QgateLatencyStats::binLimits
+
+//Latency summary of a type of request
+struct QgateLatencySummary {
+    double calls;
+    double errors;
+    double timeouts;        //Requests slower than the timeout threshold
+    double p50;             //Median latency (secs), estimated from the histogram
+    double p99;             //99th percentile latency (secs), estimated from the histogram
+    double max;             //Maximum latency (secs)
+};
+
+/* Controller request latency statistics, per type of request.
+ * Each request's latency is counted on a histogram of fixed, logarithmic
+ * bins, so recording it is a constant-time update that does not allocate
+ * memory and can be done on every request. Percentiles are estimated from
+ * the histogram. An extra type (getTotalType()) accumulates all requests.
+ */
+class QgateLatencyStats {
+public:
+    QgateLatencyStats(size_t numTypes);
+    void add(size_t type, double latency, bool success);
+    void reset();
+    void setTimeout(double timeout);
+    void getSummary(size_t type, QgateLatencySummary &summary);
+    void getHistogram(size_t type, double counts[QG_LATENCY_NUMBINS]);
+    size_t getTotalType() const { return numTypes; }
+public:
+    static const double binLimits[QG_LATENCY_NUMBINS];    //Upper limit of each bin (secs)
+private:
+    struct Histogram {
+        double counts[QG_LATENCY_NUMBINS];
+        double calls;
+        double errors;
+        double timeouts;
+        double max;
+    };
+private:
+    void addTo(Histogram &histogram, size_t bin, double latency, bool success, bool timedOut);
+    static double percentile(const Histogram &histogram, double fraction);
+private:
+    epicsMutex mutex;               //Protects the histograms: written by the I/O thread, read by the publisher
+    size_t numTypes;
+    std::vector<Histogram> histograms;  //One per type, plus the total
+    double timeoutThreshold;        //Latency considered a timeout (secs)
+};
+
+#endif //QGATENPClatency_H_
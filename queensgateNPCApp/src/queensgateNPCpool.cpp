@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <sstream>
+
+#include <epicsThread.h>
+#include <TakeLock.h>
+
+#include "queensgateNPCpool.hpp"
+#include "queensgateNPCio.hpp"
+
+QgateIOPool *QgateIOPool::shared = NULL;
+
+static void workerThreadC(void *pPvt) {
+    QgateIOPool *pPool = (QgateIOPool*)pPvt;
+    pPool->workerThread();
+}
+
+/** Shared I/O thread pool
+  * \param[in] numWorkers Amount of worker threads */
+QgateIOPool::QgateIOPool(int numWorkers)
+    : nextQueue(0)
+    , numWorkers(numWorkers)
+{
+    for(int i=0; i<numWorkers; i++) {
+        std::ostringstream name;
+        name << "QGATE_IOPOOL" << i;
+        epicsThreadCreate(name.str().c_str(),
+                        epicsThreadPriorityMedium,
+                        epicsThreadGetStackSize(epicsThreadStackMedium),
+                        (EPICSTHREADFUNC)workerThreadC, this);
+    }
+}
+
+/** Creates the pool shared by all the controllers that ask for it
+  * \param[in] numWorkers Amount of worker threads
+  * \return false if already created or invalid */
+bool QgateIOPool::configure(int numWorkers) {
+    if(shared != NULL || numWorkers < 1) {
+        return false;
+    }
+    shared = new QgateIOPool(numWorkers);
+    return true;
+}
+
+/** Gets the pool shared by the controllers
+  * \return shared pool, NULL if not configured */
+QgateIOPool* QgateIOPool::getShared() {
+    return shared;
+}
+
+/** Starts serving a queue
+  * \param[in] queue Command queue to serve */
+void QgateIOPool::attach(QgateIOQueue &queue) {
+    {
+        TakeLock takeLock(&poolMutex);
+        Entry entry;
+        entry.queue = &queue;
+        entry.busy = false;
+        queues.push_back(entry);
+    }
+    workEvent.signal();
+}
+
+/** Stops serving a queue, once the request being sent (if any) is finished
+  * \param[in] queue Command queue to stop serving */
+void QgateIOPool::detach(QgateIOQueue &queue) {
+    while(true) {
+        {
+            TakeLock takeLock(&poolMutex);
+            size_t i = 0;
+            while(i<queues.size() && queues[i].queue != &queue) {
+                i++;
+            }
+            if(i == queues.size()) {
+                return;     //Not served
+            }
+            if(!queues[i].busy) {
+                queues.erase(queues.begin() + i);
+                nextQueue = 0;
+                return;
+            }
+        }
+        epicsThreadSleep(0.01);     //Request being sent: wait for it
+    }
+}
+
+/** Wakes up a worker, as there could be work to do */
+void QgateIOPool::notify() {
+    workEvent.signal();
+}
+
+/** Prints the link usage of every queue served */
+void QgateIOPool::report() {
+    TakeLock takeLock(&poolMutex);
+    printf("queensgateNPC I/O pool: %d workers, %lu controllers\n", numWorkers, (unsigned long)queues.size());
+    for(size_t i=0; i<queues.size(); i++) {
+        double busyTime = 0.0;
+        size_t numServed = 0;
+        queues[i].queue->getLoad(busyTime, numServed);
+        printf("  %-20s %10lu requests, %10.3f secs busy%s\n", queues[i].queue->getName().c_str(),
+                (unsigned long)numServed, busyTime, (queues[i].busy)? " (sending)" : "");
+    }
+}
+
+/** Worker thread: takes turns serving the queues that have a request ready */
+void QgateIOPool::workerThread() {
+    while(true) {
+        size_t served = 0;
+        QgateIOQueue *queue = NULL;
+        double wait = -1.0;     //Shortest time for a rate-limited queue to be ready
+        {
+            TakeLock takeLock(&poolMutex);
+            for(size_t n=0; n<queues.size() && queue==NULL; n++) {
+                size_t i = (nextQueue + n) % queues.size();
+                if(queues[i].busy) {
+                    continue;
+                }
+                double queueWait = 0.0;
+                {
+                    TakeLock queueLock(&queues[i].queue->queueMutex);
+                    queueWait = queues[i].queue->pendingWait();
+                }
+                if(queueWait == 0.0) {
+                    queue = queues[i].queue;
+                    queues[i].busy = true;
+                    served = i;
+                    nextQueue = (i + 1) % queues.size();    //Next turn for the following queue
+                } else if(queueWait > 0.0 && (wait < 0.0 || queueWait < wait)) {
+                    wait = queueWait;
+                }
+            }
+        }
+        if(queue == NULL) {
+            if(wait > 0.0) {
+                workEvent.wait(wait);
+            } else {
+                workEvent.wait();
+            }
+            continue;
+        }
+        workEvent.signal();     //Other queues could be ready for other workers meanwhile
+        queue->serveNext();
+        {
+            TakeLock takeLock(&poolMutex);
+            if(served < queues.size() && queues[served].queue == queue) {
+                queues[served].busy = false;
+            } else {
+                //Queues changed meanwhile: find it again
+                for(size_t i=0; i<queues.size(); i++) {
+                    if(queues[i].queue == queue) {
+                        queues[i].busy = false;
+                    }
+                }
+            }
+        }
+        workEvent.signal();     //The queue could have more requests
+    }
+}
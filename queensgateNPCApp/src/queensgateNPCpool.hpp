@@ -0,0 +1,47 @@
+#ifndef QGATENPCpool_H_
+#define QGATENPCpool_H_
+
+#include <vector>
+
+#include <epicsMutex.h>
+#include <epicsEvent.h>
+
+class QgateIOQueue;
+
+/* Shared I/O thread pool.
+ * A fixed amount of worker threads serve the command queues of all the
+ * controllers attached to it, instead of a thread per controller. Queues
+ * are served round-robin, one request at a time, so a busy controller does
+ * not starve the others, and a queue is never served by two workers at
+ * once, as each controller session only takes one request at a time.
+ * Queues capped to a maximum request rate are skipped until allowed.
+ * A single pool is shared by the IOC, created by qgateIOPoolConfig.
+ */
+class QgateIOPool {
+public:
+    QgateIOPool(int numWorkers);
+    void attach(QgateIOQueue &queue);
+    void detach(QgateIOQueue &queue);
+    void notify();
+    void report();
+    void workerThread();
+public:
+    static bool configure(int numWorkers);
+    static QgateIOPool* getShared();
+private:
+    //Queue served by the pool
+    struct Entry {
+        QgateIOQueue *queue;
+        bool busy;          //Being served by a worker
+    };
+private:
+    epicsMutex poolMutex;   //Protects the list of queues
+    epicsEvent workEvent;   //Signalled when there could be work to do
+    std::vector<Entry> queues;
+    size_t nextQueue;       //Queue to look at first, for round-robin
+    int numWorkers;
+private:
+    static QgateIOPool *shared;
+};
+
+#endif //QGATENPCpool_H_
@@ -0,0 +1,378 @@
+#include <stdio.h>
+
+#include <TakeLock.h>
+
+#include "queensgateNPCcontroller.hpp"
+#include "queensgateNPCaxis.hpp"
+#include "queensgateNPCprofile.hpp"
+
+#define QGATE_PROFILE_CHECK_DELAY (0.001)   //Time between in-position checks, in secs
+
+static void profileThreadC(void *pPvt) {
+    QgateProfile *pProfile = (QgateProfile*)pPvt;
+    pProfile->profileThread();
+}
+
+/** Profile moves of a controller.
+  * \param[in] controller Controller object, with the profile already initialised */
+QgateProfile::QgateProfile(QgateController &controller)
+    : ctrler(controller)
+    , built(false)
+    , running(false)
+    , aborted(false)
+    , exiting(false)
+{
+    threadName = ctrler.nameCtrl + "_PROFILE";
+    epicsThreadCreate(threadName.c_str(),
+                    epicsThreadPriorityMedium,
+                    epicsThreadGetStackSize(epicsThreadStackMedium),
+                    (EPICSTHREADFUNC)profileThreadC, this);
+}
+
+QgateProfile::~QgateProfile() {
+    exiting = true;
+    aborted = true;
+    abortEvent.signal();
+    executeEvent.signal();
+    exitEvent.wait();
+}
+
+/** Builds the profile: fills the point times and checks it can be executed.
+  * Called with the lock taken.
+  * \return error if the profile is not valid */
+asynStatus QgateProfile::build() {
+    int status = PROFILE_STATUS_SUCCESS;
+    const char *message = "";
+    int numPoints = 0;
+    int numMoved = 0;
+
+    ctrler.setIntegerParam(ctrler.profileBuildState_, PROFILE_BUILD_BUSY);
+    ctrler.setIntegerParam(ctrler.profileBuildStatus_, PROFILE_STATUS_UNDEFINED);
+    ctrler.callParamCallbacks();
+    built = false;
+
+    ctrler.asynMotorController::buildProfile();     //Point times for the fixed time mode
+    ctrler.getIntegerParam(ctrler.profileNumPoints_, &numPoints);
+    if(running) {
+        status = PROFILE_STATUS_FAILURE;
+        message = "Profile being executed";
+    } else if(numPoints < 1 || (size_t)numPoints > ctrler.maxProfilePoints_) {
+        status = PROFILE_STATUS_FAILURE;
+        message = "Invalid number of points";
+    } else {
+        for(int i=0; i<numPoints; i++) {
+            if(ctrler.profileTimes_[i] < 0.0) {
+                status = PROFILE_STATUS_FAILURE;
+                message = "Negative point time";
+            }
+        }
+        for(int i=0; i<ctrler.numAxes; i++) {
+            QgateAxis* pAxis = ctrler.getQgateAxis(i);
+            int useAxis = 0;
+            ctrler.getIntegerParam(i, ctrler.profileUseAxis_, &useAxis);
+            if(pAxis && useAxis && pAxis->isProfileMovable()) {
+                numMoved++;
+            }
+        }
+        if(status == PROFILE_STATUS_SUCCESS && numMoved == 0) {
+            status = PROFILE_STATUS_FAILURE;
+            message = "No connected stage in use";
+        }
+    }
+    built = (status == PROFILE_STATUS_SUCCESS);
+    ctrler.setIntegerParam(ctrler.profileBuildState_, PROFILE_BUILD_DONE);
+    ctrler.setIntegerParam(ctrler.profileBuildStatus_, status);
+    ctrler.setStringParam(ctrler.profileBuildMessage_, message);
+    ctrler.callParamCallbacks();
+    return (built)? asynSuccess : asynError;
+}
+
+/** Starts executing the profile on the profile thread. Called with the lock taken.
+  * \return error if not built or already being executed */
+asynStatus QgateProfile::execute() {
+    const char *message = NULL;
+    if(!built) {
+        message = "Profile not built";
+    } else if(running) {
+        message = "Profile being executed";
+    }
+    if(message != NULL) {
+        ctrler.setIntegerParam(ctrler.profileExecuteStatus_, PROFILE_STATUS_FAILURE);
+        ctrler.setStringParam(ctrler.profileExecuteMessage_, message);
+        ctrler.callParamCallbacks();
+        return asynError;
+    }
+    ctrler.setIntegerParam(ctrler.profileExecuteState_, PROFILE_EXECUTE_MOVE_START);
+    ctrler.setIntegerParam(ctrler.profileExecuteStatus_, PROFILE_STATUS_UNDEFINED);
+    ctrler.setStringParam(ctrler.profileExecuteMessage_, "");
+    ctrler.setIntegerParam(ctrler.profileCurrentPoint_, 0);
+    ctrler.callParamCallbacks();
+    aborted = false;
+    abortEvent.tryWait();   //Discard any previous abort
+    running = true;
+    executeEvent.signal();
+    return asynSuccess;
+}
+
+/** Aborts the profile being executed, if any. Called with the lock taken. */
+asynStatus QgateProfile::abort() {
+    if(running) {
+        aborted = true;
+        abortEvent.signal();
+    }
+    return asynSuccess;
+}
+
+/** Publishes the positions and times captured by the last profile executed.
+  * Called with the lock taken.
+  * \return error if the profile is still being executed */
+asynStatus QgateProfile::readback() {
+    int status = PROFILE_STATUS_SUCCESS;
+    const char *message = "";
+    int numReadbacks = 0;
+
+    ctrler.setIntegerParam(ctrler.profileReadbackState_, PROFILE_READBACK_BUSY);
+    ctrler.setIntegerParam(ctrler.profileReadbackStatus_, PROFILE_STATUS_UNDEFINED);
+    ctrler.callParamCallbacks();
+    if(running) {
+        status = PROFILE_STATUS_FAILURE;
+        message = "Profile being executed";
+    } else {
+        //Axes publish their readbacks and following errors
+        ctrler.asynMotorController::readbackProfile();
+        ctrler.getIntegerParam(ctrler.profileNumReadbacks_, &numReadbacks);
+        if(numReadbacks > 0 && (size_t)numReadbacks <= captureTimes.size()) {
+            ctrler.doCallbacksFloat64Array(&captureTimes[0], numReadbacks, ctrler.QG_CtrlProfileTimes, 0);
+        }
+    }
+    ctrler.setIntegerParam(ctrler.profileReadbackState_, PROFILE_READBACK_DONE);
+    ctrler.setIntegerParam(ctrler.profileReadbackStatus_, status);
+    ctrler.setStringParam(ctrler.profileReadbackMessage_, message);
+    ctrler.callParamCallbacks();
+    return (status == PROFILE_STATUS_SUCCESS)? asynSuccess : asynError;
+}
+
+/** Profile thread: executes the profile every time it is requested */
+void QgateProfile::profileThread() {
+    while(!exiting) {
+        executeEvent.wait();
+        if(exiting) {
+            break;
+        }
+        if(running) {
+            run();
+        }
+    }
+    exitEvent.signal();
+}
+
+/** Takes a copy of the profile to be executed, so it runs without the lock taken.
+  * \param[out] numPoints Amount of profile points
+  * \param[out] pointTimeout Maximum time to reach each point (secs)
+  * \return false if no stage to move */
+bool QgateProfile::prepare(int &numPoints, double &pointTimeout) {
+    bool anyMoved = false;
+    TakeLock takeLock(&ctrler);     //Parameter callbacks done when released
+    ctrler.getIntegerParam(ctrler.profileNumPoints_, &numPoints);
+    ctrler.getDoubleParam(ctrler.QG_CtrlProfileTimeout, &pointTimeout);
+    pointTimes.assign(ctrler.profileTimes_, ctrler.profileTimes_ + numPoints);
+    captureTimes.assign(numPoints, 0.0);
+    axes.clear();
+    for(int i=0; i<ctrler.numAxes; i++) {
+        QgateAxis* pAxis = ctrler.getQgateAxis(i);
+        int useAxis = 0;
+        ctrler.getIntegerParam(i, ctrler.profileUseAxis_, &useAxis);
+        if(pAxis == NULL || !useAxis) {
+            continue;
+        }
+        ProfileAxis profileAxis;
+        profileAxis.axis = pAxis;
+        profileAxis.move = pAxis->isProfileMovable();
+        if(profileAxis.move) {
+            pAxis->getProfilePositions(profileAxis.positions, numPoints);
+            anyMoved = true;
+        }
+        axes.push_back(profileAxis);
+    }
+    captured.assign(axes.size(), 0.0);
+    ctrler.setIntegerParam(ctrler.profileExecuteState_, PROFILE_EXECUTE_EXECUTING);
+    return anyMoved;
+}
+
+/** Executes the profile: moves through all the points, capturing the positions at each one */
+void QgateProfile::run() {
+    int numPoints = 0;
+    double pointTimeout = 0.0;
+    if(!prepare(numPoints, pointTimeout)) {
+        finish(0, PROFILE_STATUS_FAILURE, "No connected stage in use");
+        return;
+    }
+    ctrler.wakeupPoller();      //Axes' readbacks follow the profile
+
+    WAITRESULT result = WAIT_DONE;
+    epicsTimeStamp startTime, pointStart, now;
+    epicsTimeGetCurrent(&startTime);
+    int point = 0;
+    for(point=0; point<numPoints && result==WAIT_DONE; point++) {
+        epicsTimeGetCurrent(&pointStart);
+        result = moveTo(point, pointTimeout);
+        if(result == WAIT_DONE) {
+            //Stay at the point for its time at least
+            epicsTimeGetCurrent(&now);
+            double remaining = pointTimes[point] - epicsTimeDiffInSeconds(&now, &pointStart);
+            if(remaining > 0.0 && abortEvent.wait(remaining)) {
+                result = WAIT_ABORTED;
+            }
+        }
+        if(result == WAIT_DONE) {
+            result = capture(point, startTime);
+        }
+    }
+
+    char message[QG_CMD_STRLEN];
+    switch(result) {
+        case WAIT_DONE:
+            finish(numPoints, PROFILE_STATUS_SUCCESS, "");
+            break;
+        case WAIT_ABORTED:
+            finish(point - 1, PROFILE_STATUS_ABORT, "Profile aborted");
+            break;
+        case WAIT_TIMEOUT:
+            snprintf(message, QG_CMD_STRLEN, "Timeout reaching point %d", point);
+            finish(point - 1, PROFILE_STATUS_TIMEOUT, message);
+            break;
+        case WAIT_FAILED:
+            snprintf(message, QG_CMD_STRLEN, "Failed to communicate at point %d", point);
+            finish(point - 1, PROFILE_STATUS_FAILURE, message);
+            break;
+    }
+}
+
+/** Commands all the moved axes to a profile point in one go and waits for them to reach it.
+  * \param[in] point Profile point [0..n-1]
+  * \param[in] pointTimeout Maximum time to reach the point (secs)
+  * \return WAIT_DONE when all of them are in position */
+QgateProfile::WAITRESULT QgateProfile::moveTo(int point, double pointTimeout) {
+    QgateRequest *request = ctrler.ioQueue.acquire();
+    for(size_t i=0; i<axes.size(); i++) {
+        if(axes[i].move) {
+            axes[i].axis->appendMove(request->command, axes[i].positions[point]);
+        }
+    }
+    request->type = QgateController::requestType(request->command);
+    DllAdapterStatus result = ctrler.ioQueue.execute(*request, QgateIOQueue::PRIORITY_HIGH);
+    if(result != DLL_ADAPTER_STATUS_SUCCESS) {
+        asynPrint(ctrler.pasynUserSelf, ASYN_TRACE_ERROR, "Controller %s profile point %d failed move %d: %s --> %s\n",
+                    ctrler.nameCtrl.c_str(), point, result, request->errorText.c_str(), request->command.c_str());
+        ctrler.ioQueue.release(request);
+        return WAIT_FAILED;
+    }
+
+    epicsTimeStamp started, sampled;
+    epicsTimeGetCurrent(&started);
+    WAITRESULT waitResult = WAIT_DONE;
+    while(true) {
+        bool inPosition = false;
+        if(aborted) {
+            waitResult = WAIT_ABORTED;
+            break;
+        }
+        if(!checkPosition(*request, inPosition, sampled)) {
+            waitResult = WAIT_FAILED;
+            break;
+        }
+        if(inPosition) {
+            break;
+        }
+        if(epicsTimeDiffInSeconds(&sampled, &started) > pointTimeout) {
+            waitResult = WAIT_TIMEOUT;
+            break;
+        }
+        if(abortEvent.wait(QGATE_PROFILE_CHECK_DELAY)) {
+            waitResult = WAIT_ABORTED;
+            break;
+        }
+    }
+    ctrler.ioQueue.release(request);
+    return waitResult;
+}
+
+/** Captures the measured positions at a profile point, for the readback.
+  * \param[in] point Profile point [0..n-1]
+  * \param[in] startTime Time the profile started
+  * \return WAIT_DONE when captured */
+QgateProfile::WAITRESULT QgateProfile::capture(int point, const epicsTimeStamp &startTime) {
+    bool inPosition = false;
+    epicsTimeStamp sampled;
+    QgateRequest *request = ctrler.ioQueue.acquire();
+    bool success = checkPosition(*request, inPosition, sampled);
+    ctrler.ioQueue.release(request);
+    if(!success) {
+        return WAIT_FAILED;
+    }
+
+    TakeLock takeLock(&ctrler);     //Parameter callbacks done when released
+    for(size_t i=0; i<axes.size(); i++) {
+        axes[i].axis->setProfileReadback(point, captured[i]);
+    }
+    captureTimes[point] = epicsTimeDiffInSeconds(&sampled, &startTime);
+    ctrler.setIntegerParam(ctrler.profileCurrentPoint_, point + 1);
+    return WAIT_DONE;
+}
+
+/** Reads the in-position status and measured position of all the axes in use,
+  * in a single request. Positions are kept on captured.
+  * \param[in,out] request Request to use
+  * \param[out] inPosition true if all the stages in use are in position
+  * \param[out] sampled Time the positions were taken, half-way through the request
+  * \return false if failed to communicate or the reply could not be decoded */
+bool QgateProfile::checkPosition(QgateRequest &request, bool &inPosition, epicsTimeStamp &sampled) {
+    size_t numReplies = 0;
+    request.command.clear();
+    for(size_t i=0; i<axes.size(); i++) {
+        numReplies += axes[i].axis->buildInPositionRequest(request.command);
+    }
+    request.type = QgateController::requestType(request.command);
+    epicsTimeStamp sent, received;
+    epicsTimeGetCurrent(&sent);
+    DllAdapterStatus result = ctrler.ioQueue.execute(request, QgateIOQueue::PRIORITY_HIGH);
+    epicsTimeGetCurrent(&received);
+    if(result != DLL_ADAPTER_STATUS_SUCCESS || request.reply.size() < numReplies) {
+        asynPrint(ctrler.pasynUserSelf, ASYN_TRACE_ERROR, "Controller %s profile failed in-position check %d: %s\n",
+                    ctrler.nameCtrl.c_str(), result, request.errorText.c_str());
+        return false;
+    }
+    sampled = sent;
+    epicsTimeAddSeconds(&sampled, epicsTimeDiffInSeconds(&received, &sent) / 2.0);
+    size_t index = 0;
+    inPosition = true;
+    for(size_t i=0; i<axes.size(); i++) {
+        bool axisInPosition = false;
+        if(!axes[i].axis->processInPositionReply(request.reply, index, axisInPosition, captured[i])) {
+            return false;
+        }
+        inPosition = inPosition && axisInPosition;
+    }
+    return true;
+}
+
+/** Ends the profile execution and reports its outcome. Stages are stopped when not completed.
+  * \param[in] numCaptured Amount of points captured
+  * \param[in] status Outcome, as ProfileStatus
+  * \param[in] message Outcome description */
+void QgateProfile::finish(int numCaptured, int status, const char *message) {
+    TakeLock takeLock(&ctrler);     //Parameter callbacks done when released
+    if(status != PROFILE_STATUS_SUCCESS) {
+        for(size_t i=0; i<axes.size(); i++) {
+            if(axes[i].move) {
+                axes[i].axis->stop(0.0);
+            }
+        }
+    }
+    running = false;
+    ctrler.setIntegerParam(ctrler.profileNumReadbacks_, (numCaptured > 0)? numCaptured : 0);
+    ctrler.setIntegerParam(ctrler.profileExecuteState_, PROFILE_EXECUTE_DONE);
+    ctrler.setIntegerParam(ctrler.profileExecuteStatus_, status);
+    ctrler.setStringParam(ctrler.profileExecuteMessage_, message);
+    ctrler.wakeupPoller();
+}
@@ -0,0 +1,72 @@
+#ifndef QGATENPCprofile_H_
+#define QGATENPCprofile_H_
+
+#include <string>
+#include <vector>
+
+#include <asynDriver.h>
+#include <epicsEvent.h>
+#include <epicsThread.h>
+#include <epicsTime.h>
+
+class QgateController;
+class QgateAxis;
+class QgateRequest;
+
+/* Profile (trajectory) moves, through the asynMotorController profile API.
+ * A profile thread steps the axes in use through their position table: on
+ * each point all of them are commanded at once, then their in-position
+ * status is checked (as each axis mode configures it) until they all reach
+ * it, or the point timeout expires. Once there and at least the point time
+ * has passed, the measured positions of the axes in use (sensors included)
+ * and the time since the profile started are captured for the readback.
+ * Every check is a single multi-line request for all the axes, sent
+ * through the controller's I/O queue without taking the controller lock.
+ */
+class QgateProfile {
+public:
+    QgateProfile(QgateController &controller);
+    virtual ~QgateProfile();
+    asynStatus build();
+    asynStatus execute();
+    asynStatus abort();
+    asynStatus readback();
+    void profileThread();
+private:
+    //Axis taking part on the profile being executed
+    struct ProfileAxis {
+        QgateAxis *axis;
+        bool move;          //Stage moved by the profile, or only read back
+        std::vector<double> positions;  //Position table (picometres)
+    };
+    //Outcome of waiting for a profile point
+    enum WAITRESULT {
+        WAIT_DONE = 0,
+        WAIT_ABORTED,
+        WAIT_FAILED,
+        WAIT_TIMEOUT
+    };
+private:
+    bool prepare(int &numPoints, double &pointTimeout);
+    void run();
+    WAITRESULT moveTo(int point, double pointTimeout);
+    WAITRESULT capture(int point, const epicsTimeStamp &startTime);
+    bool checkPosition(QgateRequest &request, bool &inPosition, epicsTimeStamp &sampled);
+    void finish(int numCaptured, int status, const char *message);
+private:
+    QgateController &ctrler;
+    std::string threadName;
+    std::vector<ProfileAxis> axes;  //Axes in use, only used by the profile thread
+    std::vector<double> pointTimes; //Time of each point (secs)
+    std::vector<double> captureTimes;   //Capture time of each point since started (secs)
+    std::vector<double> captured;       //Measured positions of the axes in use, by the profile thread
+    bool built;             //Profile built successfully
+    bool running;           //Profile being executed
+    bool aborted;           //Abort requested
+    epicsEvent executeEvent;    //Signalled to execute the profile, or when exiting
+    epicsEvent abortEvent;      //Signalled when aborted, to stop waiting
+    epicsEvent exitEvent;       //Signalled when the profile thread ends
+    bool exiting;
+};
+
+#endif //QGATENPCprofile_H_
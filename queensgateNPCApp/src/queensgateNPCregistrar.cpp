@@ -6,6 +6,7 @@
 
 #include "queensgateNPCcontroller.hpp"
 #include "queensgateNPCaxis.hpp"
+#include "queensgateNPCpool.hpp"
 
 /* The following functions have C linkage and can be called directly or from iocsh */
 extern "C" {
@@ -16,14 +17,21 @@ extern "C" {
  * \param[in] numAxes Number of configured axes
  * \param[in] movingPollPeriod The period at which to poll position while moving, in seconds
  * \param[in] idlePollPeriod The period at which to poll position while not moving, in seconds
- * \param[in] libPath Full file name and path to the Queensgate controller library
+ * \param[in] libPath Full file name and path to the Queensgate controller library,
+ *              or "emu:<options>" for the controller emulator (see queensgateNPCemulator.hpp)
+ * \param[in] identityCache Optional directory where the controller identity is cached, so it can be
+ *              published straight away on IOC start and only verified once the controller connects
+ * \param[in] sharedIO Non-zero to be served by the shared I/O pool (see qgateIOPoolConfig) instead
+ *              of a dedicated I/O thread
  */
 asynStatus qgateControllerConfig(const char* ctrlName, 
                                 const char* lowlevelPortAddress,
                                 const int maxNumAxes,
                                 const double movingPollPeriod, 
                                 const double idlePollPeriod, 
-                                const char* libPath) {
+                                const char* libPath,
+                                const char* identityCache,
+                                const int sharedIO) {
     //NOTE: For using serial comms to Ethernet Terminal Servers, the Queensgate SDK library might need to 
     // run first on the IOC server a socat connection to link serial comms to an Ethernet Terminal Server. 
     // For example, a /tmp/vmodem0 connecting to port 17 of terminal server 172.23.112.6:
@@ -32,7 +40,7 @@ asynStatus qgateControllerConfig(const char* ctrlName,
     //      t = qg.OpenSession("/tmp/vmodem0")
       
     new QgateController(ctrlName, lowlevelPortAddress, maxNumAxes, 
-                        movingPollPeriod, idlePollPeriod, libPath);
+                        movingPollPeriod, idlePollPeriod, libPath, identityCache, (sharedIO != 0));
 
     return asynSuccess;
 }
@@ -63,6 +71,175 @@ asynStatus qgateAxisConfig(const char* ctrlName,
     return result;
 }
 
+/** Configure the buffered acquisition of a sensor axis
+ * \param[in] ctlrName Asyn port name of the controller
+ * \param[in] axisNum The number of the sensor axis
+ * \param[in] blockSize Amount of samples published at once on the waveforms
+ * \param[in] bufferSize Amount of samples kept on the ring buffer
+ */
+asynStatus qgateSensorConfig(const char* ctrlName, 
+                            unsigned int axisNum, 
+                            unsigned int blockSize,
+                            unsigned int bufferSize) {
+    //Find controller
+    QgateController* ctrl = (QgateController*)findAsynPortDriver(ctrlName);
+    if(ctrl == NULL) {
+        printf("queensgateNPC: Sensor %d could not find NPC controller object '%s'\n", 
+                axisNum, ctrlName);
+        return asynError;
+    }
+    QgateAxis* axis = (QgateAxis*)ctrl->getAxis(axisNum-1);
+    if(axis == NULL || !axis->configAcquisition(blockSize, bufferSize)) {
+        printf("queensgateNPC: Sensor %d not configured on '%s' or not a sensor\n", 
+                axisNum, ctrlName);
+        return asynError;
+    }
+    return asynSuccess;
+}
+
+/** Configure the flight capture of a stage axis: its position trace during every move
+ * \param[in] ctlrName Asyn port name of the controller
+ * \param[in] axisNum The number of the stage axis
+ * \param[in] maxSamples Maximum amount of samples of a move trace
+ */
+asynStatus qgateFlightConfig(const char* ctrlName, 
+                            unsigned int axisNum, 
+                            unsigned int maxSamples) {
+    //Find controller
+    QgateController* ctrl = (QgateController*)findAsynPortDriver(ctrlName);
+    if(ctrl == NULL) {
+        printf("queensgateNPC: Axis %d could not find NPC controller object '%s'\n", 
+                axisNum, ctrlName);
+        return asynError;
+    }
+    QgateAxis* axis = (QgateAxis*)ctrl->getAxis(axisNum-1);
+    if(axis == NULL || !axis->configFlightCapture(maxSamples)) {
+        printf("queensgateNPC: Axis %d not configured on '%s', already capturing, or a sensor\n", 
+                axisNum, ctrlName);
+        return asynError;
+    }
+    return asynSuccess;
+}
+
+/** Configure a closed-loop feedback commanding a stage axis from the measured position of a
+ * sensor axis, at a fixed rate. The loop is enabled and tuned through the parameters of the stage axis.
+ * \param[in] ctlrName Asyn port name of the stage controller
+ * \param[in] axisNum The number of the stage axis
+ * \param[in] sensorCtrlName Asyn port name of the sensor controller, may be the stage one
+ * \param[in] sensorNum The number of the sensor axis
+ * \param[in] periodsec Loop period (secs)
+ */
+asynStatus qgateFeedbackConfig(const char* ctrlName, 
+                            unsigned int axisNum, 
+                            const char* sensorCtrlName,
+                            unsigned int sensorNum,
+                            double periodsec) {
+    //Find controllers
+    QgateController* ctrl = (QgateController*)findAsynPortDriver(ctrlName);
+    QgateController* sensorCtrl = (QgateController*)findAsynPortDriver(sensorCtrlName);
+    if(ctrl == NULL || sensorCtrl == NULL) {
+        printf("queensgateNPC: Feedback could not find NPC controller objects '%s' and '%s'\n", 
+                ctrlName, (sensorCtrlName)? sensorCtrlName : "");
+        return asynError;
+    }
+    QgateAxis* axis = (QgateAxis*)ctrl->getAxis(axisNum-1);
+    if(sensorCtrl->getAxis(sensorNum-1) == NULL || periodsec <= 0.0) {
+        printf("queensgateNPC: Feedback sensor %d not configured on '%s' or invalid period %f\n", 
+                sensorNum, sensorCtrlName, periodsec);
+        return asynError;
+    }
+    if(axis == NULL || !axis->configFeedback(*sensorCtrl, sensorNum, periodsec)) {
+        printf("queensgateNPC: Axis %d not configured on '%s', already with feedback, or a sensor\n", 
+                axisNum, ctrlName);
+        return asynError;
+    }
+    return asynSuccess;
+}
+
+/** Create a named group of axes whose moves are deferred and sent together,
+ * independently of the motor records' deferred moves. To be called before iocInit.
+ * \param[in] ctlrName Asyn port name of the controller
+ * \param[in] groupName Name of the group, used on its parameter names
+ * \param[in] axisList Axis numbers of the group, separated by commas (e.g. "1,2,3")
+ */
+asynStatus qgateMoveGroupConfig(const char* ctrlName, 
+                            const char* groupName,
+                            const char* axisList) {
+    //Find controller
+    QgateController* ctrl = (QgateController*)findAsynPortDriver(ctrlName);
+    if(ctrl == NULL) {
+        printf("queensgateNPC: Move group could not find NPC controller object '%s'\n", ctrlName);
+        return asynError;
+    }
+    if(ctrl->configMoveGroup(groupName, axisList) != asynSuccess) {
+        printf("queensgateNPC: Move group '%s' (%s) not valid on '%s': repeated, too many groups, or axes already grouped\n", 
+                (groupName)? groupName : "", (axisList)? axisList : "", ctrlName);
+        return asynError;
+    }
+    return asynSuccess;
+}
+
+/** Enable the profile moves of a controller. To be called once all its axes are configured.
+ * \param[in] ctlrName Asyn port name of the controller
+ * \param[in] maxPoints Maximum amount of points of a profile
+ */
+asynStatus qgateProfileConfig(const char* ctrlName, 
+                            unsigned int maxPoints) {
+    //Find controller
+    QgateController* ctrl = (QgateController*)findAsynPortDriver(ctrlName);
+    if(ctrl == NULL) {
+        printf("queensgateNPC: Profile could not find NPC controller object '%s'\n", ctrlName);
+        return asynError;
+    }
+    if(ctrl->configProfile(maxPoints) != asynSuccess) {
+        printf("queensgateNPC: Profile already configured on '%s' or invalid amount of points %u\n", 
+                ctrlName, maxPoints);
+        return asynError;
+    }
+    return asynSuccess;
+}
+
+/** Export the live state of the axes of a controller through POSIX shared memory,
+ * as laid out on queensgateNPCshm.h. To be called once all its axes are configured.
+ * \param[in] ctlrName Asyn port name of the controller
+ */
+asynStatus qgateShmConfig(const char* ctrlName) {
+    //Find controller
+    QgateController* ctrl = (QgateController*)findAsynPortDriver(ctrlName);
+    if(ctrl == NULL) {
+        printf("queensgateNPC: Shared memory could not find NPC controller object '%s'\n", ctrlName);
+        return asynError;
+    }
+    if(ctrl->configSharedMemory() != asynSuccess) {
+        printf("queensgateNPC: Shared memory already configured on '%s' or not created\n", ctrlName);
+        return asynError;
+    }
+    return asynSuccess;
+}
+
+/** Create the I/O thread pool shared by the controllers configured with sharedIO,
+ * instead of a thread per controller. To be called before those controllers are created.
+ * \param[in] numWorkers Amount of worker threads
+ */
+asynStatus qgateIOPoolConfig(int numWorkers) {
+    if(!QgateIOPool::configure(numWorkers)) {
+        printf("queensgateNPC: I/O pool already configured or invalid amount of workers %d\n", numWorkers);
+        return asynError;
+    }
+    return asynSuccess;
+}
+
+/** Print the link usage of the controllers served by the shared I/O pool */
+asynStatus qgateIOPoolReport() {
+    QgateIOPool *pool = QgateIOPool::getShared();
+    if(pool == NULL) {
+        printf("queensgateNPC: no I/O pool configured\n");
+        return asynError;
+    }
+    pool->report();
+    return asynSuccess;
+}
+
 } /* end extern "C" */
 
 static const iocshArg qgateCtrlConfig_Arg0 = { "name", iocshArgString };
@@ -71,18 +248,22 @@ static const iocshArg qgateCtrlConfig_Arg2 = { "numAxes", iocshArgInt };
 static const iocshArg qgateCtrlConfig_Arg3 = { "fastPollPeriodsec", iocshArgDouble };
 static const iocshArg qgateCtrlConfig_Arg4 = { "slowPollPeriodsec", iocshArgDouble };
 static const iocshArg qgateCtrlConfig_Arg5 = { "libPath", iocshArgString };
+static const iocshArg qgateCtrlConfig_Arg6 = { "identityCache", iocshArgString };
+static const iocshArg qgateCtrlConfig_Arg7 = { "sharedIO", iocshArgInt };
 static const iocshArg * const qgateCtrlConfig_Args[] = { &qgateCtrlConfig_Arg0, 
                                                         &qgateCtrlConfig_Arg1, 
                                                         &qgateCtrlConfig_Arg2, 
                                                         &qgateCtrlConfig_Arg3, 
                                                         &qgateCtrlConfig_Arg4, 
-                                                        &qgateCtrlConfig_Arg5 
+                                                        &qgateCtrlConfig_Arg5, 
+                                                        &qgateCtrlConfig_Arg6, 
+                                                        &qgateCtrlConfig_Arg7 
                                                         };
-static const iocshFuncDef qgateCtrlConfig_FuncDef = { "qgateCtrlConfig", 6, qgateCtrlConfig_Args };
+static const iocshFuncDef qgateCtrlConfig_FuncDef = { "qgateCtrlConfig", 8, qgateCtrlConfig_Args };
 
 static void qgateCtrlConfig_CallFunc(const iocshArgBuf *args) {
     qgateControllerConfig(args[0].sval, args[1].sval, args[2].ival, 
-                            args[3].dval, args[4].dval, args[5].sval);
+                            args[3].dval, args[4].dval, args[5].sval, args[6].sval, args[7].ival);
 }
 
 static const iocshArg qgateAxisConfig_Arg0 = { "controller port name", iocshArgString };
@@ -102,11 +283,105 @@ static void qgateAxisConfig_CallFunc(const iocshArgBuf *args) {
                         args[3].ival, args[4].ival);
 }
 
+static const iocshArg qgateSensorConfig_Arg0 = { "controller port name", iocshArgString };
+static const iocshArg qgateSensorConfig_Arg1 = { "axis index number", iocshArgInt };
+static const iocshArg qgateSensorConfig_Arg2 = { "samples per block", iocshArgInt };
+static const iocshArg qgateSensorConfig_Arg3 = { "samples buffered", iocshArgInt };
+static const iocshArg * const qgateSensorConfig_Args[] = { &qgateSensorConfig_Arg0, 
+                                                        &qgateSensorConfig_Arg1, 
+                                                        &qgateSensorConfig_Arg2,
+                                                        &qgateSensorConfig_Arg3 };
+static const iocshFuncDef qgateSensorConfig_FuncDef = { "qgateSensorConfig", 4, qgateSensorConfig_Args };
+
+static void qgateSensorConfig_CallFunc(const iocshArgBuf *args) {
+    qgateSensorConfig(args[0].sval, args[1].ival, args[2].ival, args[3].ival);
+}
+
+static const iocshArg qgateFlightConfig_Arg0 = { "controller port name", iocshArgString };
+static const iocshArg qgateFlightConfig_Arg1 = { "axis index number", iocshArgInt };
+static const iocshArg qgateFlightConfig_Arg2 = { "max samples per move", iocshArgInt };
+static const iocshArg * const qgateFlightConfig_Args[] = { &qgateFlightConfig_Arg0, 
+                                                        &qgateFlightConfig_Arg1, 
+                                                        &qgateFlightConfig_Arg2 };
+static const iocshFuncDef qgateFlightConfig_FuncDef = { "qgateFlightConfig", 3, qgateFlightConfig_Args };
+
+static void qgateFlightConfig_CallFunc(const iocshArgBuf *args) {
+    qgateFlightConfig(args[0].sval, args[1].ival, args[2].ival);
+}
+
+static const iocshArg qgateMoveGroupConfig_Arg0 = { "controller port name", iocshArgString };
+static const iocshArg qgateMoveGroupConfig_Arg1 = { "group name", iocshArgString };
+static const iocshArg qgateMoveGroupConfig_Arg2 = { "axis numbers list", iocshArgString };
+static const iocshArg * const qgateMoveGroupConfig_Args[] = { &qgateMoveGroupConfig_Arg0, 
+                                                        &qgateMoveGroupConfig_Arg1, 
+                                                        &qgateMoveGroupConfig_Arg2 };
+static const iocshFuncDef qgateMoveGroupConfig_FuncDef = { "qgateMoveGroupConfig", 3, qgateMoveGroupConfig_Args };
+
+static void qgateMoveGroupConfig_CallFunc(const iocshArgBuf *args) {
+    qgateMoveGroupConfig(args[0].sval, args[1].sval, args[2].sval);
+}
+
+static const iocshArg qgateFeedbackConfig_Arg0 = { "controller port name", iocshArgString };
+static const iocshArg qgateFeedbackConfig_Arg1 = { "axis index number", iocshArgInt };
+static const iocshArg qgateFeedbackConfig_Arg2 = { "sensor controller port name", iocshArgString };
+static const iocshArg qgateFeedbackConfig_Arg3 = { "sensor index number", iocshArgInt };
+static const iocshArg qgateFeedbackConfig_Arg4 = { "loop period sec", iocshArgDouble };
+static const iocshArg * const qgateFeedbackConfig_Args[] = { &qgateFeedbackConfig_Arg0, 
+                                                        &qgateFeedbackConfig_Arg1, 
+                                                        &qgateFeedbackConfig_Arg2, 
+                                                        &qgateFeedbackConfig_Arg3, 
+                                                        &qgateFeedbackConfig_Arg4 };
+static const iocshFuncDef qgateFeedbackConfig_FuncDef = { "qgateFeedbackConfig", 5, qgateFeedbackConfig_Args };
+
+static void qgateFeedbackConfig_CallFunc(const iocshArgBuf *args) {
+    qgateFeedbackConfig(args[0].sval, args[1].ival, args[2].sval, args[3].ival, args[4].dval);
+}
+
+static const iocshArg qgateProfileConfig_Arg0 = { "controller port name", iocshArgString };
+static const iocshArg qgateProfileConfig_Arg1 = { "max profile points", iocshArgInt };
+static const iocshArg * const qgateProfileConfig_Args[] = { &qgateProfileConfig_Arg0, 
+                                                        &qgateProfileConfig_Arg1 };
+static const iocshFuncDef qgateProfileConfig_FuncDef = { "qgateProfileConfig", 2, qgateProfileConfig_Args };
+
+static void qgateProfileConfig_CallFunc(const iocshArgBuf *args) {
+    qgateProfileConfig(args[0].sval, args[1].ival);
+}
+
+static const iocshArg qgateShmConfig_Arg0 = { "controller port name", iocshArgString };
+static const iocshArg * const qgateShmConfig_Args[] = { &qgateShmConfig_Arg0 };
+static const iocshFuncDef qgateShmConfig_FuncDef = { "qgateShmConfig", 1, qgateShmConfig_Args };
+
+static void qgateShmConfig_CallFunc(const iocshArgBuf *args) {
+    qgateShmConfig(args[0].sval);
+}
+
+static const iocshArg qgateIOPoolConfig_Arg0 = { "number of workers", iocshArgInt };
+static const iocshArg * const qgateIOPoolConfig_Args[] = { &qgateIOPoolConfig_Arg0 };
+static const iocshFuncDef qgateIOPoolConfig_FuncDef = { "qgateIOPoolConfig", 1, qgateIOPoolConfig_Args };
+
+static void qgateIOPoolConfig_CallFunc(const iocshArgBuf *args) {
+    qgateIOPoolConfig(args[0].ival);
+}
+
+static const iocshFuncDef qgateIOPoolReport_FuncDef = { "qgateIOPoolReport", 0, NULL };
+
+static void qgateIOPoolReport_CallFunc(const iocshArgBuf *args) {
+    qgateIOPoolReport();
+}
+
 /* Export the interface function table to EPICS */
 static void npcRegistrar(void)
 {
     iocshRegister(&qgateCtrlConfig_FuncDef, qgateCtrlConfig_CallFunc);
     iocshRegister(&qgateAxisConfig_FuncDef, qgateAxisConfig_CallFunc);
+    iocshRegister(&qgateSensorConfig_FuncDef, qgateSensorConfig_CallFunc);
+    iocshRegister(&qgateFlightConfig_FuncDef, qgateFlightConfig_CallFunc);
+    iocshRegister(&qgateFeedbackConfig_FuncDef, qgateFeedbackConfig_CallFunc);
+    iocshRegister(&qgateMoveGroupConfig_FuncDef, qgateMoveGroupConfig_CallFunc);
+    iocshRegister(&qgateProfileConfig_FuncDef, qgateProfileConfig_CallFunc);
+    iocshRegister(&qgateShmConfig_FuncDef, qgateShmConfig_CallFunc);
+    iocshRegister(&qgateIOPoolConfig_FuncDef, qgateIOPoolConfig_CallFunc);
+    iocshRegister(&qgateIOPoolReport_FuncDef, qgateIOPoolReport_CallFunc);
 }
 epicsExportRegistrar(npcRegistrar);
 
@@ -0,0 +1,294 @@
+#include <string.h>
+#include <limits.h>
+#include <sstream>
+
+#include <epicsStdlib.h>
+
+#include "queensgateNPCreply.hpp"
+
+#define QGATE_REPLY_RESERVE (512)   //Initial reply buffer size, enough for a controller status reply
+
+QgateReply::QgateReply() {
+    buffer.reserve(QGATE_REPLY_RESERVE);
+    fields.reserve(QGATE_REPLY_RESERVE / 16);
+}
+
+/** Takes a DoCommand reply. Previous contents are discarded.
+  * \param[in] names Names list returned by DoCommand
+  * \param[in] values Values list returned by DoCommand */
+void QgateReply::assign(const QGList &names, const QGList &values) {
+    clear();
+    QGList::const_iterator itName = names.begin();
+    for(QGList::const_iterator itVal=values.begin(); itVal!=values.end(); ++itVal) {
+        Field field;
+        if(itName != names.end()) {
+            field.nameOffset = store(*itName);
+            ++itName;
+        } else {
+            field.nameOffset = store("");   //Unnamed value
+        }
+        field.valueOffset = store(*itVal);
+        field.valueLength = itVal->length();
+        fields.push_back(field);
+    }
+}
+
+/** Discards the reply contents, keeping the storage for the next reply */
+void QgateReply::clear() {
+    buffer.clear();
+    fields.clear();
+}
+
+/** Gets the name of a reply field.
+  * \param[in] index Position of the field in the reply
+  * \return name (e.g. "value"), empty if out of range */
+const char* QgateReply::name(size_t index) const {
+    if(index >= fields.size()) {
+        return "";
+    }
+    return &buffer[fields[index].nameOffset];
+}
+
+/** Gets the value of a reply field, as sent by the controller.
+  * \param[in] index Position of the field in the reply
+  * \return value text, empty if out of range */
+const char* QgateReply::value(size_t index) const {
+    if(index >= fields.size()) {
+        return "";
+    }
+    return &buffer[fields[index].valueOffset];
+}
+
+/** Gets the length of a reply field value.
+  * \param[in] index Position of the field in the reply
+  * \return value text length, 0 if out of range */
+size_t QgateReply::valueLength(size_t index) const {
+    if(index >= fields.size()) {
+        return 0;
+    }
+    return fields[index].valueLength;
+}
+
+/** Looks for a field by its name. Replies to a single command have a few fields
+  * only, e.g. (security,channels,status), so this is a short scan.
+  * \param[in] fieldName Name of the field to look for
+  * \param[in] from Position to start looking from, e.g. the first field of a command on a multi-line reply
+  * \return position of the field, NOTFOUND when not in the reply */
+int QgateReply::find(const char* fieldName, size_t from) const {
+    for(size_t i=from; i<fields.size(); i++) {
+        if(strcmp(&buffer[fields[i].nameOffset], fieldName) == 0) {
+            return static_cast<int>(i);
+        }
+    }
+    return NOTFOUND;
+}
+
+/** Gets a floating point reply value, e.g. a position.
+  * \param[in] index Position of the field in the reply
+  * \param[out] number Value converted
+  * \return false if out of range or not a number */
+bool QgateReply::getDouble(size_t index, double &number) const {
+    if(index >= fields.size()) {
+        return false;
+    }
+    return parseDouble(&buffer[fields[index].valueOffset], fields[index].valueLength, number);
+}
+
+/** Gets an integer reply value, e.g. a status flag.
+  * \param[in] index Position of the field in the reply
+  * \param[out] number Value converted
+  * \return false if out of range or not a number */
+bool QgateReply::getInt(size_t index, int &number) const {
+    if(index >= fields.size()) {
+        return false;
+    }
+    return parseInt(&buffer[fields[index].valueOffset], fields[index].valueLength, number);
+}
+
+/** Gets an hexadecimal reply value, e.g. the controller status word 0x0000.
+  * \param[in] index Position of the field in the reply
+  * \param[out] number Value converted
+  * \return false if out of range or not a number */
+bool QgateReply::getHex(size_t index, unsigned int &number) const {
+    if(index >= fields.size()) {
+        return false;
+    }
+    return parseHex(&buffer[fields[index].valueOffset], fields[index].valueLength, number);
+}
+
+/** Gets all the reply values.
+  * \return string containing all values separated by commas */
+std::string QgateReply::print() const {
+    std::ostringstream qgList;
+    for(size_t i=0; i<fields.size(); i++) {
+        qgList << &buffer[fields[i].valueOffset] << ",";
+    }
+    return qgList.str();
+}
+
+/** Appends a NUL-terminated text to the buffer.
+  * \param[in] text Text to store
+  * \return offset of the text in the buffer */
+size_t QgateReply::store(const std::string &text) {
+    size_t offset = buffer.size();
+    buffer.insert(buffer.end(), text.begin(), text.end());
+    buffer.push_back('\0');
+    return offset;
+}
+
+/** Converts a decimal number in fixed or scientific notation, e.g. "-3.900000000e+01".
+  * Numbers whose significant digits fit a 53-bit mantissa, scaled by up to 10^22
+  * (as the controller replies), are converted exactly without depending on the
+  * locale. Longer or larger ones are left to epicsStrtod.
+  * \param[in] text Text to convert
+  * \param[in] length Length of the text
+  * \param[out] number Value converted
+  * \return false if the whole text is not a number */
+bool QgateReply::parseDouble(const char* text, size_t length, double &number) {
+    //Powers of ten exactly representable as doubles
+    static const double exactPowers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const int maxExactPower = 22;
+    const unsigned long long maxExactMantissa = 1ULL << 53;
+    const char* p = text;
+    const char* end = text + length;
+    bool negative = false;
+    unsigned long long mantissa = 0;
+    int exponent = 0;           //Decimal exponent applied to the mantissa
+    int numDigits = 0;          //Digits seen on the mantissa, leading zeros included
+    int numSignificant = 0;     //Digits held by the mantissa, from the first non-zero one
+    bool truncated = false;     //Significant digits beyond the mantissa capacity
+    const int maxDigits = 19;   //Digits held by the mantissa without overflow
+
+    if(p < end && (*p == '-' || *p == '+')) {
+        negative = (*p == '-');
+        p++;
+    }
+    for(; p < end && *p >= '0' && *p <= '9'; p++, numDigits++) {
+        if(numSignificant == 0 && *p == '0') {
+            continue;           //Leading zero
+        }
+        if(numSignificant < maxDigits) {
+            mantissa = mantissa * 10 + (*p - '0');
+            numSignificant++;
+        } else {
+            exponent++;         //Not held: keep magnitude only
+            truncated |= (*p != '0');
+        }
+    }
+    if(p < end && *p == '.') {
+        for(p++; p < end && *p >= '0' && *p <= '9'; p++, numDigits++) {
+            if(numSignificant == 0 && *p == '0') {
+                exponent--;     //Leading zero after the point
+                continue;
+            }
+            if(numSignificant < maxDigits) {
+                mantissa = mantissa * 10 + (*p - '0');
+                numSignificant++;
+                exponent--;
+            } else {
+                truncated |= (*p != '0');
+            }
+        }
+    }
+    if(numDigits == 0) {
+        return false;
+    }
+    if(p < end && (*p == 'e' || *p == 'E')) {
+        int expValue = 0;
+        if(!parseInt(p + 1, end - (p + 1), expValue)) {
+            return false;
+        }
+        exponent += expValue;
+        p = end;
+    }
+    if(p != end) {
+        return false;
+    }
+    double result;
+    if(mantissa == 0) {
+        result = 0.0;
+    } else if(!truncated && mantissa <= maxExactMantissa && 
+                exponent >= -maxExactPower && exponent <= maxExactPower) {
+        //Both operands exact: a single correctly rounded operation
+        result = static_cast<double>(mantissa);
+        if(exponent < 0) {
+            result /= exactPowers[-exponent];
+        } else {
+            result *= exactPowers[exponent];
+        }
+    } else {
+        std::string copy(text, length);     //Syntax already checked
+        number = epicsStrtod(copy.c_str(), NULL);
+        return true;
+    }
+    number = negative ? -result : result;
+    return true;
+}
+
+/** Converts a decimal integer, e.g. "1" or "-12". Does not depend on the current locale.
+  * \param[in] text Text to convert
+  * \param[in] length Length of the text
+  * \param[out] number Value converted
+  * \return false if the whole text is not a number or it does not fit an int */
+bool QgateReply::parseInt(const char* text, size_t length, int &number) {
+    const char* p = text;
+    const char* end = text + length;
+    bool negative = false;
+    long long result = 0;
+
+    if(p < end && (*p == '-' || *p == '+')) {
+        negative = (*p == '-');
+        p++;
+    }
+    if(p == end) {
+        return false;
+    }
+    const long long limit = (negative)? -(long long)INT_MIN : INT_MAX;
+    for(; p < end; p++) {
+        if(*p < '0' || *p > '9') {
+            return false;
+        }
+        result = result * 10 + (*p - '0');
+        if(result > limit) {
+            return false;       //Overflow
+        }
+    }
+    number = static_cast<int>(negative ? -result : result);
+    return true;
+}
+
+/** Converts an hexadecimal number, e.g. "0x0000". Does not depend on the current locale.
+  * \param[in] text Text to convert, with or without "0x" prefix
+  * \param[in] length Length of the text
+  * \param[out] number Value converted
+  * \return false if the whole text is not a number */
+bool QgateReply::parseHex(const char* text, size_t length, unsigned int &number) {
+    const char* p = text;
+    const char* end = text + length;
+    unsigned int result = 0;
+
+    if(end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+        p += 2;
+    }
+    if(p == end || end - p > 8) {
+        return false;
+    }
+    for(; p < end; p++) {
+        unsigned int digit;
+        if(*p >= '0' && *p <= '9') {
+            digit = *p - '0';
+        } else if(*p >= 'a' && *p <= 'f') {
+            digit = *p - 'a' + 10;
+        } else if(*p >= 'A' && *p <= 'F') {
+            digit = *p - 'A' + 10;
+        } else {
+            return false;
+        }
+        result = (result << 4) | digit;
+    }
+    number = result;
+    return true;
+}
@@ -0,0 +1,55 @@
+#ifndef QGATENPCreply_H_
+#define QGATENPCreply_H_
+
+#include <string>
+#include <vector>
+#include <list>
+
+//DLL's DoCommand Result list, as filled by the Queensgate adapter
+class QGList : public std::list<std::string> {
+public:
+    QGList() {};
+};
+
+/* Controller reply decoder.
+ * Keeps the name/value pairs of a DoCommand reply in a single flat buffer,
+ * so they can be accessed by index without walking a list nor copying strings.
+ * The buffer keeps its capacity between replies: once it has grown to the
+ * size of the usual replies, decoding does not allocate memory.
+ * Numeric values are parsed locale-independently, as the controller always
+ * replies using '.' as decimal separator, e.g. (value)=(3.900000000e+01).
+ */
+class QgateReply {
+public:
+    enum {NOTFOUND=-1};
+public:
+    QgateReply();
+    void assign(const QGList &names, const QGList &values);
+    void clear();
+    size_t size() const { return fields.size(); }
+    const char* name(size_t index) const;
+    const char* value(size_t index) const;
+    size_t valueLength(size_t index) const;
+    int find(const char* fieldName, size_t from=0) const;
+    bool getDouble(size_t index, double &number) const;
+    bool getInt(size_t index, int &number) const;
+    bool getHex(size_t index, unsigned int &number) const;
+    std::string print() const;
+public:
+    /* Locale-independent number parsing */
+    static bool parseDouble(const char* text, size_t length, double &number);
+    static bool parseInt(const char* text, size_t length, int &number);
+    static bool parseHex(const char* text, size_t length, unsigned int &number);
+private:
+    struct Field {
+        size_t nameOffset;      //Offset of the name in the buffer
+        size_t valueOffset;     //Offset of the value in the buffer
+        size_t valueLength;     //Length of the value
+    };
+    std::vector<char> buffer;   //NUL-terminated names and values
+    std::vector<Field> fields;
+private:
+    size_t store(const std::string &text);
+};
+
+#endif //QGATENPCreply_H_
@@ -0,0 +1,159 @@
+#include <stdio.h>
+
+#include <epicsAtomic.h>
+#include <TakeLock.h>
+
+#include "queensgateNPCcontroller.hpp"
+#include "queensgateNPCsensor.hpp"
+
+#define QGATE_ACQ_RETRY_DELAY (1.0)     //Time to wait after a failed sample, in secs
+
+static void acqThreadC(void *pPvt) {
+    QgateSensorAcq *pAcq = (QgateSensorAcq*)pPvt;
+    pAcq->acqThread();
+}
+
+/** Buffered acquisition of a sensor axis.
+  * \param[in] controller Controller object
+  * \param[in] axisNumber Axis stage number [1..n]
+  * \param[in] blockSize Amount of samples published at once
+  * \param[in] bufferSize Amount of samples kept on the ring buffer, at least blockSize */
+QgateSensorAcq::QgateSensorAcq(QgateController &controller, int axisNumber, size_t blockSize, size_t bufferSize)
+    : ctrler(controller)
+    , axisNum(axisNumber)
+    , axisNo(axisNumber-1)
+    , blockSize((blockSize < 1)? 1 : blockSize)
+    , head(0)
+    , pending(0)
+    , sampleCount(0)
+    , latestPosition(0.0)
+    , latestUncertainty(0.0)
+    , latestValid(false)
+    , running(0)
+    , exiting(0)
+{
+    latestSampled.secPastEpoch = 0;
+    latestSampled.nsec = 0;
+    QgateCommandSet axisCmd(axisNumber);
+    measuredCmd = axisCmd[QGCMD_POS_MEASURED];
+    if(bufferSize < this->blockSize) {
+        bufferSize = this->blockSize;
+    }
+    positions.resize(bufferSize);
+    times.resize(bufferSize);
+    blockPositions.resize(this->blockSize);
+    blockTimes.resize(this->blockSize);
+
+    char name[QG_VALUE_STRLEN];
+    snprintf(name, QG_VALUE_STRLEN, "%s_ACQ%d", ctrler.nameCtrl.c_str(), axisNum);
+    threadName = name;
+    epicsThreadCreate(threadName.c_str(),
+                    epicsThreadPriorityMedium,
+                    epicsThreadGetStackSize(epicsThreadStackMedium),
+                    (EPICSTHREADFUNC)acqThreadC, this);
+}
+
+QgateSensorAcq::~QgateSensorAcq() {
+    epicsAtomicSetIntT(&exiting, 1);
+    runEvent.signal();
+    exitEvent.wait();
+}
+
+/** Starts or stops sampling.
+  * \param[in] enable true to start sampling */
+void QgateSensorAcq::setRunning(bool enable) {
+    epicsAtomicSetIntT(&running, enable);
+    if(enable) {
+        runEvent.signal();
+    } else {
+        TakeLock takeLock(&latestMutex);
+        latestValid = false;
+    }
+}
+
+/** Tells if the sensor is being sampled */
+bool QgateSensorAcq::isRunning() {
+    return epicsAtomicGetIntT(&running) != 0;
+}
+
+/** Gets the latest sample taken.
+  * \param[out] position Latest measured position (picometres)
+  * \param[out] sampled Time the sample was taken
+  * \param[out] uncertainty Half the round trip of the sample (secs)
+  * \return false if no recent sample available */
+bool QgateSensorAcq::getLatest(double &position, epicsTimeStamp &sampled, double &uncertainty) {
+    TakeLock takeLock(&latestMutex);
+    if(latestValid) {
+        position = latestPosition;
+        sampled = latestSampled;
+        uncertainty = latestUncertainty;
+    }
+    return latestValid;
+}
+
+/** Sampling thread: reads the measured position back-to-back while running */
+void QgateSensorAcq::acqThread() {
+    QgateRequest *request = ctrler.ioQueue.acquire();
+    request->axisNum = axisNum;
+    request->type = QGCMD_POS_MEASURED;
+    while(!epicsAtomicGetIntT(&exiting)) {
+        if(!epicsAtomicGetIntT(&running)) {
+            runEvent.wait();
+            pending = 0;    //Start a new block when restarted
+            continue;
+        }
+        double position = 0.0;
+        request->command.assign(measuredCmd);
+        DllAdapterStatus result = ctrler.ioQueue.execute(*request);
+        if(result != DLL_ADAPTER_STATUS_SUCCESS || !request->reply.getDouble(0, position)) {
+            {
+                TakeLock takeLock(&latestMutex);
+                latestValid = false;
+            }
+            epicsThreadSleep(QGATE_ACQ_RETRY_DELAY);
+            continue;
+        }
+        positions[head] = position;
+        times[head] = request->sampled;
+        head = (head + 1) % positions.size();
+        sampleCount++;
+        {
+            TakeLock takeLock(&latestMutex);
+            latestPosition = position;
+            latestSampled = request->sampled;
+            latestUncertainty = request->roundTrip / 2.0;
+            latestValid = true;
+        }
+        if(++pending >= blockSize) {
+            publish();
+            pending = 0;
+        }
+    }
+    ctrler.ioQueue.release(request);
+    exitEvent.signal();
+}
+
+/** Publishes the latest block of samples. Times are relative to the first sample of the block. */
+void QgateSensorAcq::publish() {
+    size_t bufferSize = positions.size();
+    size_t first = (head + bufferSize - blockSize) % bufferSize;
+    double sum = 0.0;
+    for(size_t i=0; i<blockSize; i++) {
+        size_t slot = (first + i) % bufferSize;
+        blockPositions[i] = positions[slot];
+        blockTimes[i] = epicsTimeDiffInSeconds(&times[slot], &times[first]);
+        sum += positions[slot];
+    }
+    double mean = sum / blockSize;
+    double rate = 0.0;
+    if(blockSize > 1 && blockTimes[blockSize-1] > 0.0) {
+        rate = (blockSize - 1) / blockTimes[blockSize-1];
+    }
+
+    TakeLock takeLock(&ctrler);     //Parameter callbacks done when released
+    ctrler.doCallbacksFloat64Array(&blockPositions[0], blockSize, ctrler.QG_AxisAcqPositions, axisNo);
+    ctrler.doCallbacksFloat64Array(&blockTimes[0], blockSize, ctrler.QG_AxisAcqTimes, axisNo);
+    ctrler.setDoubleParam(axisNo, ctrler.QG_AxisAcqMean, mean);
+    ctrler.setDoubleParam(axisNo, ctrler.QG_AxisAcqRate, rate);
+    ctrler.setIntegerParam(axisNo, ctrler.QG_AxisAcqCount, (int)sampleCount);
+}
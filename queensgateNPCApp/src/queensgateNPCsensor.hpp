@@ -0,0 +1,64 @@
+#ifndef QGATENPCsensor_H_
+#define QGATENPCsensor_H_
+
+#include <string>
+#include <vector>
+
+#include <epicsMutex.h>
+#include <epicsEvent.h>
+#include <epicsThread.h>
+#include <epicsTime.h>
+
+class QgateController;
+
+/* Buffered acquisition for sensor axes.
+ * A sampling thread reads the measured position back-to-back through the
+ * controller's I/O queue, instead of once per motor poll, and keeps the
+ * samples with their timestamp on a ring buffer. Samples are stamped as
+ * the I/O queue's replies: midpoint of the round trip, not counting the
+ * time spent queued. Every blockSize samples
+ * the latest block is published as waveforms (positions and times) and as
+ * decimated readbacks (mean and sampling rate).
+ * The sampling thread never takes the controller lock while sampling, only
+ * for publishing a block.
+ */
+class QgateSensorAcq {
+public:
+    QgateSensorAcq(QgateController &controller, int axisNumber, size_t blockSize, size_t bufferSize);
+    virtual ~QgateSensorAcq();
+    void setRunning(bool enable);
+    bool isRunning();
+    bool getLatest(double &position, epicsTimeStamp &sampled, double &uncertainty);
+    size_t getBlockSize() const { return blockSize; }
+    void acqThread();
+private:
+    void publish();
+private:
+    QgateController &ctrler;
+    int axisNum;                //Axis number [1..n]
+    int axisNo;                 //Axis index [0..n-1], as the asyn address
+    std::string measuredCmd;    //Measured position command for this axis
+    std::string threadName;
+    size_t blockSize;           //Samples per published block
+    /* Ring buffer, only used by the sampling thread */
+    std::vector<double> positions;
+    std::vector<epicsTimeStamp> times;
+    size_t head;                //Next slot to use on the ring buffer
+    size_t pending;             //Samples not published yet
+    unsigned long sampleCount;  //Samples taken since started
+    std::vector<double> blockPositions; //Block being published
+    std::vector<double> blockTimes;
+    /* Latest sample, protected by latestMutex */
+    epicsMutex latestMutex;
+    double latestPosition;
+    epicsTimeStamp latestSampled;   //Time the latest sample was taken
+    double latestUncertainty;   //Half the round trip of the latest sample (secs)
+    bool latestValid;
+    /* Thread control */
+    epicsEvent runEvent;        //Signalled when started or exiting
+    epicsEvent exitEvent;       //Signalled when the sampling thread ends
+    int running;                //Accessed atomically
+    int exiting;
+};
+
+#endif //QGATENPCsensor_H_
@@ -0,0 +1,60 @@
+#include <math.h>
+
+#include "queensgateNPCsettle.hpp"
+
+#define QG_SETTLE_BIN0      (1000.0)    //Upper limit of the first bin (picometres)
+#define QG_SETTLE_WEIGHT    (0.25)      //Weight of a new move on the averages
+
+QgateSettleModel::QgateSettleModel() {
+    reset();
+}
+
+/** Forgets all the moves learned */
+void QgateSettleModel::reset() {
+    for(size_t i=0; i<QG_SETTLE_NUMBINS; i++) {
+        mean[i] = 0.0;
+        deviation[i] = 0.0;
+        count[i] = 0;
+    }
+}
+
+/** Learns the settle time of a move.
+  * \param[in] step Step size of the move (picometres)
+  * \param[in] time Time from the start of the move to its completion (secs) */
+void QgateSettleModel::learn(double step, double time) {
+    size_t bin = binOf(step);
+    if(count[bin] == 0) {
+        mean[bin] = time;
+        deviation[bin] = 0.0;
+    } else {
+        deviation[bin] += QG_SETTLE_WEIGHT * (fabs(time - mean[bin]) - deviation[bin]);
+        mean[bin] += QG_SETTLE_WEIGHT * (time - mean[bin]);
+    }
+    count[bin]++;
+}
+
+/** Predicts the settle time of a move.
+  * \param[in] step Step size of the move (picometres)
+  * \param[out] time Expected time from the start of the move to its completion (secs)
+  * \param[out] deviation Expected deviation from it (secs)
+  * \return false if not enough moves of that size were learned */
+bool QgateSettleModel::predict(double step, double &time, double &deviation) const {
+    size_t bin = binOf(step);
+    if(count[bin] < QG_SETTLE_MINMOVES) {
+        return false;
+    }
+    time = mean[bin];
+    deviation = this->deviation[bin];
+    return true;
+}
+
+/** Finds the bin of a step size.
+  * \param[in] step Step size (picometres)
+  * \return bin index [0..QG_SETTLE_NUMBINS-1] */
+size_t QgateSettleModel::binOf(double step) {
+    size_t bin = 0;
+    for(double limit = QG_SETTLE_BIN0; step >= limit && bin < QG_SETTLE_NUMBINS - 1; limit *= 2.0) {
+        bin++;
+    }
+    return bin;
+}
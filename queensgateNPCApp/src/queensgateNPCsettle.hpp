@@ -0,0 +1,29 @@
+#ifndef QGATENPCsettle_H_
+#define QGATENPCsettle_H_
+
+#include <stddef.h>
+
+#define QG_SETTLE_NUMBINS   (16)        //Step size bins, doubling from 1 nm
+#define QG_SETTLE_MINMOVES  (3)         //Moves learned on a bin before predicting from it
+
+/* Move-to-settle time of a stage, learned from its past moves.
+ * Moves are classed by step size in bins doubling in size (the last one
+ * unbounded), and each bin keeps an exponentially weighted average of the
+ * time from the move start to its completion being reported, along with
+ * the average deviation from it.
+ */
+class QgateSettleModel {
+public:
+    QgateSettleModel();
+    void reset();
+    void learn(double step, double time);
+    bool predict(double step, double &time, double &deviation) const;
+private:
+    static size_t binOf(double step);
+private:
+    double mean[QG_SETTLE_NUMBINS];         //Average settle time (secs)
+    double deviation[QG_SETTLE_NUMBINS];    //Average absolute deviation (secs)
+    size_t count[QG_SETTLE_NUMBINS];        //Moves learned
+};
+
+#endif //QGATENPCsettle_H_
@@ -0,0 +1,97 @@
+/* Shared memory export of the live axis state of a Queensgate NPC controller.
+ *
+ * Created by qgateShmConfig for a controller, as the POSIX shared memory
+ * object QGATE_SHM_PREFIX followed by the controller port name (e.g.
+ * "/qgateNPC_NPC1"). It holds a header and a slot per axis, updated by the
+ * driver on every poll of the axis. Processes on the IOC host can map it
+ * read-only and take the latest state straight from memory:
+ *
+ *     int fd = shm_open("/qgateNPC_NPC1", O_RDONLY, 0);
+ *     void *base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+ *     qgateShmAxis state;
+ *     if(qgateShmReadAxis(QGATE_SHM_AXIS(base, 0), &state)) { ... }
+ *
+ * Each slot is protected by a sequence lock: the driver makes its sequence
+ * odd while writing the slot, and even again once written, so a reader
+ * only has to retry when the sequence was odd or changed while copying.
+ * Readers never block the driver.
+ */
+#ifndef QGATENPCshm_H_
+#define QGATENPCshm_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define QGATE_SHM_PREFIX        "/qgateNPC_"    /* Followed by the controller port name */
+#define QGATE_SHM_MAGIC         (0x5147504EU)   /* "QGPN" */
+#define QGATE_SHM_VERSION       (1)
+#define QGATE_SHM_SLOTSIZE      (64)            /* Header and axis slots size: a cache line each */
+
+/* Axis status flags */
+#define QGATE_SHM_CONNECTED     (0x01)  /* Stage connected, and its controller too */
+#define QGATE_SHM_MOVING        (0x02)  /* Moving, as configured by the axis mode */
+#define QGATE_SHM_SENSOR        (0x04)  /* Sensor axis: position only */
+#define QGATE_SHM_VALID         (0x08)  /* Position read at least once */
+
+/* Region header, at the start of the region */
+typedef struct qgateShmHeader {
+    uint32_t magic;             /* QGATE_SHM_MAGIC once initialised */
+    uint32_t version;           /* QGATE_SHM_VERSION */
+    uint32_t numAxes;           /* Axis slots following the header */
+    uint32_t slotSize;          /* Size of the header and of each axis slot (bytes) */
+    char name[32];              /* Controller port name */
+    uint8_t reserved[QGATE_SHM_SLOTSIZE - 48];
+} qgateShmHeader;
+
+/* Axis slot, axis index [0..n-1] */
+typedef struct qgateShmAxis {
+    volatile uint32_t sequence; /* Odd while being written */
+    uint32_t flags;             /* QGATE_SHM_* status flags */
+    double position;            /* Latest measured position (picometres) */
+    double uncertainty;         /* Uncertainty of the position time (secs) */
+    uint32_t secPastEpoch;      /* Time the position was sampled (EPICS epoch) */
+    uint32_t nsec;
+    uint64_t updates;           /* Times the slot was written */
+    uint8_t reserved[QGATE_SHM_SLOTSIZE - 40];
+} qgateShmAxis;
+
+/* Size of the region for an amount of axes */
+#define QGATE_SHM_SIZE(numAxes) (QGATE_SHM_SLOTSIZE * (1 + (size_t)(numAxes)))
+
+/* Slot of an axis, from the base address of the region */
+#define QGATE_SHM_AXIS(base, axisNo) \
+    ((const qgateShmAxis*)((const char*)(base) + QGATE_SHM_SLOTSIZE * (1 + (size_t)(axisNo))))
+
+/* Takes a consistent copy of an axis slot.
+ * Returns 0 if it was being written all the tries, 1 otherwise. */
+static inline int qgateShmReadAxis(const qgateShmAxis *slot, qgateShmAxis *copy) {
+    int tries;
+    for(tries = 0; tries < 1000; tries++) {
+        uint32_t before = slot->sequence;
+        if(before & 1) {
+            continue;   /* Being written */
+        }
+        __sync_synchronize();
+        copy->flags = slot->flags;
+        copy->position = slot->position;
+        copy->uncertainty = slot->uncertainty;
+        copy->secPastEpoch = slot->secPastEpoch;
+        copy->nsec = slot->nsec;
+        copy->updates = slot->updates;
+        __sync_synchronize();
+        if(slot->sequence == before) {
+            copy->sequence = before;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* QGATENPCshm_H_ */
@@ -0,0 +1,109 @@
+#include <math.h>
+
+#include <epicsAtomic.h>
+
+#include "queensgateNPCstats.hpp"
+
+/** Position samples ring.
+  * \param[in] capacity Minimum amount of samples held, rounded up to a power of 2 */
+QgateSampleRing::QgateSampleRing(size_t capacity)
+    : head(0)
+    , tail(0)
+    , dropped(0)
+{
+    size_t size = 2;
+    while(size < capacity) {
+        size <<= 1;
+    }
+    samples.resize(size);
+    mask = size - 1;
+}
+
+/** Adds a sample. To be called by the producer only.
+  * \param[in] position Measured position
+  * \param[in] time Time of the measurement
+  * \return false if the ring is full and the sample was dropped */
+bool QgateSampleRing::push(double position, const epicsTimeStamp &time) {
+    size_t currentHead = head;     //Only written by this side
+    if(currentHead - epicsAtomicGetSizeT(&tail) > mask) {
+        dropped++;
+        return false;   //Full
+    }
+    QgateSample &sample = samples[currentHead & mask];
+    sample.position = position;
+    sample.time = time;
+    epicsAtomicWriteMemoryBarrier();    //Sample stored before publishing it
+    epicsAtomicSetSizeT(&head, currentHead + 1);
+    return true;
+}
+
+/** Takes the oldest sample. To be called by the consumer only.
+  * \param[out] sample Oldest sample on the ring
+  * \return false if the ring is empty */
+bool QgateSampleRing::pop(QgateSample &sample) {
+    size_t currentTail = tail;     //Only written by this side
+    if(currentTail == epicsAtomicGetSizeT(&head)) {
+        return false;   //Empty
+    }
+    epicsAtomicReadMemoryBarrier();     //Sample read after seeing it published
+    sample = samples[currentTail & mask];
+    epicsAtomicSetSizeT(&tail, currentTail + 1);
+    return true;
+}
+
+/** Position statistics.
+  * \param[in] capacity Samples buffered between updates
+  * \param[in] maxSamples Max samples kept on the window, whatever its length */
+QgatePositionStats::QgatePositionStats(size_t capacity, size_t maxSamples)
+    : ring(capacity)
+    , maxWindow((maxSamples < 1)? 1 : maxSamples)
+{
+}
+
+/** Takes the new samples and computes the statistics over the latest window.
+  * To be called by the consumer only.
+  * \param[in] windowSec Length of the window, in seconds
+  * \param[out] result Statistics of the samples in the window
+  * \return false if there are no samples in the window */
+bool QgatePositionStats::update(double windowSec, QgatePositionStatsResult &result) {
+    QgateSample sample;
+    while(ring.pop(sample)) {
+        window.push_back(sample);
+        if(window.size() > maxWindow) {
+            window.pop_front();     //Memory bounded on long windows
+        }
+    }
+    //Discard the samples older than the window
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+    while(!window.empty() && epicsTimeDiffInSeconds(&now, &window.front().time) > windowSec) {
+        window.pop_front();
+    }
+
+    result.numSamples = window.size();
+    if(window.empty()) {
+        result.mean = result.stddev = result.min = result.max = result.peakToPeak = 0.0;
+        return false;
+    }
+    //Two passes: mean first, so the deviation does not lose precision on large positions
+    double sum = 0.0;
+    result.min = result.max = window.front().position;
+    for(std::deque<QgateSample>::const_iterator it=window.begin(); it!=window.end(); ++it) {
+        sum += it->position;
+        if(it->position < result.min) {
+            result.min = it->position;
+        }
+        if(it->position > result.max) {
+            result.max = it->position;
+        }
+    }
+    result.mean = sum / window.size();
+    double sumSq = 0.0;
+    for(std::deque<QgateSample>::const_iterator it=window.begin(); it!=window.end(); ++it) {
+        double deviation = it->position - result.mean;
+        sumSq += deviation * deviation;
+    }
+    result.stddev = (window.size() > 1)? sqrt(sumSq / (window.size() - 1)) : 0.0;
+    result.peakToPeak = result.max - result.min;
+    return true;
+}
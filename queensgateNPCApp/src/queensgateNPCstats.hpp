@@ -0,0 +1,62 @@
+#ifndef QGATENPCstats_H_
+#define QGATENPCstats_H_
+
+#include <vector>
+#include <deque>
+
+#include <epicsTime.h>
+
+#define QG_STATS_MAX_SAMPLES    (65536)     //Max samples kept on a statistics window
+
+//Timestamped position sample
+struct QgateSample {
+    double position;        //Measured position (picometres)
+    epicsTimeStamp time;    //Time of the measurement
+};
+
+/* Single-producer, single-consumer ring of position samples.
+ * The producer (the axis, on each position update) and the consumer (the
+ * statistics thread) never wait for each other: each one only writes its
+ * own index, so no lock is needed. When full, new samples are dropped.
+ */
+class QgateSampleRing {
+public:
+    QgateSampleRing(size_t capacity);
+    bool push(double position, const epicsTimeStamp &time);
+    bool pop(QgateSample &sample);
+    size_t getDropped() const { return dropped; }
+private:
+    std::vector<QgateSample> samples;
+    size_t mask;            //Capacity - 1, as capacity is a power of 2
+    size_t head;            //Next slot to write, only written by the producer
+    size_t tail;            //Next slot to read, only written by the consumer
+    size_t dropped;         //Samples dropped when full, only written by the producer
+};
+
+//Position statistics over a time window
+struct QgatePositionStatsResult {
+    double mean;
+    double stddev;
+    double min;
+    double max;
+    double peakToPeak;
+    size_t numSamples;      //Samples in the window
+};
+
+/* Position statistics over a sliding time window.
+ * Samples are added by the producer through the ring, and the window is
+ * only handled by the consumer on update(). The window keeps a bounded
+ * amount of samples: on long windows only the latest ones are used.
+ */
+class QgatePositionStats {
+public:
+    QgatePositionStats(size_t capacity=1024, size_t maxSamples=QG_STATS_MAX_SAMPLES);
+    bool add(double position, const epicsTimeStamp &time) { return ring.push(position, time); }
+    bool update(double windowSec, QgatePositionStatsResult &result);
+private:
+    QgateSampleRing ring;
+    std::deque<QgateSample> window;     //Samples within the window, oldest first
+    size_t maxWindow;                   //Max samples kept on the window
+};
+
+#endif //QGATENPCstats_H_